@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tsmux.h"
+#include "nalu.h"
+#include "simd.h"
+#include "flag.h"
+
+/*
+ ts打包的性能测试和输出检查，不上传。
+ 把demo的h264和aac切成帧，按时间戳交织以后反复喂给LinkTsMuxerContext，取最好的一次算每个ts包多少ns。
+ reserve是上传时用的路径(直接写到队列里)，vec是reserve不到内存时不拷贝es数据的路径。
+ --check时：
+   1. 每一帧分别用模板打包(LinkGetTemplatePESData/Vec)和原来的LinkGetPESData/Vec打包，逐字节比较
+   2. 两种路径输出的整个ts的crc32和包数要和kGoldenCrc/kGoldenPackets一样(默认素材，改了打包方式以后重新确认)
+ */
+
+#define VERSION "v1.0.0"
+
+#ifndef MUXBENCH_MATERIAL_DIR
+#define MUXBENCH_MATERIAL_DIR "material"
+#endif
+
+#define AAC_SAMPLE_RATE 16000
+#define VIDEO_FRAME_DURATION 40 //毫秒
+
+//默认素材用打包模板之前的LinkGetPESData输出的结果
+static const uint32_t kGoldenCrc = 0x2cb5dbc5;
+static const int kGoldenPackets = 26338;
+
+typedef struct {
+        uint8_t *pData;
+        int nLen;
+        int64_t nPts;
+        int nIsVideo;
+        int nIsKeyFrame;
+}Frame;
+
+typedef struct {
+        const char *pVFilePath;
+        const char *pAFilePath;
+        int nRuns;
+        bool IsCheck;
+}CmdArg;
+
+typedef struct {
+        uint8_t packet[188];
+        int64_t nPackets;
+        uint32_t nCrc;
+        int nWithCrc;
+}Output;
+
+static CmdArg cmdArg;
+
+static int readFileToBuf(const char * _pFilename, uint8_t ** _pBuf, int *_pLen)
+{
+        FILE * pFile = fopen(_pFilename, "rb");
+        if (pFile == NULL) {
+                fprintf(stderr, "open file %s fail\n", _pFilename);
+                return -1;
+        }
+        fseek(pFile, 0, SEEK_END);
+        int nLen = (int)ftell(pFile);
+        fseek(pFile, 0, SEEK_SET);
+
+        uint8_t *pData = malloc(nLen);
+        if (pData == NULL || fread(pData, 1, nLen, pFile) != (size_t)nLen) {
+                fprintf(stderr, "read file %s fail\n", _pFilename);
+                fclose(pFile);
+                free(pData);
+                return -2;
+        }
+        fclose(pFile);
+        *_pBuf = pData;
+        *_pLen = nLen;
+        return 0;
+}
+
+//sps/pps/sei和后面的slice算一帧，和test.c一样
+static int splitH264(uint8_t *_pData, int _nLen, Frame *_pFrames, int _nMax)
+{
+        const uint8_t *pEnd = _pData + _nLen;
+        const uint8_t *pStart = LinkFindStartCode(_pData, pEnd);
+        const uint8_t *pFrame = pStart;
+        int nIsKeyFrame = 0;
+        int nCount = 0;
+
+        while (pStart < pEnd && nCount < _nMax) {
+                const uint8_t *pNext = LinkFindStartCode(pStart + 3, pEnd);
+                int nType = (pStart[2] == 0x01 ? pStart[3] : pStart[4]) & 0x1F;
+                if (nType == 5) {
+                        nIsKeyFrame = 1;
+                }
+                if (nType == 1 || nType == 5) {
+                        _pFrames[nCount].pData = (uint8_t *)pFrame;
+                        _pFrames[nCount].nLen = pNext - pFrame;
+                        _pFrames[nCount].nPts = (int64_t)nCount * VIDEO_FRAME_DURATION;
+                        _pFrames[nCount].nIsVideo = 1;
+                        _pFrames[nCount].nIsKeyFrame = nIsKeyFrame;
+                        nCount++;
+                        nIsKeyFrame = 0;
+                        pFrame = pNext;
+                }
+                pStart = pNext;
+        }
+        return nCount;
+}
+
+static int splitAdts(uint8_t *_pData, int _nLen, Frame *_pFrames, int _nMax)
+{
+        int nOffset = 0;
+        int nCount = 0;
+        while (nOffset + 7 <= _nLen && nCount < _nMax) {
+                uint8_t *p = _pData + nOffset;
+                if (p[0] != 0xFF || (p[1] & 0xF0) != 0xF0) {
+                        break;
+                }
+                int nFrameLen = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+                if (nFrameLen < 7 || nOffset + nFrameLen > _nLen) {
+                        break;
+                }
+                _pFrames[nCount].pData = p;
+                _pFrames[nCount].nLen = nFrameLen;
+                _pFrames[nCount].nPts = (int64_t)nCount * 1024 * 1000 / AAC_SAMPLE_RATE;
+                _pFrames[nCount].nIsVideo = 0;
+                _pFrames[nCount].nIsKeyFrame = 0;
+                nCount++;
+                nOffset += nFrameLen;
+        }
+        return nCount;
+}
+
+static int cmpFramePts(const void *_pA, const void *_pB)
+{
+        const Frame *pA = (const Frame *)_pA;
+        const Frame *pB = (const Frame *)_pB;
+        if (pA->nPts != pB->nPts) {
+                return pA->nPts < pB->nPts ? -1 : 1;
+        }
+        //同一时间戳视频在前，qsort不稳定，再按地址排
+        if (pA->nIsVideo != pB->nIsVideo) {
+                return pB->nIsVideo - pA->nIsVideo;
+        }
+        return pA->pData < pB->pData ? -1 : 1;
+}
+
+static void addPacket(Output *_pOutput, const void *_pData, int _nLen)
+{
+        if (_pOutput->nWithCrc) {
+                _pOutput->nCrc = LinkSimdCrc32(_pOutput->nCrc, _pData, _nLen);
+        }
+        _pOutput->nPackets += _nLen / 188;
+}
+
+static int writePacket(void *_pOpaque, void *_pData, int _nLen)
+{
+        addPacket((Output *)_pOpaque, _pData, _nLen);
+        return _nLen;
+}
+
+static uint8_t * reservePacket(void *_pOpaque, int _nLen)
+{
+        Output *pOutput = (Output *)_pOpaque;
+        return _nLen <= (int)sizeof(pOutput->packet) ? pOutput->packet : NULL;
+}
+
+static int commitPacket(void *_pOpaque, int _nLen)
+{
+        Output *pOutput = (Output *)_pOpaque;
+        addPacket(pOutput, pOutput->packet, _nLen);
+        return _nLen;
+}
+
+static uint8_t * reserveNothing(void *_pOpaque, int _nLen)
+{
+        return NULL;
+}
+
+static int writePacketVec(void *_pOpaque, const struct iovec *_pVec, int _nVecCount)
+{
+        Output *pOutput = (Output *)_pOpaque;
+        int i = 0;
+        int nLen = 0;
+        for (i = 0; i < _nVecCount; i++) {
+                if (pOutput->nWithCrc) {
+                        pOutput->nCrc = LinkSimdCrc32(pOutput->nCrc, _pVec[i].iov_base, _pVec[i].iov_len);
+                }
+                nLen += _pVec[i].iov_len;
+        }
+        pOutput->nPackets += nLen / 188;
+        return nLen;
+}
+
+static int64_t getNanoSecond()
+{
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return (int64_t)tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static int muxAll(Frame *_pFrames, int _nCount, int _nIsVec, Output *_pOutput)
+{
+        LinkTsMuxerArg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.nAudioFormat = LINK_AUDIO_AAC;
+        arg.nAudioSampleRate = AAC_SAMPLE_RATE;
+        arg.nAudioChannels = 1;
+        arg.nVideoFormat = LINK_VIDEO_H264;
+        arg.output = writePacket;
+        arg.reserve = _nIsVec ? reserveNothing : reservePacket;
+        arg.commit = commitPacket;
+        arg.outputVec = _nIsVec ? writePacketVec : NULL;
+        arg.pOpaque = _pOutput;
+
+        LinkTsMuxerContext *pMuxerCtx = NULL;
+        int ret = LinkNewTsMuxerContext(&arg, &pMuxerCtx);
+        if (ret != 0) {
+                fprintf(stderr, "LinkNewTsMuxerContext fail:%d\n", ret);
+                return ret;
+        }
+
+        int i = 0;
+        for (i = 0; i < _nCount && ret >= 0; i++) {
+                Frame *pFrame = &_pFrames[i];
+                if (pFrame->nIsVideo) {
+                        ret = LinkMuxerVideo(pMuxerCtx, pFrame->pData, pFrame->nLen, pFrame->nPts, pFrame->nIsKeyFrame);
+                } else {
+                        ret = LinkMuxerAudio(pMuxerCtx, pFrame->pData, pFrame->nLen, pFrame->nPts);
+                }
+        }
+        if (ret >= 0) {
+                ret = LinkMuxerFlush(pMuxerCtx);
+        }
+        LinkDestroyTsMuxerContext(pMuxerCtx);
+        if (ret < 0) {
+                fprintf(stderr, "mux frame %d fail:%d\n", i - 1, ret);
+                return ret;
+        }
+        return 0;
+}
+
+static int bench(Frame *_pFrames, int _nCount, int _nIsVec)
+{
+        int64_t nBest = -1;
+        Output output;
+        int i = 0;
+        for (i = 0; i < cmdArg.nRuns; i++) {
+                memset(&output, 0, sizeof(output));
+                int64_t nStart = getNanoSecond();
+                if (muxAll(_pFrames, _nCount, _nIsVec, &output) != 0) {
+                        return -1;
+                }
+                int64_t nCost = getNanoSecond() - nStart;
+                if (nBest < 0 || nCost < nBest) {
+                        nBest = nCost;
+                }
+        }
+        printf("%-8s %d frames %lld packets, best of %d runs: %.1f ns/packet\n", _nIsVec ? "vec" : "reserve",
+               _nCount, (long long)output.nPackets, cmdArg.nRuns, (double)nBest / output.nPackets);
+        return 0;
+}
+
+static int comparePacket(const uint8_t *_pRef, const uint8_t *_pData, const struct iovec *_pVec, int _nFrame, int _nPacket)
+{
+        uint8_t packet[188];
+        if (_pVec) {
+                memcpy(packet, _pVec[0].iov_base, _pVec[0].iov_len);
+                memcpy(packet + _pVec[0].iov_len, _pVec[1].iov_base, _pVec[1].iov_len);
+                _pData = packet;
+        }
+        if (memcmp(_pRef, _pData, 188) != 0) {
+                fprintf(stderr, "frame %d packet %d differs from LinkGetPESData%s\n", _nFrame, _nPacket, _pVec ? "Vec" : "");
+                return -1;
+        }
+        return 0;
+}
+
+//模板打包和原来的LinkGetPESData/LinkGetPESDataVec逐包比较
+static int checkTemplate(Frame *_pFrames, int _nCount)
+{
+        LinkPESTemplate videoTemplate, audioTemplate, videoVecTemplate, audioVecTemplate;
+        LinkInitPESTemplate(&videoTemplate, LINK_VIDEO_PID, 0xE0, LINK_VIDEO_H264);
+        LinkInitPESTemplate(&audioTemplate, LINK_AUDIO_PID, 0xC0, (LinkVideoFormat)0);
+        videoVecTemplate = videoTemplate;
+        audioVecTemplate = audioTemplate;
+        int nVideoCounter = 0, nAudioCounter = 0;
+
+        uint8_t ref[188], data[188], header[188], refHeader[188];
+        struct iovec vec[2], refVec[2];
+        int64_t nPackets = 0;
+        int i = 0;
+        for (i = 0; i < _nCount; i++) {
+                Frame *pFrame = &_pFrames[i];
+                LinkPES refPes, pes, vecPes, refVecPes;
+                if (pFrame->nIsVideo) {
+                        if (pFrame->nIsKeyFrame) {
+                                LinkInitVideoPESWithPcr(&refPes, LINK_VIDEO_H264, pFrame->pData, pFrame->nLen, pFrame->nPts);
+                        } else {
+                                LinkInitVideoPES(&refPes, LINK_VIDEO_H264, pFrame->pData, pFrame->nLen, pFrame->nPts);
+                        }
+                        refPes.nWithoutAud = LinkIsAudPrefixed(LINK_VIDEO_H264, pFrame->pData, pFrame->nLen);
+                } else {
+                        LinkInitAudioPES(&refPes, pFrame->pData, pFrame->nLen, pFrame->nPts);
+                }
+                pes = vecPes = refVecPes = refPes;
+
+                int *pCounter = pFrame->nIsVideo ? &nVideoCounter : &nAudioCounter;
+                LinkPESTemplate *pTemplate = pFrame->nIsVideo ? &videoTemplate : &audioTemplate;
+                LinkPESTemplate *pVecTemplate = pFrame->nIsVideo ? &videoVecTemplate : &audioVecTemplate;
+                int nPid = pFrame->nIsVideo ? LINK_VIDEO_PID : LINK_AUDIO_PID;
+                int nPacket = 0;
+                while (LinkGetPESData(&refPes, *pCounter, nPid, ref, sizeof(ref)) > 0) {
+                        if (LinkGetPESDataVec(&refVecPes, *pCounter, nPid, refHeader, refVec) <= 0 ||
+                            comparePacket(ref, NULL, refVec, i, nPacket) != 0) {
+                                return -1;
+                        }
+                        *pCounter = (*pCounter + 1) & 0x0F;
+                        if (LinkGetTemplatePESData(pTemplate, &pes, data) <= 0 ||
+                            comparePacket(ref, data, NULL, i, nPacket) != 0) {
+                                return -1;
+                        }
+                        if (LinkGetTemplatePESDataVec(pVecTemplate, &vecPes, header, vec) <= 0 ||
+                            comparePacket(ref, NULL, vec, i, nPacket) != 0) {
+                                return -1;
+                        }
+                        nPacket++;
+                }
+                if (pes.nPos != pes.nESDataLen || vecPes.nPos != vecPes.nESDataLen) {
+                        fprintf(stderr, "frame %d: template path wrote more packets than LinkGetPESData\n", i);
+                        return -1;
+                }
+                nPackets += nPacket;
+        }
+        printf("template packetizer matches LinkGetPESData: %d frames %lld packets\n", _nCount, (long long)nPackets);
+        return 0;
+}
+
+static int checkGolden(Frame *_pFrames, int _nCount, int _nIsVec, int _nIsDefaultMaterial)
+{
+        Output output;
+        memset(&output, 0, sizeof(output));
+        output.nWithCrc = 1;
+        if (muxAll(_pFrames, _nCount, _nIsVec, &output) != 0) {
+                return -1;
+        }
+        printf("%-8s crc32:%08x packets:%lld\n", _nIsVec ? "vec" : "reserve", output.nCrc, (long long)output.nPackets);
+        if (_nIsDefaultMaterial && (output.nCrc != kGoldenCrc || output.nPackets != kGoldenPackets)) {
+                fprintf(stderr, "output differs from golden crc32:%08x packets:%d\n", kGoldenCrc, kGoldenPackets);
+                return -1;
+        }
+        return 0;
+}
+
+int main(int argc, const char** argv)
+{
+        cmdArg.pVFilePath = MUXBENCH_MATERIAL_DIR "/h265_aac_1_16000_h264.h264";
+        cmdArg.pAFilePath = MUXBENCH_MATERIAL_DIR "/h265_aac_1_16000_a.aac";
+        cmdArg.nRuns = 50;
+        flag_str(&cmdArg.pVFilePath, "vfpath", "h264 file. default demo material");
+        flag_str(&cmdArg.pAFilePath, "afpath", "aac(adts) file. default demo material");
+        flag_int(&cmdArg.nRuns, "runs", "bench runs, best one is reported. default 50");
+        flag_bool(&cmdArg.IsCheck, "check", "compare with LinkGetPESData and golden crc instead of bench");
+        flag_parse(argc, argv, VERSION);
+
+        int nIsDefaultMaterial = strcmp(cmdArg.pVFilePath, MUXBENCH_MATERIAL_DIR "/h265_aac_1_16000_h264.h264") == 0 &&
+                strcmp(cmdArg.pAFilePath, MUXBENCH_MATERIAL_DIR "/h265_aac_1_16000_a.aac") == 0;
+
+        uint8_t *pVideo = NULL, *pAudio = NULL;
+        int nVideoLen = 0, nAudioLen = 0;
+        if (readFileToBuf(cmdArg.pVFilePath, &pVideo, &nVideoLen) != 0 ||
+            readFileToBuf(cmdArg.pAFilePath, &pAudio, &nAudioLen) != 0) {
+                free(pVideo);
+                return 1;
+        }
+
+        //每帧至少一个start code或者一个adts头，不会超过这么多
+        int nMax = nVideoLen / 4 + nAudioLen / 7 + 2;
+        Frame *pFrames = malloc(sizeof(Frame) * nMax);
+        int nCount = splitH264(pVideo, nVideoLen, pFrames, nMax);
+        nCount += splitAdts(pAudio, nAudioLen, pFrames + nCount, nMax - nCount);
+        qsort(pFrames, nCount, sizeof(Frame), cmpFramePts);
+
+        int ret = 0;
+        if (cmdArg.IsCheck) {
+                if (checkTemplate(pFrames, nCount) != 0 ||
+                    checkGolden(pFrames, nCount, 0, nIsDefaultMaterial) != 0 ||
+                    checkGolden(pFrames, nCount, 1, nIsDefaultMaterial) != 0) {
+                        ret = 1;
+                }
+        } else {
+                if (bench(pFrames, nCount, 0) != 0 || bench(pFrames, nCount, 1) != 0) {
+                        ret = 1;
+                }
+        }
+
+        free(pFrames);
+        free(pVideo);
+        free(pAudio);
+        return ret;
+}
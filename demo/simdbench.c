@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simd.h"
+#include "flag.h"
+
+/*
+ simd.c的性能测试和正确性检查。
+ 用LinkSimdSetCpuFlagsMask依次只打开标量、SSE2、AVX2、PCLMUL、NEON、arm crc32，
+ start code查找和crc32都和逐字节的参考实现比较(--check)，或者测吞吐量(默认)。
+ cpu不支持的组合直接跳过。
+ */
+
+#define VERSION "v1.0.0"
+
+#ifndef SIMDBENCH_MATERIAL_DIR
+#define SIMDBENCH_MATERIAL_DIR "material"
+#endif
+
+#define CHECK_BUF_LEN 4096
+#define BENCH_BUF_LEN (1024 * 1024)
+
+typedef struct {
+        const char *pVFilePath;
+        int nRuns;
+        bool IsCheck;
+}CmdArg;
+
+typedef struct {
+        int nMask;
+        const char *pName;
+}KernelSet;
+
+static const KernelSet kKernelSets[] = {
+        {0, "scalar"},
+        {LINK_CPU_SSE2, "sse2"},
+        {LINK_CPU_SSE2 | LINK_CPU_AVX2, "avx2"},
+        {LINK_CPU_SSE2 | LINK_CPU_PCLMUL, "pclmul"},
+        {LINK_CPU_NEON, "neon"},
+        {LINK_CPU_CRC32, "armcrc32"},
+};
+
+static CmdArg cmdArg;
+static uint32_t nRandState = 1;
+
+static uint32_t nextRand()
+{
+        nRandState = nRandState * 1103515245 + 12345;
+        return nRandState >> 8;
+}
+
+static const uint8_t *refFindStartCode(const uint8_t *p, const uint8_t *pEnd)
+{
+        //和LinkSimdFindStartCode一样，start code后面至少要有一个字节
+        for (; pEnd - p >= 4; p++) {
+                if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+                        return p;
+        }
+        return pEnd;
+}
+
+static uint32_t refCrc32(uint32_t nCrc, const uint8_t *p, size_t nLen)
+{
+        nCrc = ~nCrc;
+        while (nLen--) {
+                nCrc ^= *p++;
+                int i = 0;
+                for (i = 0; i < 8; i++) {
+                        nCrc = (nCrc & 1) ? (0xEDB88320 ^ (nCrc >> 1)) : (nCrc >> 1);
+                }
+        }
+        return ~nCrc;
+}
+
+//0和1多一些，start code出现得足够密，也有连续很多0的情况
+static void fillStartCodeData(uint8_t *_pBuf, int _nLen)
+{
+        int i = 0;
+        for (i = 0; i < _nLen; i++) {
+                uint32_t r = nextRand();
+                switch (r % 8) {
+                case 0:
+                case 1:
+                case 2:
+                        _pBuf[i] = 0;
+                        break;
+                case 3:
+                        _pBuf[i] = 1;
+                        break;
+                default:
+                        _pBuf[i] = r >> 16;
+                        break;
+                }
+        }
+}
+
+static int isSupported(int _nMask)
+{
+        LinkSimdSetCpuFlagsMask(_nMask);
+        return LinkSimdGetCpuFlags() == _nMask;
+}
+
+//从每个位置开始一直找到结尾，每次找到的都要和参考实现一样
+static int checkStartCodeRange(const uint8_t *_pStart, const uint8_t *_pEnd)
+{
+        const uint8_t *p = _pStart;
+        while (1) {
+                const uint8_t *pRef = refFindStartCode(p, _pEnd);
+                const uint8_t *pOut = LinkSimdFindStartCode(p, _pEnd);
+                if (pOut != pRef) {
+                        fprintf(stderr, "start code: from %d len %d got %d expect %d\n", (int)(p - _pStart),
+                                (int)(_pEnd - p), (int)(pOut - _pStart), (int)(pRef - _pStart));
+                        return -1;
+                }
+                if (pRef == _pEnd) {
+                        return 0;
+                }
+                p = pRef + 1;
+        }
+}
+
+static int checkStartCode(const char *_pName)
+{
+        static uint8_t buf[CHECK_BUF_LEN + 64];
+        int nRound = 0, nOffset = 0, nLen = 0;
+        for (nRound = 0; nRound < 16; nRound++) {
+                fillStartCodeData(buf, sizeof(buf));
+                //不同对齐和长度，覆盖向量循环剩下的尾巴
+                for (nOffset = 0; nOffset < 32; nOffset++) {
+                        for (nLen = 0; nLen <= 128; nLen++) {
+                                if (checkStartCodeRange(buf + nOffset, buf + nOffset + nLen) != 0) {
+                                        return -1;
+                                }
+                        }
+                        nLen = nextRand() % CHECK_BUF_LEN;
+                        if (checkStartCodeRange(buf + nOffset, buf + nOffset + nLen) != 0) {
+                                return -1;
+                        }
+                }
+        }
+
+        //一整块没有0，再在每个位置放一个start code
+        memset(buf, 0xAA, sizeof(buf));
+        if (checkStartCodeRange(buf, buf + CHECK_BUF_LEN) != 0) {
+                return -1;
+        }
+        for (nOffset = 0; nOffset < 200; nOffset++) {
+                buf[nOffset] = 0;
+                buf[nOffset + 1] = 0;
+                buf[nOffset + 2] = 1;
+                if (checkStartCodeRange(buf, buf + 200) != 0) {
+                        return -1;
+                }
+                buf[nOffset] = buf[nOffset + 1] = buf[nOffset + 2] = 0xAA;
+        }
+        printf("%-8s start code ok\n", _pName);
+        return 0;
+}
+
+static int checkCrc32(const char *_pName)
+{
+        static uint8_t buf[CHECK_BUF_LEN];
+        int i = 0, nOffset = 0, nLen = 0;
+        for (i = 0; i < CHECK_BUF_LEN; i++) {
+                buf[i] = nextRand();
+        }
+
+        if (LinkSimdCrc32(0, "123456789", 9) != 0xCBF43926) {
+                fprintf(stderr, "crc32: check value %08x\n", LinkSimdCrc32(0, "123456789", 9));
+                return -1;
+        }
+        for (nOffset = 0; nOffset < 16; nOffset++) {
+                for (nLen = 0; nLen <= 300; nLen++) {
+                        uint32_t nCrc = LinkSimdCrc32(0, buf + nOffset, nLen);
+                        uint32_t nRef = refCrc32(0, buf + nOffset, nLen);
+                        if (nCrc != nRef) {
+                                fprintf(stderr, "crc32: offset %d len %d got %08x expect %08x\n", nOffset, nLen, nCrc, nRef);
+                                return -1;
+                        }
+                }
+        }
+
+        //分段算和一次算结果一样
+        uint32_t nRef = refCrc32(0, buf, CHECK_BUF_LEN);
+        for (i = 0; i < 64; i++) {
+                uint32_t nCrc = 0;
+                int nPos = 0;
+                while (nPos < CHECK_BUF_LEN) {
+                        nLen = nextRand() % 1024;
+                        if (nLen > CHECK_BUF_LEN - nPos) {
+                                nLen = CHECK_BUF_LEN - nPos;
+                        }
+                        nCrc = LinkSimdCrc32(nCrc, buf + nPos, nLen);
+                        nPos += nLen;
+                }
+                if (nCrc != nRef) {
+                        fprintf(stderr, "crc32: chained got %08x expect %08x\n", nCrc, nRef);
+                        return -1;
+                }
+        }
+        printf("%-8s crc32 ok\n", _pName);
+        return 0;
+}
+
+static int64_t getNanoSecond()
+{
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return (int64_t)tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static int countStartCodes(const uint8_t *_pData, int _nLen)
+{
+        const uint8_t *pEnd = _pData + _nLen;
+        const uint8_t *p = LinkSimdFindStartCode(_pData, pEnd);
+        int nCount = 0;
+        while (p < pEnd) {
+                nCount++;
+                p = LinkSimdFindStartCode(p + 3, pEnd);
+        }
+        return nCount;
+}
+
+//返回最好一次的MB/s
+static double benchStartCode(const uint8_t *_pData, int _nLen, int *_pCount)
+{
+        int64_t nBest = -1;
+        int i = 0;
+        for (i = 0; i < cmdArg.nRuns; i++) {
+                int64_t nStart = getNanoSecond();
+                *_pCount = countStartCodes(_pData, _nLen);
+                int64_t nCost = getNanoSecond() - nStart;
+                if (nBest < 0 || nCost < nBest) {
+                        nBest = nCost;
+                }
+        }
+        return (double)_nLen * 1000 / nBest;
+}
+
+static double benchCrc32(const uint8_t *_pData, int _nLen, int _nBlockLen, uint32_t *_pCrc)
+{
+        int64_t nBest = -1;
+        int i = 0;
+        for (i = 0; i < cmdArg.nRuns; i++) {
+                int64_t nStart = getNanoSecond();
+                uint32_t nCrc = 0;
+                int nPos = 0;
+                for (nPos = 0; nPos + _nBlockLen <= _nLen; nPos += _nBlockLen) {
+                        nCrc = LinkSimdCrc32(nCrc, _pData + nPos, _nBlockLen);
+                }
+                *_pCrc = nCrc;
+                int64_t nCost = getNanoSecond() - nStart;
+                if (nBest < 0 || nCost < nBest) {
+                        nBest = nCost;
+                }
+        }
+        return (double)_nLen * 1000 / nBest;
+}
+
+static int readFileToBuf(const char * _pFilename, uint8_t ** _pBuf, int *_pLen)
+{
+        FILE * pFile = fopen(_pFilename, "rb");
+        if (pFile == NULL) {
+                fprintf(stderr, "open file %s fail\n", _pFilename);
+                return -1;
+        }
+        fseek(pFile, 0, SEEK_END);
+        int nLen = (int)ftell(pFile);
+        fseek(pFile, 0, SEEK_SET);
+
+        uint8_t *pData = malloc(nLen);
+        if (pData == NULL || fread(pData, 1, nLen, pFile) != (size_t)nLen) {
+                fprintf(stderr, "read file %s fail\n", _pFilename);
+                fclose(pFile);
+                free(pData);
+                return -2;
+        }
+        fclose(pFile);
+        *_pBuf = pData;
+        *_pLen = nLen;
+        return 0;
+}
+
+static int bench()
+{
+        uint8_t *pVideo = NULL;
+        int nVideoLen = 0;
+        if (readFileToBuf(cmdArg.pVFilePath, &pVideo, &nVideoLen) != 0) {
+                return -1;
+        }
+        //没有0的数据测向量循环本身，随机数据测crc
+        uint8_t *pNoZero = malloc(BENCH_BUF_LEN);
+        uint8_t *pRandom = malloc(BENCH_BUF_LEN);
+        int i = 0;
+        for (i = 0; i < BENCH_BUF_LEN; i++) {
+                pNoZero[i] = 0xAA;
+                pRandom[i] = nextRand();
+        }
+
+        printf("%-8s %14s %14s %14s %14s   (MB/s, best of %d runs)\n", "", "startcode-h264", "startcode-no0",
+               "crc32-188B", "crc32-64KB", cmdArg.nRuns);
+        int nExpectCount = -1;
+        uint32_t nExpectCrc = 0;
+        unsigned int k = 0;
+        for (k = 0; k < sizeof(kKernelSets) / sizeof(kKernelSets[0]); k++) {
+                if (!isSupported(kKernelSets[k].nMask)) {
+                        continue;
+                }
+                int nCount = 0, nNoZeroCount = 0;
+                uint32_t nCrc188 = 0, nCrc64K = 0;
+                double fH264 = benchStartCode(pVideo, nVideoLen, &nCount);
+                double fNoZero = benchStartCode(pNoZero, BENCH_BUF_LEN, &nNoZeroCount);
+                double fCrc188 = benchCrc32(pRandom, BENCH_BUF_LEN, 188, &nCrc188);
+                double fCrc64K = benchCrc32(pRandom, BENCH_BUF_LEN, 65536, &nCrc64K);
+                printf("%-8s %14.0f %14.0f %14.0f %14.0f\n", kKernelSets[k].pName, fH264, fNoZero, fCrc188, fCrc64K);
+                //顺便确认每种实现算出来的一样
+                if (nExpectCount < 0) {
+                        nExpectCount = nCount;
+                        nExpectCrc = nCrc188;
+                } else if (nCount != nExpectCount || nCrc188 != nExpectCrc) {
+                        fprintf(stderr, "%s: %d start codes crc %08x, scalar %d crc %08x\n", kKernelSets[k].pName,
+                                nCount, nCrc188, nExpectCount, nExpectCrc);
+                }
+        }
+        LinkSimdSetCpuFlagsMask(~0);
+
+        free(pRandom);
+        free(pNoZero);
+        free(pVideo);
+        return 0;
+}
+
+int main(int argc, const char** argv)
+{
+        cmdArg.pVFilePath = SIMDBENCH_MATERIAL_DIR "/h265_aac_1_16000_h264.h264";
+        cmdArg.nRuns = 20;
+        flag_str(&cmdArg.pVFilePath, "vfpath", "h264 file for start code bench. default demo material");
+        flag_int(&cmdArg.nRuns, "runs", "bench runs, best one is reported. default 20");
+        flag_bool(&cmdArg.IsCheck, "check", "compare every kernel with the reference instead of bench");
+        flag_parse(argc, argv, VERSION);
+
+        int nDetected = LinkSimdGetCpuFlags();
+        printf("cpu flags:%x\n", nDetected);
+
+        if (!cmdArg.IsCheck) {
+                return bench() == 0 ? 0 : 1;
+        }
+
+        int ret = 0;
+        unsigned int k = 0;
+        for (k = 0; k < sizeof(kKernelSets) / sizeof(kKernelSets[0]); k++) {
+                if (!isSupported(kKernelSets[k].nMask)) {
+                        printf("%-8s not supported, skip\n", kKernelSets[k].pName);
+                        continue;
+                }
+                if (checkStartCode(kKernelSets[k].pName) != 0 || checkCrc32(kKernelSets[k].pName) != 0) {
+                        fprintf(stderr, "%s failed\n", kKernelSets[k].pName);
+                        ret = 1;
+                }
+        }
+        LinkSimdSetCpuFlagsMask(~0);
+        return ret;
+}
@@ -9,6 +9,7 @@
 #include "tsuploaderapi.h"
 #include "localkey.h"
 #include "adts.h"
+#include "nalu.h"
 #include "flag.h"
 
 typedef struct {
@@ -49,6 +50,7 @@ typedef struct {
         bool IsNoNet;
         bool IsQuit;
         bool IsDropFirstKeyFrame;
+        bool IsFmp4;
         int64_t nKeyFrameCount;
         int64_t nBaseAudioTime; //for loop test
         int64_t nBaseVideoTime; //for loop test
@@ -136,49 +138,6 @@ enum HevcType {
         HEVC_B =2
 };
 
-static const uint8_t *ff_avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
-{
-        const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-        
-        for (end -= 3; p < a && p < end; p++) {
-                if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-                        return p;
-        }
-        
-        for (end -= 3; p < end; p += 4) {
-                uint32_t x = *(const uint32_t*)p;
-                //      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-                //      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-                if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-                        if (p[1] == 0) {
-                                if (p[0] == 0 && p[2] == 1)
-                                        return p;
-                                if (p[2] == 0 && p[3] == 1)
-                                        return p+1;
-                        }
-                        if (p[3] == 0) {
-                                if (p[2] == 0 && p[4] == 1)
-                                        return p+2;
-                                if (p[4] == 0 && p[5] == 1)
-                                        return p+3;
-                        }
-                }
-        }
-        
-        for (end += 3; p < end; p++) {
-                if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-                        return p;
-        }
-        
-        return end + 3;
-}
-
-static const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end){
-        const uint8_t *out= ff_avc_find_startcode_internal(p, end);
-        if(p<out && out<end && !out[-1]) out--;
-        return out;
-}
-
 static inline int64_t getCurrentMilliSecond(){
         struct timeval tv;
         gettimeofday(&tv, NULL);
@@ -307,8 +266,8 @@ int start_file_test(char * _pAudioFile, char * _pVideoFile, DataCallback callbac
                         uint8_t * sendp = NULL;
                         int type = -1;
                         do{
-                                start = (uint8_t *)ff_avc_find_startcode((const uint8_t *)nextstart, (const uint8_t *)endptr);
-                                end = (uint8_t *)ff_avc_find_startcode(start+4, endptr);
+                                start = (uint8_t *)LinkFindStartCode((const uint8_t *)nextstart, (const uint8_t *)endptr);
+                                end = (uint8_t *)LinkFindStartCode(start+4, endptr);
                                 
                                 nextstart = end;
                                 if(sendp == NULL)
@@ -757,6 +716,7 @@ static void * second_test(void * opaque) {
         avuploader.userUploadArg.nUploaderBufferSize = cmdArg.nQbufSize;
         avuploader.userUploadArg.nNewSegmentInterval = cmdArg.nNewSetIntval;
         avuploader.userUploadArg.uploadZone_ = cmdArg.zone;
+        avuploader.userUploadArg.nContainerFormat = cmdArg.IsFmp4 ? LINK_CONTAINER_FMP4 : LINK_CONTAINER_TS;
         
         int ret = LinkCreateAndStartAVUploader(&avuploader.pTsMuxUploader, &avuploader.avArg, &avuploader.userUploadArg);
         if (ret != 0) {
@@ -841,6 +801,7 @@ int main(int argc, const char** argv)
         flag_int(&cmdArg.nLoopSleeptime, "csleeptime", "next round sleeptime");
         flag_bool(&cmdArg.IsNoNet, "nonet", "no network");
         flag_bool(&cmdArg.IsDropFirstKeyFrame, "drop_first_keyframe", "drop first keyframe");
+        flag_bool(&cmdArg.IsFmp4, "fmp4", "upload fmp4(init.mp4 and .m4s) instead of ts");
 
         flag_parse(argc, argv, VERSION);
         if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "-help") == 0)) {
@@ -973,6 +934,7 @@ int main(int argc, const char** argv)
         avuploader.userUploadArg.nUploaderBufferSize = cmdArg.nQbufSize;
         avuploader.userUploadArg.nNewSegmentInterval = cmdArg.nNewSetIntval;
         avuploader.userUploadArg.uploadZone_ = cmdArg.zone;
+        avuploader.userUploadArg.nContainerFormat = cmdArg.IsFmp4 ? LINK_CONTAINER_FMP4 : LINK_CONTAINER_TS;
         
         ret = LinkCreateAndStartAVUploader(&avuploader.pTsMuxUploader, &avuploader.avArg, &avuploader.userUploadArg);
         if (ret != 0) {
@@ -111,3 +111,9 @@ void LinkConvertAdtsHeader2Char(const LinkADTSFixheader *_pFixedHeader, const Li
     pHeader[5] = (value >> 8) & 0xff;
     pHeader[6] = (value) & 0xff;
 }
+
+void LinkSetAdtsFrameLength(unsigned char *pHeader, int nFrameLength) {
+    pHeader[3] = (pHeader[3] & 0xfc) | ((nFrameLength >> 11) & 0x03);
+    pHeader[4] = (nFrameLength >> 3) & 0xff;
+    pHeader[5] = (pHeader[5] & 0x1f) | ((nFrameLength & 0x07) << 5);
+}
@@ -40,4 +40,7 @@ extern void LinkConvertAdtsHeader2Int64(const LinkADTSFixheader *pFixedHeader, c
 // 7 byte adts convert to char[7]
 extern void LinkConvertAdtsHeader2Char(const LinkADTSFixheader *pFixedHeader, const LinkADTSVariableHeader *pVarHeader, unsigned char *pData);
 
+// 只改char[7]里的aac_frame_length(包括头)，其他字段每帧都一样，可以预先生成
+extern void LinkSetAdtsFrameLength(unsigned char *pData, int nFrameLength);
+
 #endif
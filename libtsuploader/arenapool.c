@@ -0,0 +1,128 @@
+#include "arenapool.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "base.h"
+#include "log.h"
+
+#define LINK_ARENA_DEFAULT_CACHE 2
+
+typedef struct _Arena Arena;
+typedef struct _Arena {
+        Arena *pNext;
+        int nSize;
+        int64_t nReserved; //保证后面的内存8字节对齐
+}Arena;
+
+typedef struct _ArenaPool {
+        pthread_mutex_t mutex_;
+        Arena *pFree_;
+        int nFreeCount_;
+        int nOutstanding_;
+        int nMaxCount_;
+}ArenaPool;
+
+static ArenaPool pool = {
+        .mutex_ = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void freeArenaList(Arena *pArena)
+{
+        while (pArena) {
+                Arena *pNext = pArena->pNext;
+                free(pArena);
+                pArena = pNext;
+        }
+}
+
+void LinkSetArenaPoolLimit(int _nMaxCount)
+{
+        pthread_mutex_lock(&pool.mutex_);
+        pool.nMaxCount_ = _nMaxCount > 0 ? _nMaxCount : 0;
+        pthread_mutex_unlock(&pool.mutex_);
+}
+
+void * LinkGetArena(int _nSize)
+{
+        Arena *pArena = NULL;
+
+        pthread_mutex_lock(&pool.mutex_);
+        if (pool.nMaxCount_ > 0 && pool.nOutstanding_ >= pool.nMaxCount_) {
+                pthread_mutex_unlock(&pool.mutex_);
+                LinkLogWarn("arena pool reach limit:%d", pool.nMaxCount_);
+                return NULL;
+        }
+        Arena **ppArena = &pool.pFree_;
+        while (*ppArena) {
+                if ((*ppArena)->nSize == _nSize) {
+                        pArena = *ppArena;
+                        *ppArena = pArena->pNext;
+                        pool.nFreeCount_--;
+                        break;
+                }
+                ppArena = &(*ppArena)->pNext;
+        }
+        //没有这个大小的就新分配，其他大小的留着给别的上传实例(buffer大小不同，或者多节目ts)用。
+        //大小改了以后旧的不会再被借走，还回来的时候会先被淘汰
+        pool.nOutstanding_++;
+        pthread_mutex_unlock(&pool.mutex_);
+
+        if (pArena == NULL) {
+                pArena = (Arena *)malloc(sizeof(Arena) + _nSize);
+                if (pArena == NULL) {
+                        pthread_mutex_lock(&pool.mutex_);
+                        pool.nOutstanding_--;
+                        pthread_mutex_unlock(&pool.mutex_);
+                        return NULL;
+                }
+                pArena->nSize = _nSize;
+        }
+        pArena->pNext = NULL;
+        return (char *)pArena + sizeof(Arena);
+}
+
+void LinkPutArena(void *_pArena)
+{
+        if (_pArena == NULL) {
+                return;
+        }
+        Arena *pArena = (Arena *)((char *)_pArena - sizeof(Arena));
+
+        pthread_mutex_lock(&pool.mutex_);
+        pool.nOutstanding_--;
+        //没设上限时每块借出去的可以对应缓存一块，多个上传实例同时在跑也够用
+        int nMaxCache = pool.nMaxCount_ > 0 ? pool.nMaxCount_ : LINK_ARENA_DEFAULT_CACHE;
+        if (pool.nMaxCount_ <= 0 && pool.nOutstanding_ > nMaxCache) {
+                nMaxCache = pool.nOutstanding_;
+        }
+        //链表头是最近还回来的，超过缓存个数时淘汰最久没用的(链表尾)
+        pArena->pNext = pool.pFree_;
+        pool.pFree_ = pArena;
+        pool.nFreeCount_++;
+        pArena = NULL;
+        if (pool.nFreeCount_ > nMaxCache) {
+                Arena **ppTail = &pool.pFree_;
+                while ((*ppTail)->pNext) {
+                        ppTail = &(*ppTail)->pNext;
+                }
+                pArena = *ppTail;
+                *ppTail = NULL;
+                pool.nFreeCount_--;
+        }
+        pthread_mutex_unlock(&pool.mutex_);
+
+        if (pArena) {
+                free(pArena);
+        }
+}
+
+void LinkCleanArenaPool()
+{
+        pthread_mutex_lock(&pool.mutex_);
+        Arena *pFree = pool.pFree_;
+        pool.pFree_ = NULL;
+        pool.nFreeCount_ = 0;
+        pthread_mutex_unlock(&pool.mutex_);
+
+        freeArenaList(pFree);
+}
@@ -0,0 +1,17 @@
+#ifndef __LINK_ARENA_POOL_H__
+#define __LINK_ARENA_POOL_H__
+
+/*
+ 进程内共享的队列内存池。每个分片都要创建一个上传队列，分片上传完后再释放。
+ 队列的内存从这里借，用完还回来，下一个分片直接复用，不用每个分片都malloc/free几M的内存
+ */
+
+//最多同时借出多少块，0表示不限制(默认)
+void LinkSetArenaPoolLimit(int nMaxCount);
+//返回NULL表示没有内存或者借出的已经达到上限
+void * LinkGetArena(int nSize);
+void LinkPutArena(void *pArena);
+//释放缓存的内存块，借出的不受影响
+void LinkCleanArenaPool();
+
+#endif
@@ -26,6 +26,11 @@ typedef enum _LinkUploadZone{
         LINK_ZONE_DONGNANYA = 5,
 }LinkUploadZone;
 
+typedef enum {
+        LINK_CONTAINER_TS = 0,
+        LINK_CONTAINER_FMP4 = 1 //init.mp4加.m4s分片，比ts少了每188字节4字节的包头和pes/adaptation填充
+}LinkContainerFormat;
+
 typedef struct _LinkUserUploadArg{
         char  *pToken_;
         int   nTokenLen_;
@@ -34,6 +39,10 @@ typedef struct _LinkUserUploadArg{
         int   nDeviceIdLen_;
         int   nUploaderBufferSize;
         int   nNewSegmentInterval;
+        LinkContainerFormat nContainerFormat; //0是ts
+        int   nWithMetadata; //不为0时ts里带一路id3 timed metadata流，用LinkPushMetadata把事件放到分片里
+        int   nInterleaveWindow; //毫秒，0不打开。音频一次来几百毫秒时ts里音视频按时间戳排序，要大于音频一次来的时长加200(建议700)。
+                                 //打开以后等着排序的帧要拷贝一次
 }LinkUserUploadArg;
 
 typedef enum {
@@ -47,6 +56,13 @@ typedef enum {
         LINK_AUDIO_AAC = 3
 }LinkAudioFormat;
 
+//上传线程都在忙的时候新分片怎么办
+typedef enum {
+        LINK_UPLOAD_BUSY_WAIT = 0, //排队等空闲的线程，排队的分片满了丢掉新分片。线程数跟着流数加，有上限。默认
+        LINK_UPLOAD_BUSY_DROP = 1, //直接丢掉新分片
+        LINK_UPLOAD_BUSY_SPAWN = 2 //创建上传实例(每个分片一个)时线程不够就加，线程数不限制
+}LinkUploadBusyPolicy;
+
 typedef enum {
         LINK_UPLOAD_INIT,
         LINK_UPLOAD_FAIL,
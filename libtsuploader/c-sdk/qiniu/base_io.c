@@ -28,6 +28,10 @@
 #define Qiniu_Posix_InvalidHandle -1
 #endif
 
+#ifdef QINIU_USE_LINK_SIMD
+#include "simd.h"
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY	0
 #endif
@@ -35,6 +39,15 @@
 /*============================================================================*/
 /* type Qiniu_Crc32 */
 
+#ifdef QINIU_USE_LINK_SIMD
+
+unsigned long Qiniu_Crc32_Update(unsigned long inCrc32, const void *buf, size_t bufLen)
+{
+	return LinkSimdCrc32((uint32_t)inCrc32, buf, bufLen);
+}
+
+#else
+
 static const unsigned long crcTable[256] =
 {
 	0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,
@@ -91,6 +104,8 @@ unsigned long Qiniu_Crc32_Update(unsigned long inCrc32, const void *buf, size_t
 	return crc32 ^ 0xFFFFFFFF;
 }
 
+#endif
+
 static size_t Qiniu_Crc32_Fwrite(const void* buf, size_t cbelem, size_t n, Qiniu_Crc32* self)
 {
 	self->val = Qiniu_Crc32_Update(self->val, buf, n);
@@ -0,0 +1,830 @@
+#include "fmp4mux.h"
+#include "base.h"
+#include "nalu.h"
+
+#define FMP4_VIDEO_TRACK_ID 1
+#define FMP4_AUDIO_TRACK_ID 2
+#define FMP4_VIDEO_TIMESCALE 90000
+#define FMP4_DEFAULT_VIDEO_DURATION 3600 //还不知道帧间隔的时候按25帧算
+
+#define FMP4_INIT_MAX (LINK_PARAM_SET_MAX + 2048)
+#define FMP4_HEADER_MAX 4096
+#define FMP4_MAX_PARAM_SET 8
+
+#define FMP4_MAX_VIDEO_SAMPLES 128
+#define FMP4_AUDIO_BUF_MAX 65536
+#define FMP4_MAX_AUDIO_SAMPLES 256
+#define FMP4_AUDIO_FLUSH_DURATION 1000 //毫秒。一直没有视频帧时音频单独输出
+
+#define FMP4_SAMPLE_FLAGS_SYNC     0x02000000 //sample_depends_on=2
+#define FMP4_SAMPLE_FLAGS_NON_SYNC 0x01010000 //sample_depends_on=1, sample_is_non_sync_sample=1
+
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+#define HEVC_NAL_AUD 35
+
+typedef struct _BoxWriter {
+        uint8_t *pBuf;
+        int nLen;
+        int nCap;
+        int nError;
+}BoxWriter;
+
+typedef struct _ParamSet {
+        const uint8_t *pData;
+        int nLen;
+}ParamSet;
+
+struct _LinkFmp4MuxerContext {
+        LinkTsMuxerArg arg;
+        int isInitWrited;
+        uint32_t nSequence;
+        uint8_t init[FMP4_INIT_MAX];
+        uint8_t header[FMP4_HEADER_MAX]; //styp，moof和mdat头
+        struct iovec vec[3];
+
+        //没有输出的视频帧，已经转成了长度前缀。遇到关键帧或者够了nFragmentDuration输出一个moof
+        uint8_t *pVideoBuf;
+        int nVideoBufCap;
+        int nVideoBufLen;
+        int nVideoSamples;
+        int nIsFirstKeyFrame;
+        int64_t nVideoPts; //第一帧的
+        int64_t nLastVideoPts;
+        uint32_t nVideoDuration; //上一个帧间隔，最后一帧的时长先用它
+        uint32_t videoSampleSize[FMP4_MAX_VIDEO_SAMPLES];
+        uint32_t videoSampleDuration[FMP4_MAX_VIDEO_SAMPLES];
+
+        //没有输出的音频帧(aac去掉了adts头)，跟视频帧放在同一个moof里
+        uint8_t *pAudioBuf;
+        int nAudioBufLen;
+        int nAudioSamples;
+        int64_t nAudioPts;
+        uint32_t audioSampleSize[FMP4_MAX_AUDIO_SAMPLES];
+        uint32_t audioSampleDuration[FMP4_MAX_AUDIO_SAMPLES];
+};
+
+static const int aAacFreqs[13] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+
+static const uint32_t aMatrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+
+static void putBytes(BoxWriter *_pWriter, const void *_pData, int _nLen)
+{
+        if (_pWriter->nLen + _nLen > _pWriter->nCap) {
+                _pWriter->nError = 1;
+                return;
+        }
+        memcpy(_pWriter->pBuf + _pWriter->nLen, _pData, _nLen);
+        _pWriter->nLen += _nLen;
+}
+
+static void putZero(BoxWriter *_pWriter, int _nLen)
+{
+        if (_pWriter->nLen + _nLen > _pWriter->nCap) {
+                _pWriter->nError = 1;
+                return;
+        }
+        memset(_pWriter->pBuf + _pWriter->nLen, 0, _nLen);
+        _pWriter->nLen += _nLen;
+}
+
+static void put8(BoxWriter *_pWriter, uint8_t _nValue)
+{
+        putBytes(_pWriter, &_nValue, 1);
+}
+
+static void put16(BoxWriter *_pWriter, uint16_t _nValue)
+{
+        uint8_t buf[2] = {_nValue >> 8, _nValue};
+        putBytes(_pWriter, buf, 2);
+}
+
+static void put24(BoxWriter *_pWriter, uint32_t _nValue)
+{
+        uint8_t buf[3] = {_nValue >> 16, _nValue >> 8, _nValue};
+        putBytes(_pWriter, buf, 3);
+}
+
+static void put32(BoxWriter *_pWriter, uint32_t _nValue)
+{
+        uint8_t buf[4] = {_nValue >> 24, _nValue >> 16, _nValue >> 8, _nValue};
+        putBytes(_pWriter, buf, 4);
+}
+
+static void put64(BoxWriter *_pWriter, uint64_t _nValue)
+{
+        put32(_pWriter, (uint32_t)(_nValue >> 32));
+        put32(_pWriter, (uint32_t)_nValue);
+}
+
+static void putTag(BoxWriter *_pWriter, const char *_pTag)
+{
+        putBytes(_pWriter, _pTag, 4);
+}
+
+static void setBE32(uint8_t *_pBuf, uint32_t _nValue)
+{
+        _pBuf[0] = _nValue >> 24;
+        _pBuf[1] = _nValue >> 16;
+        _pBuf[2] = _nValue >> 8;
+        _pBuf[3] = _nValue;
+}
+
+//返回box开始的位置，box写完后用endBox填长度
+static int beginBox(BoxWriter *_pWriter, const char *_pTag)
+{
+        int nStart = _pWriter->nLen;
+        put32(_pWriter, 0);
+        putTag(_pWriter, _pTag);
+        return nStart;
+}
+
+static int beginFullBox(BoxWriter *_pWriter, const char *_pTag, int _nVersion, uint32_t _nFlags)
+{
+        int nStart = beginBox(_pWriter, _pTag);
+        put8(_pWriter, _nVersion);
+        put24(_pWriter, _nFlags);
+        return nStart;
+}
+
+static void endBox(BoxWriter *_pWriter, int _nStart)
+{
+        if (!_pWriter->nError) {
+                setBE32(_pWriter->pBuf + _nStart, _pWriter->nLen - _nStart);
+        }
+}
+
+static void putMatrix(BoxWriter *_pWriter)
+{
+        int i;
+        for (i = 0; i < 9; i++) {
+                put32(_pWriter, aMatrix[i]);
+        }
+}
+
+static int getNaluType(LinkVideoFormat _fmt, uint8_t _nHdr)
+{
+        if (_fmt == LINK_VIDEO_H264) {
+                return _nHdr & 0x1f;
+        }
+        return (_nHdr >> 1) & 0x3f;
+}
+
+static int getAacFreqIndex(int _nFreq)
+{
+        int i;
+        for (i = 0; i < 13; i++) {
+                if (aAacFreqs[i] == _nFreq) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+static int hasAudio(LinkFmp4MuxerContext *_pCtx)
+{
+        return _pCtx->arg.nAudioFormat == LINK_AUDIO_AAC || _pCtx->arg.nAudioFormat == LINK_AUDIO_PCMU ||
+               _pCtx->arg.nAudioFormat == LINK_AUDIO_PCMA;
+}
+
+static void writeFtyp(BoxWriter *_pWriter)
+{
+        int nBox = beginBox(_pWriter, "ftyp");
+        putTag(_pWriter, "iso6");
+        put32(_pWriter, 0);
+        putTag(_pWriter, "iso6");
+        putTag(_pWriter, "cmfc");
+        putTag(_pWriter, "mp41");
+        endBox(_pWriter, nBox);
+}
+
+static void writeMvhd(BoxWriter *_pWriter)
+{
+        int nBox = beginFullBox(_pWriter, "mvhd", 0, 0);
+        put32(_pWriter, 0); //creation_time
+        put32(_pWriter, 0); //modification_time
+        put32(_pWriter, 1000);
+        put32(_pWriter, 0); //duration，分片的不知道
+        put32(_pWriter, 0x00010000); //rate
+        put16(_pWriter, 0x0100); //volume
+        putZero(_pWriter, 10);
+        putMatrix(_pWriter);
+        putZero(_pWriter, 24); //pre_defined
+        put32(_pWriter, FMP4_AUDIO_TRACK_ID + 1); //next_track_ID
+        endBox(_pWriter, nBox);
+}
+
+static void writeTkhd(BoxWriter *_pWriter, int _nTrackId, int _nIsAudio, int _nWidth, int _nHeight)
+{
+        int nBox = beginFullBox(_pWriter, "tkhd", 0, 3); //track_enabled|track_in_movie
+        put32(_pWriter, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, _nTrackId);
+        put32(_pWriter, 0);
+        put32(_pWriter, 0); //duration
+        putZero(_pWriter, 8);
+        put16(_pWriter, 0); //layer
+        put16(_pWriter, 0); //alternate_group
+        put16(_pWriter, _nIsAudio ? 0x0100 : 0);
+        put16(_pWriter, 0);
+        putMatrix(_pWriter);
+        put32(_pWriter, (uint32_t)_nWidth << 16);
+        put32(_pWriter, (uint32_t)_nHeight << 16);
+        endBox(_pWriter, nBox);
+}
+
+static void writeMdhdAndHdlr(BoxWriter *_pWriter, int _nTimescale, const char *_pHandler, const char *_pName)
+{
+        int nBox = beginFullBox(_pWriter, "mdhd", 0, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, _nTimescale);
+        put32(_pWriter, 0);
+        put16(_pWriter, 0x55c4); //und
+        put16(_pWriter, 0);
+        endBox(_pWriter, nBox);
+
+        nBox = beginFullBox(_pWriter, "hdlr", 0, 0);
+        put32(_pWriter, 0);
+        putTag(_pWriter, _pHandler);
+        putZero(_pWriter, 12);
+        putBytes(_pWriter, _pName, strlen(_pName) + 1);
+        endBox(_pWriter, nBox);
+}
+
+static void writeDinf(BoxWriter *_pWriter)
+{
+        int nDinf = beginBox(_pWriter, "dinf");
+        int nDref = beginFullBox(_pWriter, "dref", 0, 0);
+        put32(_pWriter, 1);
+        int nUrl = beginFullBox(_pWriter, "url ", 0, 1); //数据在同一个文件里
+        endBox(_pWriter, nUrl);
+        endBox(_pWriter, nDref);
+        endBox(_pWriter, nDinf);
+}
+
+//fmp4的样本都在moof里，stbl里的表都是空的
+static void writeEmptySampleTables(BoxWriter *_pWriter)
+{
+        int nBox = beginFullBox(_pWriter, "stts", 0, 0);
+        put32(_pWriter, 0);
+        endBox(_pWriter, nBox);
+        nBox = beginFullBox(_pWriter, "stsc", 0, 0);
+        put32(_pWriter, 0);
+        endBox(_pWriter, nBox);
+        nBox = beginFullBox(_pWriter, "stsz", 0, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, 0);
+        endBox(_pWriter, nBox);
+        nBox = beginFullBox(_pWriter, "stco", 0, 0);
+        put32(_pWriter, 0);
+        endBox(_pWriter, nBox);
+}
+
+static void writeParamSetArray(BoxWriter *_pWriter, int _nType, const ParamSet *_pSets, int _nCount)
+{
+        int i;
+        put8(_pWriter, 0x80 | _nType); //array_completeness
+        put16(_pWriter, _nCount);
+        for (i = 0; i < _nCount; i++) {
+                put16(_pWriter, _pSets[i].nLen);
+                putBytes(_pWriter, _pSets[i].pData, _pSets[i].nLen);
+        }
+}
+
+static void writeAvcC(BoxWriter *_pWriter, const ParamSet *_pSps, int _nSpsCount, const ParamSet *_pPps, int _nPpsCount)
+{
+        int i;
+        int nBox = beginBox(_pWriter, "avcC");
+        put8(_pWriter, 1);
+        put8(_pWriter, _pSps[0].pData[1]); //profile_idc
+        put8(_pWriter, _pSps[0].pData[2]); //constraint_set flags
+        put8(_pWriter, _pSps[0].pData[3]); //level_idc
+        put8(_pWriter, 0xff); //lengthSizeMinusOne=3
+        put8(_pWriter, 0xe0 | _nSpsCount);
+        for (i = 0; i < _nSpsCount; i++) {
+                put16(_pWriter, _pSps[i].nLen);
+                putBytes(_pWriter, _pSps[i].pData, _pSps[i].nLen);
+        }
+        put8(_pWriter, _nPpsCount);
+        for (i = 0; i < _nPpsCount; i++) {
+                put16(_pWriter, _pPps[i].nLen);
+                putBytes(_pWriter, _pPps[i].pData, _pPps[i].nLen);
+        }
+        endBox(_pWriter, nBox);
+}
+
+static void writeHvcC(BoxWriter *_pWriter, const LinkSpsInfo *_pSpsInfo, const ParamSet *_pVps, int _nVpsCount,
+                      const ParamSet *_pSps, int _nSpsCount, const ParamSet *_pPps, int _nPpsCount)
+{
+        int nBox = beginBox(_pWriter, "hvcC");
+        put8(_pWriter, 1);
+        putBytes(_pWriter, _pSpsInfo->profileTierLevel, 12);
+        put16(_pWriter, 0xf000); //min_spatial_segmentation_idc
+        put8(_pWriter, 0xfc); //parallelismType
+        put8(_pWriter, 0xfc | _pSpsInfo->nChromaFormat);
+        put8(_pWriter, 0xf8 | (_pSpsInfo->nBitDepthLuma - 8));
+        put8(_pWriter, 0xf8 | (_pSpsInfo->nBitDepthChroma - 8));
+        put16(_pWriter, 0); //avgFrameRate
+        put8(_pWriter, (_pSpsInfo->nMaxSubLayers << 3) | (_pSpsInfo->nTemporalIdNested << 2) | 3);
+        put8(_pWriter, 3);
+        writeParamSetArray(_pWriter, HEVC_NAL_VPS, _pVps, _nVpsCount);
+        writeParamSetArray(_pWriter, HEVC_NAL_SPS, _pSps, _nSpsCount);
+        writeParamSetArray(_pWriter, HEVC_NAL_PPS, _pPps, _nPpsCount);
+        endBox(_pWriter, nBox);
+}
+
+static void writeEsds(BoxWriter *_pWriter, int _nSampleRate, int _nChannels)
+{
+        //AudioSpecificConfig: AAC LC, 采样率下标, 声道数
+        uint16_t nAsc = (2 << 11) | (getAacFreqIndex(_nSampleRate) << 7) | (_nChannels << 3);
+        int nBox = beginFullBox(_pWriter, "esds", 0, 0);
+        put8(_pWriter, 0x03); //ES_Descriptor
+        put8(_pWriter, 25);
+        put16(_pWriter, FMP4_AUDIO_TRACK_ID);
+        put8(_pWriter, 0);
+        put8(_pWriter, 0x04); //DecoderConfigDescriptor
+        put8(_pWriter, 17);
+        put8(_pWriter, 0x40); //Audio ISO/IEC 14496-3
+        put8(_pWriter, 0x15); //AudioStream
+        put24(_pWriter, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, 0);
+        put8(_pWriter, 0x05); //DecoderSpecificInfo
+        put8(_pWriter, 2);
+        put16(_pWriter, nAsc);
+        put8(_pWriter, 0x06); //SLConfigDescriptor
+        put8(_pWriter, 1);
+        put8(_pWriter, 0x02);
+        endBox(_pWriter, nBox);
+}
+
+static void writeVideoTrak(LinkFmp4MuxerContext *_pCtx, BoxWriter *_pWriter, const LinkSpsInfo *_pSpsInfo,
+                           const ParamSet *_pVps, int _nVpsCount, const ParamSet *_pSps, int _nSpsCount,
+                           const ParamSet *_pPps, int _nPpsCount)
+{
+        int nTrak = beginBox(_pWriter, "trak");
+        writeTkhd(_pWriter, FMP4_VIDEO_TRACK_ID, 0, _pSpsInfo->nWidth, _pSpsInfo->nHeight);
+        int nMdia = beginBox(_pWriter, "mdia");
+        writeMdhdAndHdlr(_pWriter, FMP4_VIDEO_TIMESCALE, "vide", "VideoHandler");
+        int nMinf = beginBox(_pWriter, "minf");
+        int nVmhd = beginFullBox(_pWriter, "vmhd", 0, 1);
+        putZero(_pWriter, 8);
+        endBox(_pWriter, nVmhd);
+        writeDinf(_pWriter);
+        int nStbl = beginBox(_pWriter, "stbl");
+        int nStsd = beginFullBox(_pWriter, "stsd", 0, 0);
+        put32(_pWriter, 1);
+        int nEntry = beginBox(_pWriter, _pCtx->arg.nVideoFormat == LINK_VIDEO_H264 ? "avc1" : "hvc1");
+        putZero(_pWriter, 6);
+        put16(_pWriter, 1); //data_reference_index
+        putZero(_pWriter, 16);
+        put16(_pWriter, _pSpsInfo->nWidth);
+        put16(_pWriter, _pSpsInfo->nHeight);
+        put32(_pWriter, 0x00480000); //72dpi
+        put32(_pWriter, 0x00480000);
+        put32(_pWriter, 0);
+        put16(_pWriter, 1); //frame_count
+        putZero(_pWriter, 32); //compressorname
+        put16(_pWriter, 0x0018);
+        put16(_pWriter, 0xffff);
+        if (_pCtx->arg.nVideoFormat == LINK_VIDEO_H264) {
+                writeAvcC(_pWriter, _pSps, _nSpsCount, _pPps, _nPpsCount);
+        } else {
+                writeHvcC(_pWriter, _pSpsInfo, _pVps, _nVpsCount, _pSps, _nSpsCount, _pPps, _nPpsCount);
+        }
+        endBox(_pWriter, nEntry);
+        endBox(_pWriter, nStsd);
+        writeEmptySampleTables(_pWriter);
+        endBox(_pWriter, nStbl);
+        endBox(_pWriter, nMinf);
+        endBox(_pWriter, nMdia);
+        endBox(_pWriter, nTrak);
+}
+
+static void writeAudioTrak(LinkFmp4MuxerContext *_pCtx, BoxWriter *_pWriter)
+{
+        int nTrak = beginBox(_pWriter, "trak");
+        writeTkhd(_pWriter, FMP4_AUDIO_TRACK_ID, 1, 0, 0);
+        int nMdia = beginBox(_pWriter, "mdia");
+        writeMdhdAndHdlr(_pWriter, _pCtx->arg.nAudioSampleRate, "soun", "SoundHandler");
+        int nMinf = beginBox(_pWriter, "minf");
+        int nSmhd = beginFullBox(_pWriter, "smhd", 0, 0);
+        put32(_pWriter, 0);
+        endBox(_pWriter, nSmhd);
+        writeDinf(_pWriter);
+        int nStbl = beginBox(_pWriter, "stbl");
+        int nStsd = beginFullBox(_pWriter, "stsd", 0, 0);
+        put32(_pWriter, 1);
+        const char *pEntry = "mp4a";
+        if (_pCtx->arg.nAudioFormat == LINK_AUDIO_PCMU) {
+                pEntry = "ulaw";
+        } else if (_pCtx->arg.nAudioFormat == LINK_AUDIO_PCMA) {
+                pEntry = "alaw";
+        }
+        int nEntry = beginBox(_pWriter, pEntry);
+        putZero(_pWriter, 6);
+        put16(_pWriter, 1); //data_reference_index
+        putZero(_pWriter, 8);
+        put16(_pWriter, _pCtx->arg.nAudioChannels);
+        put16(_pWriter, 16); //samplesize
+        put32(_pWriter, 0);
+        put32(_pWriter, _pCtx->arg.nAudioSampleRate <= 0xffff ? (uint32_t)_pCtx->arg.nAudioSampleRate << 16 : 0);
+        if (_pCtx->arg.nAudioFormat == LINK_AUDIO_AAC) {
+                writeEsds(_pWriter, _pCtx->arg.nAudioSampleRate, _pCtx->arg.nAudioChannels);
+        }
+        endBox(_pWriter, nEntry);
+        endBox(_pWriter, nStsd);
+        writeEmptySampleTables(_pWriter);
+        endBox(_pWriter, nStbl);
+        endBox(_pWriter, nMinf);
+        endBox(_pWriter, nMdia);
+        endBox(_pWriter, nTrak);
+}
+
+static void writeTrex(BoxWriter *_pWriter, int _nTrackId, uint32_t _nFlags)
+{
+        int nBox = beginFullBox(_pWriter, "trex", 0, 0);
+        put32(_pWriter, _nTrackId);
+        put32(_pWriter, 1); //default_sample_description_index
+        put32(_pWriter, 0);
+        put32(_pWriter, 0);
+        put32(_pWriter, _nFlags);
+        endBox(_pWriter, nBox);
+}
+
+//pData是LinkParamSetCache的格式，每个参数集前面4字节start code
+static int writeInitSegment(LinkFmp4MuxerContext *_pCtx, const uint8_t *_pData, int _nLen)
+{
+        ParamSet vps[FMP4_MAX_PARAM_SET], sps[FMP4_MAX_PARAM_SET], pps[FMP4_MAX_PARAM_SET];
+        int nVpsCount = 0, nSpsCount = 0, nPpsCount = 0;
+        int isH264 = _pCtx->arg.nVideoFormat == LINK_VIDEO_H264;
+        const uint8_t *pEnd = _pData + _nLen;
+        const uint8_t *pNalu = LinkFindStartCode(_pData, pEnd);
+        while (pNalu < pEnd) {
+                const uint8_t *pPayload = pNalu + (pNalu[2] == 1 ? 3 : 4);
+                const uint8_t *pNext = LinkFindStartCode(pPayload, pEnd);
+                int nType = getNaluType(_pCtx->arg.nVideoFormat, pPayload[0]);
+                ParamSet set = {pPayload, pNext - pPayload};
+                if (nType == (isH264 ? H264_NAL_SPS : HEVC_NAL_SPS) && nSpsCount < FMP4_MAX_PARAM_SET) {
+                        sps[nSpsCount++] = set;
+                } else if (nType == (isH264 ? H264_NAL_PPS : HEVC_NAL_PPS) && nPpsCount < FMP4_MAX_PARAM_SET) {
+                        pps[nPpsCount++] = set;
+                } else if (!isH264 && nType == HEVC_NAL_VPS && nVpsCount < FMP4_MAX_PARAM_SET) {
+                        vps[nVpsCount++] = set;
+                }
+                pNalu = pNext;
+        }
+        if (nSpsCount == 0 || nPpsCount == 0 || (!isH264 && nVpsCount == 0) || sps[0].nLen < 4) {
+                return LINK_ARG_ERROR;
+        }
+        LinkSpsInfo spsInfo;
+        if (LinkParseSps(_pCtx->arg.nVideoFormat, sps[0].pData, sps[0].nLen, &spsInfo) != 0) {
+                LinkLogWarn("parse sps fail");
+                return LINK_ARG_ERROR;
+        }
+
+        BoxWriter writer = {_pCtx->init, 0, sizeof(_pCtx->init), 0};
+        writeFtyp(&writer);
+        int nMoov = beginBox(&writer, "moov");
+        writeMvhd(&writer);
+        writeVideoTrak(_pCtx, &writer, &spsInfo, vps, nVpsCount, sps, nSpsCount, pps, nPpsCount);
+        if (hasAudio(_pCtx)) {
+                writeAudioTrak(_pCtx, &writer);
+        }
+        int nMvex = beginBox(&writer, "mvex");
+        writeTrex(&writer, FMP4_VIDEO_TRACK_ID, FMP4_SAMPLE_FLAGS_NON_SYNC);
+        if (hasAudio(_pCtx)) {
+                writeTrex(&writer, FMP4_AUDIO_TRACK_ID, FMP4_SAMPLE_FLAGS_SYNC);
+        }
+        endBox(&writer, nMvex);
+        endBox(&writer, nMoov);
+        if (writer.nError) {
+                LinkLogError("init segment too large");
+                return LINK_BUFFER_IS_SMALL;
+        }
+        LinkLogDebug("fmp4 init segment:%d bytes %dx%d", writer.nLen, spsInfo.nWidth, spsInfo.nHeight);
+        if (_pCtx->arg.initOutput) {
+                return _pCtx->arg.initOutput(_pCtx->arg.pOpaque, _pCtx->init, writer.nLen);
+        }
+        return 0;
+}
+
+//写tfhd, tfdt和trun的头，返回trun开始的位置。样本表由调用者写完后再endBox(trun)和endBox(traf)
+//data_offset先写0，pDataOffsetPos返回它的位置，moof写完后再填
+static int writeTrafHeader(BoxWriter *_pWriter, int _nTrackId, uint64_t _nDecodeTime, uint32_t _nTrunFlags, int _nCount,
+                           int *_pDataOffsetPos)
+{
+        int nBox = beginFullBox(_pWriter, "tfhd", 0, 0x020000); //default-base-is-moof
+        put32(_pWriter, _nTrackId);
+        endBox(_pWriter, nBox);
+        nBox = beginFullBox(_pWriter, "tfdt", 1, 0);
+        put64(_pWriter, _nDecodeTime);
+        endBox(_pWriter, nBox);
+        int nTrun = beginFullBox(_pWriter, "trun", 0, _nTrunFlags);
+        put32(_pWriter, _nCount);
+        *_pDataOffsetPos = _pWriter->nLen;
+        put32(_pWriter, 0);
+        return nTrun;
+}
+
+//把攒下的音视频帧输出成一个moof+mdat，header和两段数据一次输出
+static int writeFragment(LinkFmp4MuxerContext *_pCtx)
+{
+        BoxWriter writer = {_pCtx->header, 0, sizeof(_pCtx->header), 0};
+        int i;
+
+        if (_pCtx->nVideoSamples == 0 && _pCtx->nAudioSamples == 0) {
+                return 0;
+        }
+        if (_pCtx->nSequence == 0) {
+                int nStyp = beginBox(&writer, "styp");
+                putTag(&writer, "msdh");
+                put32(&writer, 0);
+                putTag(&writer, "msdh");
+                putTag(&writer, "msix");
+                endBox(&writer, nStyp);
+        }
+        _pCtx->nSequence++;
+
+        int nMoof = beginBox(&writer, "moof");
+        int nBox = beginFullBox(&writer, "mfhd", 0, 0);
+        put32(&writer, _pCtx->nSequence);
+        endBox(&writer, nBox);
+
+        int nVideoOffsetPos = 0;
+        if (_pCtx->nVideoSamples > 0) {
+                nBox = beginBox(&writer, "traf");
+                //data_offset, first_sample_flags, sample_duration, sample_size。关键帧只会是第一个，后面的用trex里的flags
+                int nTrun = writeTrafHeader(&writer, FMP4_VIDEO_TRACK_ID, (uint64_t)_pCtx->nVideoPts * 90, 0x000305,
+                                            _pCtx->nVideoSamples, &nVideoOffsetPos);
+                put32(&writer, _pCtx->nIsFirstKeyFrame ? FMP4_SAMPLE_FLAGS_SYNC : FMP4_SAMPLE_FLAGS_NON_SYNC);
+                for (i = 0; i < _pCtx->nVideoSamples; i++) {
+                        put32(&writer, _pCtx->videoSampleDuration[i]);
+                        put32(&writer, _pCtx->videoSampleSize[i]);
+                }
+                endBox(&writer, nTrun);
+                endBox(&writer, nBox);
+        }
+        int nAudioOffsetPos = 0;
+        if (_pCtx->nAudioSamples > 0) {
+                nBox = beginBox(&writer, "traf");
+                uint64_t nDecodeTime = (uint64_t)_pCtx->nAudioPts * _pCtx->arg.nAudioSampleRate / 1000;
+                //data_offset, sample_duration, sample_size
+                int nTrun = writeTrafHeader(&writer, FMP4_AUDIO_TRACK_ID, nDecodeTime, 0x000301, _pCtx->nAudioSamples, &nAudioOffsetPos);
+                for (i = 0; i < _pCtx->nAudioSamples; i++) {
+                        put32(&writer, _pCtx->audioSampleDuration[i]);
+                        put32(&writer, _pCtx->audioSampleSize[i]);
+                }
+                endBox(&writer, nTrun);
+                endBox(&writer, nBox);
+        }
+        endBox(&writer, nMoof);
+        put32(&writer, 8 + _pCtx->nVideoBufLen + _pCtx->nAudioBufLen);
+        putTag(&writer, "mdat");
+        if (writer.nError) {
+                return LINK_BUFFER_IS_SMALL;
+        }
+        //data_offset从moof开始算
+        int nMdatData = writer.nLen - nMoof;
+        if (_pCtx->nVideoSamples > 0) {
+                setBE32(_pCtx->header + nVideoOffsetPos, nMdatData);
+        }
+        if (_pCtx->nAudioSamples > 0) {
+                setBE32(_pCtx->header + nAudioOffsetPos, nMdatData + _pCtx->nVideoBufLen);
+        }
+
+        _pCtx->vec[0].iov_base = _pCtx->header;
+        _pCtx->vec[0].iov_len = writer.nLen;
+        _pCtx->vec[1].iov_base = _pCtx->pVideoBuf;
+        _pCtx->vec[1].iov_len = _pCtx->nVideoBufLen;
+        _pCtx->vec[2].iov_base = _pCtx->pAudioBuf;
+        _pCtx->vec[2].iov_len = _pCtx->nAudioBufLen;
+        _pCtx->nVideoSamples = 0;
+        _pCtx->nVideoBufLen = 0;
+        _pCtx->nAudioSamples = 0;
+        _pCtx->nAudioBufLen = 0;
+
+        if (_pCtx->arg.outputVec) {
+                int nRet = _pCtx->arg.outputVec(_pCtx->arg.pOpaque, _pCtx->vec, 3);
+                return nRet < 0 ? nRet : 0;
+        }
+        for (i = 0; i < 3; i++) {
+                if (_pCtx->vec[i].iov_len == 0) {
+                        continue;
+                }
+                int nRet = _pCtx->arg.output(_pCtx->arg.pOpaque, _pCtx->vec[i].iov_base, _pCtx->vec[i].iov_len);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        return 0;
+}
+
+int LinkNewFmp4MuxerContext(LinkTsMuxerArg *_pArg, LinkFmp4MuxerContext **_pFmp4MuxerCtx)
+{
+        if (_pArg->nVideoFormat != LINK_VIDEO_H264 && _pArg->nVideoFormat != LINK_VIDEO_H265) {
+                LinkLogError("fmp4 need video:%d", _pArg->nVideoFormat);
+                return LINK_ARG_ERROR;
+        }
+        if (_pArg->nAudioFormat == LINK_AUDIO_AAC && (getAacFreqIndex(_pArg->nAudioSampleRate) < 0 ||
+                                                       _pArg->nAudioChannels < 1 || _pArg->nAudioChannels > 2)) {
+                LinkLogError("wrong audio arg:channel:%d sameplerate%d", _pArg->nAudioChannels, _pArg->nAudioSampleRate);
+                return LINK_ARG_ERROR;
+        }
+        LinkFmp4MuxerContext *pCtx = (LinkFmp4MuxerContext *)malloc(sizeof(LinkFmp4MuxerContext));
+        if (pCtx == NULL) {
+                return LINK_NO_MEMORY;
+        }
+        memset(pCtx, 0, sizeof(LinkFmp4MuxerContext));
+        pCtx->arg = *_pArg;
+        if (pCtx->arg.nAudioChannels < 1) {
+                pCtx->arg.nAudioChannels = 1;
+        }
+        pCtx->nVideoDuration = FMP4_DEFAULT_VIDEO_DURATION;
+        *_pFmp4MuxerCtx = pCtx;
+        return 0;
+}
+
+int LinkFmp4MuxerFlush(LinkFmp4MuxerContext *_pCtx)
+{
+        if (!_pCtx->isInitWrited) {
+                //init之前没有地方输出，直接丢掉
+                _pCtx->nAudioSamples = 0;
+                _pCtx->nAudioBufLen = 0;
+                return 0;
+        }
+        return writeFragment(_pCtx);
+}
+
+int LinkFmp4MuxerPendingBytes(LinkFmp4MuxerContext *_pCtx)
+{
+        if (_pCtx->nVideoSamples == 0 && _pCtx->nAudioSamples == 0) {
+                return 0;
+        }
+        return _pCtx->nVideoBufLen + _pCtx->nAudioBufLen + FMP4_HEADER_MAX;
+}
+
+static int addAudioSample(LinkFmp4MuxerContext *_pCtx, const uint8_t *_pData, int _nLen, uint32_t _nDuration, int64_t _nPts)
+{
+        if (_nLen > FMP4_AUDIO_BUF_MAX) {
+                LinkLogWarn("audio frame too large:%d", _nLen);
+                return 0;
+        }
+        //音频攒满了，或者很久没有视频帧了
+        if (_pCtx->nAudioSamples > 0 && (_pCtx->nAudioSamples == FMP4_MAX_AUDIO_SAMPLES ||
+                                         _pCtx->nAudioBufLen + _nLen > FMP4_AUDIO_BUF_MAX ||
+                                         (_pCtx->nVideoSamples == 0 && _nPts - _pCtx->nAudioPts >= FMP4_AUDIO_FLUSH_DURATION))) {
+                int nRet = LinkFmp4MuxerFlush(_pCtx);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        if (_pCtx->pAudioBuf == NULL) {
+                _pCtx->pAudioBuf = (uint8_t *)malloc(FMP4_AUDIO_BUF_MAX);
+                if (_pCtx->pAudioBuf == NULL) {
+                        return LINK_NO_MEMORY;
+                }
+        }
+        if (_pCtx->nAudioSamples == 0) {
+                _pCtx->nAudioPts = _nPts;
+        }
+        memcpy(_pCtx->pAudioBuf + _pCtx->nAudioBufLen, _pData, _nLen);
+        _pCtx->nAudioBufLen += _nLen;
+        _pCtx->audioSampleSize[_pCtx->nAudioSamples] = _nLen;
+        _pCtx->audioSampleDuration[_pCtx->nAudioSamples] = _nDuration;
+        _pCtx->nAudioSamples++;
+        return 0;
+}
+
+int LinkFmp4MuxerAudio(LinkFmp4MuxerContext *_pCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        if (!hasAudio(_pCtx)) {
+                return 0;
+        }
+        if (_pCtx->arg.nAudioFormat != LINK_AUDIO_AAC) {
+                return addAudioSample(_pCtx, _pData, _nDataLen, _nDataLen / _pCtx->arg.nAudioChannels, _nPts);
+        }
+        //mp4里的aac不带adts头。一次可能传进来几个adts帧
+        int nFrame = 0;
+        while (_nDataLen >= 7 && _pData[0] == 0xff && (_pData[1] & 0xf0) == 0xf0) {
+                int nHeaderLen = (_pData[1] & 0x01) ? 7 : 9;
+                int nFrameLen = ((_pData[3] & 0x03) << 11) | (_pData[4] << 3) | (_pData[5] >> 5);
+                if (nFrameLen <= nHeaderLen || nFrameLen > _nDataLen) {
+                        break;
+                }
+                int64_t nPts = _nPts + (int64_t)nFrame * 1024 * 1000 / _pCtx->arg.nAudioSampleRate;
+                int nRet = addAudioSample(_pCtx, _pData + nHeaderLen, nFrameLen - nHeaderLen, 1024, nPts);
+                if (nRet < 0) {
+                        return nRet;
+                }
+                _pData += nFrameLen;
+                _nDataLen -= nFrameLen;
+                nFrame++;
+        }
+        if (nFrame == 0 && _nDataLen > 0) {
+                return addAudioSample(_pCtx, _pData, _nDataLen, 1024, _nPts);
+        }
+        return 0;
+}
+
+//start code换成4字节长度，aud去掉，拷贝到pVideoBuf后面。返回sample长度
+static int appendVideoSample(LinkFmp4MuxerContext *_pCtx, const uint8_t *_pData, int _nDataLen)
+{
+        //每个NAL至少有3字节start code和1字节头，换成长度前缀最多变成5/4
+        int nNeed = _pCtx->nVideoBufLen + _nDataLen + _nDataLen / 4 + 4;
+        if (_pCtx->nVideoBufCap < nNeed) {
+                int nCap = _pCtx->nVideoBufCap * 2 > nNeed ? _pCtx->nVideoBufCap * 2 : nNeed;
+                uint8_t *pBuf = (uint8_t *)realloc(_pCtx->pVideoBuf, nCap);
+                if (pBuf == NULL) {
+                        LinkLogWarn("malloc %d size memory fail", nCap);
+                        return LINK_NO_MEMORY;
+                }
+                _pCtx->pVideoBuf = pBuf;
+                _pCtx->nVideoBufCap = nCap;
+        }
+        const uint8_t *pEnd = _pData + _nDataLen;
+        const uint8_t *pNalu = LinkFindStartCode(_pData, pEnd);
+        int nAudType = _pCtx->arg.nVideoFormat == LINK_VIDEO_H264 ? H264_NAL_AUD : HEVC_NAL_AUD;
+        uint8_t *pOut = _pCtx->pVideoBuf + _pCtx->nVideoBufLen;
+        while (pNalu < pEnd) {
+                const uint8_t *pPayload = pNalu + (pNalu[2] == 1 ? 3 : 4);
+                const uint8_t *pNext = LinkFindStartCode(pPayload, pEnd);
+                if (getNaluType(_pCtx->arg.nVideoFormat, pPayload[0]) != nAudType) {
+                        setBE32(pOut, pNext - pPayload);
+                        memcpy(pOut + 4, pPayload, pNext - pPayload);
+                        pOut += 4 + (pNext - pPayload);
+                }
+                pNalu = pNext;
+        }
+        int nSampleLen = pOut - (_pCtx->pVideoBuf + _pCtx->nVideoBufLen);
+        _pCtx->nVideoBufLen += nSampleLen;
+        return nSampleLen;
+}
+
+int LinkFmp4MuxerVideo(LinkFmp4MuxerContext *_pCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
+{
+        if (!_pCtx->isInitWrited) {
+                if (!_nIsKeyFrame) {
+                        return 0;
+                }
+                LinkVideoFrameInfo info;
+                LinkParamSetCache paramSets;
+                paramSets.nLen = 0;
+                LinkAnalyzeVideoFrame(_pCtx->arg.nVideoFormat, _pData, _nDataLen, &info, &paramSets);
+                int nRet = writeInitSegment(_pCtx, paramSets.data, paramSets.nLen);
+                if (nRet == LINK_ARG_ERROR) {
+                        LinkLogWarn("no parameter set in keyframe. drop this frame");
+                        return 0;
+                }
+                if (nRet < 0) {
+                        return nRet;
+                }
+                _pCtx->isInitWrited = 1;
+        }
+
+        //有了这一帧才知道上一帧的时长
+        if (_pCtx->nVideoSamples > 0 && _nPts > _pCtx->nLastVideoPts) {
+                _pCtx->nVideoDuration = (uint32_t)((_nPts - _pCtx->nLastVideoPts) * 90);
+                _pCtx->videoSampleDuration[_pCtx->nVideoSamples - 1] = _pCtx->nVideoDuration;
+        }
+        //关键帧总是在moof的第一个，播放器可以从任何一个关键帧开始
+        if (_pCtx->nVideoSamples > 0 && (_nIsKeyFrame || _pCtx->nVideoSamples == FMP4_MAX_VIDEO_SAMPLES ||
+                                         _nPts - _pCtx->nVideoPts >= _pCtx->arg.nFragmentDuration)) {
+                int nRet = writeFragment(_pCtx);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+
+        int nSampleLen = appendVideoSample(_pCtx, _pData, _nDataLen);
+        if (nSampleLen <= 0) {
+                return nSampleLen;
+        }
+        if (_pCtx->nVideoSamples == 0) {
+                _pCtx->nVideoPts = _nPts;
+                _pCtx->nIsFirstKeyFrame = _nIsKeyFrame;
+        }
+        _pCtx->videoSampleSize[_pCtx->nVideoSamples] = nSampleLen;
+        _pCtx->videoSampleDuration[_pCtx->nVideoSamples] = _pCtx->nVideoDuration;
+        _pCtx->nVideoSamples++;
+        _pCtx->nLastVideoPts = _nPts;
+        return 0;
+}
+
+void LinkDestroyFmp4MuxerContext(LinkFmp4MuxerContext *_pCtx)
+{
+        if (_pCtx) {
+                if (_pCtx->pAudioBuf) {
+                        free(_pCtx->pAudioBuf);
+                }
+                if (_pCtx->pVideoBuf) {
+                        free(_pCtx->pVideoBuf);
+                }
+                free(_pCtx);
+        }
+}
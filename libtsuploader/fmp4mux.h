@@ -0,0 +1,20 @@
+#ifndef __LINK_FMP4_MUX_H__
+#define __LINK_FMP4_MUX_H__
+#include <stdint.h>
+#include "tsmux.h"
+
+//fragmented mp4(CMAF)的封装，LinkTsMuxerArg.nContainer为LINK_CONTAINER_FMP4时由tsmux.c调用
+//音视频帧攒够nFragmentDuration(或者遇到关键帧)就输出一个moof+mdat，不缓存整个分片
+//init segment用第一个关键帧里的参数集生成。不加锁，由调用者保证
+typedef struct _LinkFmp4MuxerContext LinkFmp4MuxerContext;
+
+int LinkNewFmp4MuxerContext(LinkTsMuxerArg *pArg, LinkFmp4MuxerContext **pFmp4MuxerCtx);
+int LinkFmp4MuxerAudio(LinkFmp4MuxerContext *pMuxerCtx, uint8_t *pData, int nDataLen, int64_t nPts);
+int LinkFmp4MuxerVideo(LinkFmp4MuxerContext *pMuxerCtx, uint8_t *pData, int nDataLen, int64_t nPts, int nIsKeyFrame);
+//攒下的帧马上输出，分片结束前要调用
+int LinkFmp4MuxerFlush(LinkFmp4MuxerContext *pMuxerCtx);
+//攒着还没输出的帧加上moof头的大小
+int LinkFmp4MuxerPendingBytes(LinkFmp4MuxerContext *pMuxerCtx);
+void LinkDestroyFmp4MuxerContext(LinkFmp4MuxerContext *pMuxerCtx);
+
+#endif
@@ -93,6 +93,14 @@ void LinkInitAudioPES(LinkPES *_pPes, uint8_t *_pData, int _nDataLen, int64_t _n
         return;
 }
 
+void LinkInitAudioPESWithPrefix(LinkPES *_pPes, const uint8_t *_pPrefix, int _nPrefixLen, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        LinkInitAudioPES(_pPes, _pData, _nDataLen + _nPrefixLen, _nPts);
+        _pPes->pPrefix = _pPrefix;
+        _pPes->nPrefixLen = _nPrefixLen;
+        return;
+}
+
 void LinkInitPrivateTypePES(LinkPES *_pPes, uint8_t *_pData, int _nDataLen, int64_t _nPts)
 {
         initPes(_pPes, _pData, _nDataLen, _nPts);
@@ -101,6 +109,14 @@ void LinkInitPrivateTypePES(LinkPES *_pPes, uint8_t *_pData, int _nDataLen, int6
         return;
 }
 
+void LinkInitPrivateTypePESWithPrefix(LinkPES *_pPes, const uint8_t *_pPrefix, int _nPrefixLen, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        LinkInitPrivateTypePES(_pPes, _pData, _nDataLen + _nPrefixLen, _nPts);
+        _pPes->pPrefix = _pPrefix;
+        _pPes->nPrefixLen = _nPrefixLen;
+        return;
+}
+
 void NewVideoPES(LinkPES *_pPes, uint8_t *_pData, int _nDataLen, int64_t _nPts)
 {
         initPes(_pPes, _pData, _nDataLen, _nPts);
@@ -166,15 +182,27 @@ static void printPts(uint8_t *buf){
         printf("pes pts:%lld\n", pts/90);
 }
 
-static int getPESHeaderJustWithPtsLen(LinkPES *_pPes)
+static const uint8_t *getAud(LinkPES *_pPes, int *_pLen)
 {
-        int nLen = 14;
+        *_pLen = 0;
+        if (_pPes->nWithoutAud) {
+                return NULL;
+        }
         if (_pPes->videoFormat == LINK_VIDEO_H264) {
-                nLen += sizeof(h264Aud);
+                *_pLen = sizeof(h264Aud);
+                return h264Aud;
         } else if (_pPes->videoFormat == LINK_VIDEO_H265) {
-                nLen += sizeof(h265Aud);
+                *_pLen = sizeof(h265Aud);
+                return h265Aud;
         }
-        return nLen;
+        return NULL;
+}
+
+static int getPESHeaderJustWithPtsLen(LinkPES *_pPes)
+{
+        int nAudLen = 0;
+        getAud(_pPes, &nAudLen);
+        return 14 + nAudLen;
 }
 
 static int writePESHeaderJustWithPts(LinkPES *_pPes, uint8_t *pData)
@@ -187,12 +215,9 @@ static int writePESHeaderJustWithPts(LinkPES *_pPes, uint8_t *pData)
         
         pData[3] = _pPes->nStreamId; //stream_id 8bit
         
-        int nLen = _pPes->nESDataLen + 8; //PES_packet_length 16bit header[6-13]长度为8
-        if (_pPes->videoFormat == LINK_VIDEO_H264) {
-                nLen += sizeof(h264Aud);
-        } else if (_pPes->videoFormat == LINK_VIDEO_H265) {
-                nLen += sizeof(h265Aud);
-        }
+        int nAudLen = 0;
+        const uint8_t *pAud = getAud(_pPes, &nAudLen);
+        int nLen = _pPes->nESDataLen + 8 + nAudLen; //PES_packet_length 16bit header[6-13]长度为8
         if (nLen > 65535) {
                 //A value of zero for the PES packet length can be used only when the PES packet payload is a video elementary stream
                 assert(_pPes->nStreamId >= 0xE0 && _pPes->nStreamId <= 0xEF);
@@ -227,12 +252,9 @@ static int writePESHeaderJustWithPts(LinkPES *_pPes, uint8_t *pData)
         pData[13] = 0x01 | ((nPts << 1 ) & 0xFE);
         nRetLen += 14;
         
-        if (_pPes->videoFormat == LINK_VIDEO_H264) {
-                memcpy(&pData[nRetLen], h264Aud, sizeof(h264Aud));
-                nRetLen += sizeof(h264Aud);
-        } else if (_pPes->videoFormat == LINK_VIDEO_H265) {
-                memcpy(&pData[nRetLen], h265Aud, sizeof(h265Aud));
-                nRetLen += sizeof(h265Aud);
+        if (pAud) {
+                memcpy(&pData[nRetLen], pAud, nAudLen);
+                nRetLen += nAudLen;
         }
         
         pPts=pData+9; //for debug
@@ -243,11 +265,9 @@ static int writePESHeaderJustWithPts(LinkPES *_pPes, uint8_t *pData)
         return nRetLen;
 }
 
-int LinkGetPESData(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pData, int _nLen)
+//写ts头、adaptation和pes头，返回头的长度。*_pReadLen是这个包带的es数据长度，es数据总是在包的最后
+static int writePESPacketHeader(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pData, int _nLen, int *_pReadLen)
 {
-        if (_pPes->nPos == _pPes->nESDataLen)
-                return 0;
-        
         int nRetLen = 0;
         int nRemainLen = _pPes->nESDataLen - _pPes->nPos;
         uint8_t * pData = _pData;
@@ -288,7 +308,6 @@ int LinkGetPESData(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pData, in
         int nReadLen = nRemainLen > _nLen ? _nLen : nRemainLen;
         if (nReadLen + nRetLen + nPesHdrLen >= 188) {
                 nReadLen = 188 - nRetLen;
-                memcpy(&_pData[nRetLen], _pPes->pESData + _pPes->nPos, nReadLen);
         } else {
                 nRetLen += 2; //两字节的adaptation_field
                 if (nReadLen + nRetLen + nPesHdrLen > 188) {
@@ -306,12 +325,174 @@ int LinkGetPESData(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pData, in
                 if (isPaddingBeforePesHdr) {
                         nRetLen += writePESHeaderJustWithPts(_pPes, &_pData[nRetLen]);
                 }
-                memcpy(&_pData[188 - nReadLen], _pPes->pESData + _pPes->nPos, nReadLen);
         }
         
+        assert(nRetLen + nReadLen == 188);
+        *_pReadLen = nReadLen;
+        return nRetLen;
+}
+
+int LinkGetPESData(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pData, int _nLen)
+{
+        if (_pPes->nPos == _pPes->nESDataLen)
+                return 0;
+        
+        int nReadLen = 0;
+        int nHdrLen = writePESPacketHeader(_pPes, _nCounter, _nPid, _pData, _nLen, &nReadLen);
+        memcpy(&_pData[nHdrLen], _pPes->pESData + _pPes->nPos, nReadLen);
+        _pPes->nPos += nReadLen;
+        return 188;
+}
+
+int LinkGetPESDataVec(LinkPES *_pPes, int _nCounter, int _nPid, uint8_t *_pHeader, struct iovec *_pVec)
+{
+        if (_pPes->nPos == _pPes->nESDataLen)
+                return 0;
+        
+        int nReadLen = 0;
+        int nHdrLen = writePESPacketHeader(_pPes, _nCounter, _nPid, _pHeader, 188, &nReadLen);
+        _pVec[0].iov_base = _pHeader;
+        _pVec[0].iov_len = nHdrLen;
+        _pVec[1].iov_base = _pPes->pESData + _pPes->nPos;
+        _pVec[1].iov_len = nReadLen;
+        _pPes->nPos += nReadLen;
+        return 188;
+}
+
+void LinkInitPESTemplate(LinkPESTemplate *_pTemplate, int _nPid, int _nStreamId, LinkVideoFormat _fmt)
+{
+        LinkPES pes;
+        memset(&pes, 0, sizeof(pes));
+        pes.nStreamId = _nStreamId;
+        pes.videoFormat = _fmt;
+        
+        memset(_pTemplate, 0, sizeof(LinkPESTemplate));
+        LinkWriteTsHeader(_pTemplate->tsHeader, 0, 0, _nPid, LINK_ADAPTATION_JUST_PAYLOAD);
+        _pTemplate->nPesHeaderLen = writePESHeaderJustWithPts(&pes, _pTemplate->pesHeader);
+        getAud(&pes, &_pTemplate->nAudLen);
+}
+
+static int getTemplatePESHeaderLen(LinkPESTemplate *_pTemplate, LinkPES *_pPes)
+{
+        return _pTemplate->nPesHeaderLen - (_pPes->nWithoutAud ? _pTemplate->nAudLen : 0);
+}
+
+static void writeTemplatePESHeader(LinkPESTemplate *_pTemplate, LinkPES *_pPes, uint8_t *_pData, int _nPesHdrLen)
+{
+        memcpy(_pData, _pTemplate->pesHeader, _nPesHdrLen);
+        
+        int nLen = _pPes->nESDataLen + _nPesHdrLen - 6; //PES_packet_length不包括前6个字节
+        if (nLen > 65535) {
+                assert(_pPes->nStreamId >= 0xE0 && _pPes->nStreamId <= 0xEF);
+                nLen = 0;
+        }
+        _pData[4] = nLen / 256;
+        _pData[5] = nLen % 256;
+        
+        int64_t nPts = _pPes->nPts;
+        _pData[9]  = 0x21 | ((nPts >> 29) & 0x0E);
+        _pData[10] = (nPts >>22 & 0xFF);
+        _pData[11] = 0x01 | ((nPts >> 14 ) & 0xFE);
+        _pData[12] = (nPts >> 7 & 0xFF);
+        _pData[13] = 0x01 | ((nPts << 1 ) & 0xFE);
+}
+
+//包的布局和writePESPacketHeader一样：ts头，adaptation(pcr或者填充)，pes头(只在第一个包)，es数据
+static int writeTemplatePacketHeader(LinkPESTemplate *_pTemplate, LinkPES *_pPes, uint8_t *_pData, int *_pReadLen)
+{
+        uint8_t *pData = _pData;
+        memcpy(pData, _pTemplate->tsHeader, 4);
+        pData[3] |= _pTemplate->nCounter;
+        _pTemplate->nCounter = (_pTemplate->nCounter + 1) & 0x0F;
+        pData += 4;
+        
+        int nPesHdrLen = 0;
+        if (_pPes->nPos == 0) {
+                _pData[1] |= 0x40; //payload_unit_start_indicator
+                if (_pPes->nWithPcr) {
+                        LinkSetAdaptationFieldFlag(_pData, LINK_ADAPTATION_BOTH);
+                        pData += writeAdaptationFieldJustWithPCR(pData, _pPes->nPts);
+                }
+                nPesHdrLen = getTemplatePESHeaderLen(_pTemplate, _pPes);
+        }
+        
+        int nSpace = 188 - (pData - _pData) - nPesHdrLen;
+        int nReadLen = _pPes->nESDataLen - _pPes->nPos;
+        if (nReadLen >= nSpace) {
+                nReadLen = nSpace;
+        } else if (_pPes->nWithPcr && _pPes->nPos == 0) {
+                //已经有adaptation了，直接在后面填充
+                int nPadLen = nSpace - nReadLen;
+                memset(pData, 0xff, nPadLen);
+                _pData[4] += nPadLen;
+                pData += nPadLen;
+        } else {
+                //两字节的adaptation_field头，放不下的话少读一个字节留到下一个包
+                if (nReadLen > nSpace - 2) {
+                        nReadLen = nSpace - 2;
+                }
+                int nPadLen = nSpace - 2 - nReadLen;
+                pData[0] = nPadLen + 1;
+                pData[1] = 0x00;
+                memset(pData + 2, 0xff, nPadLen);
+                LinkSetAdaptationFieldFlag(_pData, LINK_ADAPTATION_BOTH);
+                pData += nPadLen + 2;
+        }
+        if (nPesHdrLen) {
+                writeTemplatePESHeader(_pTemplate, _pPes, pData, nPesHdrLen);
+                pData += nPesHdrLen;
+        }
+        
+        *_pReadLen = nReadLen;
+        return pData - _pData;
+}
+
+//先读pPrefix里剩下的部分，返回读了多少
+static int readPESPrefix(LinkPES *_pPes, uint8_t *_pData, int _nReadLen)
+{
+        int nLen = _pPes->nPrefixLen - _pPes->nPos;
+        if (nLen <= 0) {
+                return 0;
+        }
+        if (nLen > _nReadLen) {
+                nLen = _nReadLen;
+        }
+        memcpy(_pData, _pPes->pPrefix + _pPes->nPos, nLen);
+        _pPes->nPos += nLen;
+        return nLen;
+}
+
+int LinkGetTemplatePESData(LinkPESTemplate *_pTemplate, LinkPES *_pPes, uint8_t *_pData)
+{
+        if (_pPes->nPos == _pPes->nESDataLen)
+                return 0;
+        
+        int nReadLen = 0;
+        int nHdrLen = writeTemplatePacketHeader(_pTemplate, _pPes, _pData, &nReadLen);
+        int nPrefixLen = readPESPrefix(_pPes, &_pData[nHdrLen], nReadLen);
+        nHdrLen += nPrefixLen;
+        nReadLen -= nPrefixLen;
+        memcpy(&_pData[nHdrLen], _pPes->pESData + _pPes->nPos - _pPes->nPrefixLen, nReadLen);
+        _pPes->nPos += nReadLen;
+        return 188;
+}
+
+int LinkGetTemplatePESDataVec(LinkPESTemplate *_pTemplate, LinkPES *_pPes, uint8_t *_pHeader, struct iovec *_pVec)
+{
+        if (_pPes->nPos == _pPes->nESDataLen)
+                return 0;
+        
+        int nReadLen = 0;
+        int nHdrLen = writeTemplatePacketHeader(_pTemplate, _pPes, _pHeader, &nReadLen);
+        //prefix很短，拷到头后面
+        int nPrefixLen = readPESPrefix(_pPes, &_pHeader[nHdrLen], nReadLen);
+        nHdrLen += nPrefixLen;
+        nReadLen -= nPrefixLen;
+        _pVec[0].iov_base = _pHeader;
+        _pVec[0].iov_len = nHdrLen;
+        _pVec[1].iov_base = _pPes->pESData + _pPes->nPos - _pPes->nPrefixLen;
+        _pVec[1].iov_len = nReadLen;
         _pPes->nPos += nReadLen;
-        nRetLen += nReadLen;
-        assert(nRetLen == 188);
         return 188;
 }
 
@@ -400,9 +581,21 @@ int LinkWriteSDT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nA
         return 39+nRetLen;
 }
 
-int LinkWritePAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField)
+static void writeCrc(uint8_t *_pBuf, int _nLen)
+{
+        uint32_t c32 = crc32(_pBuf, _nLen);
+        uint8_t *pTmp =  (uint8_t*)&c32;
+        _pBuf[_nLen] = pTmp[3];
+        _pBuf[_nLen + 1] = pTmp[2];
+        _pBuf[_nLen + 2] = pTmp[1];
+        _pBuf[_nLen + 3] = pTmp[0];
+}
+
+int LinkWriteProgramPAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField, const LinkTsProgram *_pPrograms, int _nProgramCount)
 {
+        assert(_nProgramCount > 0 && _nProgramCount <= LINK_TS_MAX_PROGRAMS);
         int nRetLen = 4;
+        int i;
         LinkWriteTsHeader(_pBuf, _nUinitStartIndicator, _nCount, LINK_PAT_PID, _nAdaptationField);
         _pBuf += 4;
         if (_nUinitStartIndicator) {
@@ -410,10 +603,11 @@ int LinkWritePAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nA
                 nRetLen++;
                 _pBuf++; //pointer field
         }
+        int nSectionLen = 5 + 4 * _nProgramCount + 4;
         _pBuf[0] = 0; //table_id
         
-        _pBuf[1] = 0x80; //section_syntax_indicator 1bit(1);zero 1bit(0);reserved 2bit(0); include 4bit section length
-        _pBuf[2] = 0x0d; //section_length 12bit
+        _pBuf[1] = 0x80 | (nSectionLen >> 8); //section_syntax_indicator 1bit(1);zero 1bit(0);reserved 2bit(0); include 4bit section length
+        _pBuf[2] = nSectionLen & 0xff; //section_length 12bit
         
         _pBuf[3] = 0x00; //transport_stream_id 16bit
         _pBuf[4] = 0x01;
@@ -423,29 +617,77 @@ int LinkWritePAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nA
         _pBuf[6] = 0; //section_number 8bit
         _pBuf[7] = 0; //last_section_number 8bit
         
-        _pBuf[8] = 0; //program_number 16bit
-        _pBuf[9] = 0x01;
-        
-        _pBuf[10] = 0xF0; //reserved 3bit(7);
-        _pBuf[11] = 0x00; //program_map_PID 13bit(4096)
-        
-        uint32_t c32 = crc32(_pBuf, 12);
-        uint8_t *pTmp =  (uint8_t*)&c32;
-        _pBuf[12] = pTmp[3];
-        _pBuf[13] = pTmp[2];
-        _pBuf[14] = pTmp[1];
-        _pBuf[15] = pTmp[0];
+        uint8_t *pEntry = _pBuf + 8;
+        for (i = 0; i < _nProgramCount; i++) {
+                pEntry[0] = _pPrograms[i].nProgramNumber >> 8; //program_number 16bit
+                pEntry[1] = _pPrograms[i].nProgramNumber & 0xff;
+                pEntry[2] = 0xE0 | (_pPrograms[i].nPmtPid >> 8); //reserved 3bit(7); program_map_PID 13bit
+                pEntry[3] = _pPrograms[i].nPmtPid & 0xff;
+                pEntry += 4;
+        }
         
-        return 16+nRetLen;
+        writeCrc(_pBuf, 3 + nSectionLen - 4);
+        return 3 + nSectionLen + nRetLen;
 }
 
+int LinkWritePAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField)
+{
+        LinkTsProgram program = {1, LINK_PMT_PID, LINK_VIDEO_PID, 0, LINK_AUDIO_PID, 0};
+        return LinkWriteProgramPAT(_pBuf, _nUinitStartIndicator, _nCount, _nAdaptationField, &program, 1);
+}
 
-int LinkWritePMT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField, int _nVStreamType, int _nAStreamType)
+static uint8_t * writePmtStream(uint8_t *_pBuf, int _nStreamType, int _nPid)
 {
-        assert(_nVStreamType ||  _nAStreamType);
+        _pBuf[0] = _nStreamType; //stream_type 8bit
+        _pBuf[1] = 0xE0 | (_nPid >> 8); //reserved 3bit(7), include elementary_PID 5bit
+        _pBuf[2] = _nPid & 0xff; //remain elementary_PID 8bit
+        _pBuf[3] = 0xF0; //reserved 4bit, include ES_info_length 4bit
+        _pBuf[4] = 0x00; //remaint ES_info_length 8bit
+        return _pBuf + 5;
+}
+
+//hls的id3 timed metadata。application format和format都是'ID3 '，metadata_service_id为0
+static uint8_t * writeId3MetadataFormat(uint8_t *_pBuf)
+{
+        _pBuf[0] = 0xFF; //metadata_application_format 16bit
+        _pBuf[1] = 0xFF;
+        memcpy(_pBuf + 2, "ID3 ", 4); //metadata_application_format_identifier 32bit
+        _pBuf[6] = 0xFF; //metadata_format 8bit
+        memcpy(_pBuf + 7, "ID3 ", 4); //metadata_format_identifier 32bit
+        _pBuf[11] = 0x00; //metadata_service_id 8bit
+        return _pBuf + 12;
+}
+
+static uint8_t * writeMetadataPointerDescriptor(uint8_t *_pBuf, int _nProgramNumber)
+{
+        _pBuf[0] = 0x25; //metadata_pointer_descriptor
+        _pBuf[1] = 15;
+        _pBuf = writeId3MetadataFormat(_pBuf + 2);
+        _pBuf[0] = 0x1F; //metadata_locator_record_flag 1bit(0); MPEG_carriage_flags 2bit(0 同一个ts); reserved 5bit
+        _pBuf[1] = _nProgramNumber >> 8;
+        _pBuf[2] = _nProgramNumber & 0xff;
+        return _pBuf + 3;
+}
+
+static uint8_t * writeMetadataStream(uint8_t *_pBuf, int _nStreamType, int _nPid)
+{
+        uint8_t *pEnd = writePmtStream(_pBuf, _nStreamType, _nPid);
+        pEnd[0] = 0x26; //metadata_descriptor
+        pEnd[1] = 13;
+        pEnd = writeId3MetadataFormat(pEnd + 2);
+        pEnd[0] = 0x0F; //decoder_config_flags 3bit(0); DSM-CC_flag 1bit(0); reserved 4bit
+        pEnd++;
+        int nInfoLen = pEnd - _pBuf - 5;
+        _pBuf[3] = 0xF0 | (nInfoLen >> 8);
+        _pBuf[4] = nInfoLen & 0xff;
+        return pEnd;
+}
+
+int LinkWriteProgramPMT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField, const LinkTsProgram *_pProgram)
+{
+        assert(_pProgram->nVideoStreamType ||  _pProgram->nAudioStreamType);
         int nRetLen = 4;
-        int noAOrV = 0;
-        LinkWriteTsHeader(_pBuf, _nUinitStartIndicator, _nCount, LINK_PMT_PID, _nAdaptationField);
+        LinkWriteTsHeader(_pBuf, _nUinitStartIndicator, _nCount, _pProgram->nPmtPid, _nAdaptationField);
         _pBuf += 4;
         if (_nUinitStartIndicator) {
                 _pBuf[0] = 0;
@@ -453,53 +695,48 @@ int LinkWritePMT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nA
                 nRetLen++;
         }
         
+        //pcr在视频pes里，没有视频就不带pcr
+        int nPcrPid = _pProgram->nVideoStreamType ? _pProgram->nVideoPid : LINK_NULL_PID;
         _pBuf[0] = 0x02; //table_id
         
-        _pBuf[1] = 0x80; //section_syntax_indicator 1bit;zero 1bit;reserved 2bit; include 4bit section length
-        _pBuf[2] = 0x17; //section_length 12bit
-        
-        _pBuf[3] = 0x00; //program_number 16bit
-        _pBuf[4] = 0x01;
+        _pBuf[3] = _pProgram->nProgramNumber >> 8; //program_number 16bit
+        _pBuf[4] = _pProgram->nProgramNumber & 0xff;
         
-        _pBuf[5] = 0xC1; //reserved 2bit(3); version_number 5bit(0);current_next_indicator 1bit(1)
+        _pBuf[5] = 0xC1 | ((_pProgram->nVersion & 0x1F) << 1); //reserved 2bit(3); version_number 5bit;current_next_indicator 1bit(1)
         
         _pBuf[6] = 0; //section_number 8bit
         _pBuf[7] = 0; //last_section_number 8bit
         
-        _pBuf[8] = 0xE1; //reserved 3bit(14); PCR_PID prev 5bit
-        _pBuf[9] = 0x00; //PCR_PID remain 8bit //这个是视频的PID
+        _pBuf[8] = 0xE0 | (nPcrPid >> 8); //reserved 3bit(7); PCR_PID prev 5bit
+        _pBuf[9] = nPcrPid & 0xff; //PCR_PID remain 8bit
         
         _pBuf[10] = 0xF0; //reserved 4bit
         _pBuf[11] = 0x00; //program_info_length 12bit(00 mean no descriptor)
         
-        if (_nVStreamType != 0) {
-                _pBuf[12] = _nVStreamType; //stream_type 8bit STREAM_TYPE_VIDEO_H264
-                _pBuf[13] = 0xE1; //reserved 3bit(7), include elementary_PID 5bit
-                _pBuf[14] = 0x00; //remain elementary_PID 8bit
-                _pBuf[15] = 0xF0; //reserved 4bit, include program_info_length 4bit
-                _pBuf[16] = 0x00; //remaint program_info_length 8bit
-        } else {
-                _pBuf[2] = 0x12; //section_length 12bit
-                noAOrV = -5;
+        uint8_t *pEnd = _pBuf + 12;
+        if (_pProgram->nMetadataStreamType != 0) {
+                pEnd = writeMetadataPointerDescriptor(pEnd, _pProgram->nProgramNumber);
+                _pBuf[11] = pEnd - _pBuf - 12;
         }
-        
-        if (_nAStreamType != 0) {
-                _pBuf[17] = _nAStreamType; //stream_type 8bit STREAM_TYPE_VIDEO_H264
-                _pBuf[18] = 0xE1; //reserved 3bit(7), include elementary_PID 5bit
-                _pBuf[19] = 0x01; //remain elementary_PID 8bit
-                _pBuf[20] = 0xF0; //reserved 4bit, include program_info_length 4bit
-                _pBuf[21] = 0x00; //remaint program_info_length 8bit
-        } else {
-                noAOrV = -5;
-                _pBuf[2] = 0x12; //section_length 12bit
+        if (_pProgram->nVideoStreamType != 0) {
+                pEnd = writePmtStream(pEnd, _pProgram->nVideoStreamType, _pProgram->nVideoPid);
         }
+        if (_pProgram->nAudioStreamType != 0) {
+                pEnd = writePmtStream(pEnd, _pProgram->nAudioStreamType, _pProgram->nAudioPid);
+        }
+        if (_pProgram->nMetadataStreamType != 0) {
+                pEnd = writeMetadataStream(pEnd, _pProgram->nMetadataStreamType, _pProgram->nMetadataPid);
+        }
+        int nSectionLen = (pEnd - _pBuf) - 3 + 4;
+        _pBuf[1] = 0x80 | (nSectionLen >> 8); //section_syntax_indicator 1bit;zero 1bit;reserved 2bit; include 4bit section length
+        _pBuf[2] = nSectionLen & 0xff; //section_length 12bit
         
-        uint32_t c32 = crc32(_pBuf, 22);
-        uint8_t *pTmp =  (uint8_t*)&c32;
-        _pBuf[22] = pTmp[3];
-        _pBuf[23] = pTmp[2];
-        _pBuf[24] = pTmp[1];
-        _pBuf[25] = pTmp[0];
-        
-        return 26+nRetLen+noAOrV;
+        writeCrc(_pBuf, pEnd - _pBuf);
+        return (pEnd - _pBuf) + 4 + nRetLen;
+}
+
+int LinkWritePMT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField, int _nVStreamType, int _nAStreamType)
+{
+        LinkTsProgram program = {1, LINK_PMT_PID, LINK_VIDEO_PID, _nVStreamType, LINK_AUDIO_PID, _nAStreamType};
+        return LinkWriteProgramPMT(_pBuf, _nUinitStartIndicator, _nCount, _nAdaptationField, &program);
 }
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
 #include "base.h"
 
 /* pids */
@@ -13,6 +14,15 @@
 #define LINK_PMT_PID 0x1000
 #define LINK_VIDEO_PID 0x100
 #define LINK_AUDIO_PID 0x101
+#define LINK_METADATA_PID 0x102
+
+//多节目ts(mpts)第i个节目(从0开始)的pid，第0个节目和单节目ts一样
+#define LINK_TS_MAX_PROGRAMS 16
+#define LINK_PROGRAM_PMT_PID(i) (LINK_PMT_PID + (i))
+#define LINK_PROGRAM_VIDEO_PID(i) (LINK_VIDEO_PID + 0x10 * (i))
+#define LINK_PROGRAM_AUDIO_PID(i) (LINK_AUDIO_PID + 0x10 * (i))
+#define LINK_PROGRAM_METADATA_PID(i) (LINK_METADATA_PID + 0x10 * (i))
+#define LINK_NULL_PID 0x1FFF
 
 /* table ids */
 #define LINK_PAT_TID   0x00
@@ -28,27 +38,68 @@
 
 
 typedef int (*LinkTsPacketCallback)(void *pOpaque, void* pTsData, int nTsDataLen);
+//申请nTsDataLen长度的输出内存，ts包直接写到里面。返回NULL时写到临时buffer再调用LinkTsPacketCallback
+typedef uint8_t *(*LinkTsPacketReserve)(void *pOpaque, int nTsDataLen);
+typedef int (*LinkTsPacketCommit)(void *pOpaque, int nTsDataLen);
+//一个ts包分成两段: pVec[0]是生成的ts头/adaptation/pes头，pVec[1]直接指向es数据(可能长度为0)，一共188字节
+typedef int (*LinkTsPacketVecCallback)(void *pOpaque, const struct iovec *pVec, int nVecCount);
+
+//pat/pmt里一个节目的描述。stream type为0表示没有这路流
+typedef struct _LinkTsProgram {
+        int nProgramNumber;
+        int nPmtPid;
+        int nVideoPid;
+        int nVideoStreamType;
+        int nAudioPid;
+        int nAudioStreamType;
+        int nMetadataPid;
+        int nMetadataStreamType; //不为0时pmt带上id3 timed metadata的描述符(metadata_pointer/metadata_descriptor)
+        int nVersion; //pmt的version_number，0-31
+}LinkTsProgram;
 
 typedef struct _LinkPES LinkPES;
 typedef struct _LinkPES{
         uint8_t *pESData;
-        int nESDataLen;
-        int nPos; //指向pESData
+        int nESDataLen; //包括pPrefix
+        int nPos; //指向pPrefix+pESData
+        const uint8_t *pPrefix; //在pESData前面输出(比如aac的adts头)，不用拷贝拼接。只有模板打包支持
+        int nPrefixLen;
         int nStreamId; //Audio streams (0xC0-0xDF), Video streams (0xE0-0xEF)
         int nPid;
         int64_t nPts;
         uint8_t nWithPcr;
         uint8_t nPrivate;
+        uint8_t nWithoutAud; //es数据第一个NAL已经是aud了，不用再加
         LinkVideoFormat videoFormat;
         //设想是传入h264(或者音频)给pESData， 在封装ts时候每次应该封装多少长度的数据是应该知道的
         //也是尽量减少内存使用
 }LinkPES;
 
+//每路es流一个打包模板，创建muxer时生成。ts头和pes头(h264/h265包括aud)预先写好，
+//之后每帧只改pes长度和pts，每个ts包只改continuity_counter，不用再判断格式
+typedef struct _LinkPESTemplate {
+        uint8_t tsHeader[4];
+        uint8_t pesHeader[32];
+        int nPesHeaderLen;
+        int nAudLen; //pesHeader最后的aud长度，帧自己带aud时不写
+        int nCounter;
+}LinkPESTemplate;
+
 void LinkInitVideoPESWithPcr(LinkPES *_pPes, LinkVideoFormat fmt, uint8_t *_pData, int _nDataLen, int64_t _nPts);
 void LinkInitVideoPES(LinkPES *pPes, LinkVideoFormat fmt, uint8_t *pData, int nDataLen, int64_t nPts);
 void LinkInitAudioPES(LinkPES *pPes, uint8_t *pData, int nDataLen, int64_t nPts);
+void LinkInitAudioPESWithPrefix(LinkPES *pPes, const uint8_t *pPrefix, int nPrefixLen, uint8_t *pData, int nDataLen, int64_t nPts);
 void LinkInitPrivateTypePES(LinkPES *pPes, uint8_t *pData, int nDataLen, int64_t nPts);
+void LinkInitPrivateTypePESWithPrefix(LinkPES *pPes, const uint8_t *pPrefix, int nPrefixLen, uint8_t *pData, int nDataLen, int64_t nPts);
 int LinkGetPESData(LinkPES *pPes, int _nCounter, int _nPid, uint8_t *pData, int nLen); //返回0则到了EOF
+//和LinkGetPESData一样，但是不拷贝es数据。头写到pHeader(至少188字节)，pVec[2]返回两段
+int LinkGetPESDataVec(LinkPES *pPes, int nCounter, int nPid, uint8_t *pHeader, struct iovec *pVec);
+
+//音频流fmt传0，不带aud
+void LinkInitPESTemplate(LinkPESTemplate *pTemplate, int nPid, int nStreamId, LinkVideoFormat fmt);
+//和LinkGetPESData/LinkGetPESDataVec一样，但是头从模板生成，continuity_counter也由模板维护
+int LinkGetTemplatePESData(LinkPESTemplate *pTemplate, LinkPES *pPes, uint8_t *pData);
+int LinkGetTemplatePESDataVec(LinkPESTemplate *pTemplate, LinkPES *pPes, uint8_t *pHeader, struct iovec *pVec);
 
 int LinkWriteTsHeader(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nPid, int _nAdaptationField);
 void LinkSetAdaptationFieldFlag(uint8_t *_pBuf, int _nAdaptationField);
@@ -56,5 +107,8 @@ void LinkWriteContinuityCounter(uint8_t *pBuf, int nCounter);
 int LinkWriteSDT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField);
 int LinkWritePAT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField);
 int LinkWritePMT(uint8_t *_pBuf, int _nUinitStartIndicator, int _nCount, int _nAdaptationField, int _nVStreamType, int _nAStreamType);
+//LinkWritePAT/LinkWritePMT是这两个函数只有一个节目、用固定pid的情况。pat最多LINK_TS_MAX_PROGRAMS个节目，都在一个ts包里
+int LinkWriteProgramPAT(uint8_t *pBuf, int nUinitStartIndicator, int nCount, int nAdaptationField, const LinkTsProgram *pPrograms, int nProgramCount);
+int LinkWriteProgramPMT(uint8_t *pBuf, int nUinitStartIndicator, int nCount, int nAdaptationField, const LinkTsProgram *pProgram);
 
 #endif
@@ -0,0 +1,349 @@
+#include "nalu.h"
+#include <string.h>
+#include "log.h"
+#include "simd.h"
+
+#define H264_NAL_IDR 5
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+
+#define HEVC_NAL_BLA_W_LP 16
+#define HEVC_NAL_CRA_NUT 21
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+#define HEVC_NAL_AUD 35
+
+const uint8_t *LinkFindStartCode(const uint8_t *_pData, const uint8_t *_pEnd)
+{
+        const uint8_t *pOut = LinkSimdFindStartCode(_pData, _pEnd);
+        if (_pData < pOut && pOut < _pEnd && !pOut[-1])
+                pOut--;
+        return pOut;
+}
+
+static int getNaluType(LinkVideoFormat _fmt, uint8_t _nHdr)
+{
+        if (_fmt == LINK_VIDEO_H264) {
+                return _nHdr & 0x1f;
+        }
+        return (_nHdr >> 1) & 0x3f;
+}
+
+static int isAud(LinkVideoFormat _fmt, int _nType)
+{
+        if (_fmt == LINK_VIDEO_H264) {
+                return _nType == H264_NAL_AUD;
+        }
+        return _nType == HEVC_NAL_AUD;
+}
+
+static int isParamSet(LinkVideoFormat _fmt, int _nType)
+{
+        if (_fmt == LINK_VIDEO_H264) {
+                return _nType == H264_NAL_SPS || _nType == H264_NAL_PPS;
+        }
+        return _nType >= HEVC_NAL_VPS && _nType <= HEVC_NAL_PPS;
+}
+
+static int isVcl(LinkVideoFormat _fmt, int _nType)
+{
+        if (_fmt == LINK_VIDEO_H264) {
+                return _nType >= 1 && _nType <= H264_NAL_IDR;
+        }
+        return _nType <= 31;
+}
+
+static void setVclInfo(LinkVideoFormat _fmt, uint8_t _nHdr, LinkVideoFrameInfo *_pInfo)
+{
+        int nType = getNaluType(_fmt, _nHdr);
+        if (_fmt == LINK_VIDEO_H264) {
+                _pInfo->nIsKeyFrame = (nType == H264_NAL_IDR);
+                _pInfo->nIsReference = (_nHdr & 0x60) != 0;
+        } else {
+                //BLA, IDR, CRA都是IRAP，可以从这里开始解码
+                _pInfo->nIsKeyFrame = (nType >= HEVC_NAL_BLA_W_LP && nType <= HEVC_NAL_CRA_NUT);
+                //TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N等偶数类型是子层非参考帧
+                _pInfo->nIsReference = !(nType <= 14 && nType % 2 == 0);
+        }
+}
+
+void LinkAnalyzeVideoFrame(LinkVideoFormat _fmt, const uint8_t *_pData, int _nLen, LinkVideoFrameInfo *_pInfo, LinkParamSetCache *_pCache)
+{
+        const uint8_t *pEnd = _pData + _nLen;
+        const uint8_t *pNalu = LinkFindStartCode(_pData, pEnd);
+        int nParamSetLen = 0;
+        int nIsFirst = 1;
+
+        memset(_pInfo, 0, sizeof(LinkVideoFrameInfo));
+        _pInfo->nIsReference = 1;
+
+        while (pNalu < pEnd) {
+                const uint8_t *pPayload = pNalu + (pNalu[2] == 1 ? 3 : 4);
+                if (pPayload >= pEnd) {
+                        break;
+                }
+                int nType = getNaluType(_fmt, pPayload[0]);
+                if (isVcl(_fmt, nType)) {
+                        //slice数据不用扫描
+                        setVclInfo(_fmt, pPayload[0], _pInfo);
+                        break;
+                }
+
+                const uint8_t *pNext = LinkFindStartCode(pPayload, pEnd);
+                if (nIsFirst && isAud(_fmt, nType)) {
+                        _pInfo->nHasAud = 1;
+                        _pInfo->nAudLen = pNext - _pData;
+                } else if (isParamSet(_fmt, nType)) {
+                        _pInfo->nHasParamSet = 1;
+                        int nLen = pNext - pPayload;
+                        if (_pCache && nParamSetLen >= 0) {
+                                if (nParamSetLen + 4 + nLen > LINK_PARAM_SET_MAX) {
+                                        LinkLogWarn("parameter sets too large:%d", nParamSetLen + 4 + nLen);
+                                        nParamSetLen = -1;
+                                } else {
+                                        static const uint8_t startCode[4] = {0, 0, 0, 1};
+                                        memcpy(_pCache->data + nParamSetLen, startCode, 4);
+                                        memcpy(_pCache->data + nParamSetLen + 4, pPayload, nLen);
+                                        nParamSetLen += 4 + nLen;
+                                }
+                        }
+                }
+                nIsFirst = 0;
+                pNalu = pNext;
+        }
+
+        //帧里的参数集整组替换缓存的
+        if (_pCache && _pInfo->nHasParamSet) {
+                _pCache->nLen = nParamSetLen > 0 ? nParamSetLen : 0;
+        }
+}
+
+int LinkIsAudPrefixed(LinkVideoFormat _fmt, const uint8_t *_pData, int _nLen)
+{
+        int nOffset = 0;
+        if (_nLen > 3 && _pData[0] == 0 && _pData[1] == 0 && _pData[2] == 1) {
+                nOffset = 3;
+        } else if (_nLen > 4 && _pData[0] == 0 && _pData[1] == 0 && _pData[2] == 0 && _pData[3] == 1) {
+                nOffset = 4;
+        } else {
+                return 0;
+        }
+        return isAud(_fmt, getNaluType(_fmt, _pData[nOffset]));
+}
+
+#define SPS_MAX_LEN 256
+
+typedef struct _BitReader {
+        const uint8_t *pData;
+        int nBits;
+        int nPos;
+}BitReader;
+
+static int readBit(BitReader *_pReader)
+{
+        if (_pReader->nPos >= _pReader->nBits) {
+                _pReader->nPos++;
+                return 0;
+        }
+        int nBit = (_pReader->pData[_pReader->nPos >> 3] >> (7 - (_pReader->nPos & 7))) & 1;
+        _pReader->nPos++;
+        return nBit;
+}
+
+static uint32_t readBits(BitReader *_pReader, int _nCount)
+{
+        uint32_t nValue = 0;
+        while (_nCount-- > 0) {
+                nValue = (nValue << 1) | readBit(_pReader);
+        }
+        return nValue;
+}
+
+static uint32_t readUe(BitReader *_pReader)
+{
+        int nZeros = 0;
+        while (readBit(_pReader) == 0 && nZeros < 32) {
+                nZeros++;
+        }
+        if (nZeros >= 32) {
+                return 0;
+        }
+        return (1u << nZeros) - 1 + readBits(_pReader, nZeros);
+}
+
+static int32_t readSe(BitReader *_pReader)
+{
+        uint32_t nValue = readUe(_pReader);
+        return (nValue & 1) ? (int32_t)((nValue + 1) / 2) : -(int32_t)(nValue / 2);
+}
+
+//去掉emulation prevention(00 00 03)
+static int unescapeRbsp(const uint8_t *_pData, int _nLen, uint8_t *_pOut, int _nOutLen)
+{
+        int nZeros = 0;
+        int nOut = 0;
+        int i;
+        for (i = 0; i < _nLen && nOut < _nOutLen; i++) {
+                if (nZeros >= 2 && _pData[i] == 3) {
+                        nZeros = 0;
+                        continue;
+                }
+                nZeros = _pData[i] == 0 ? nZeros + 1 : 0;
+                _pOut[nOut++] = _pData[i];
+        }
+        return nOut;
+}
+
+static void skipScalingList(BitReader *_pReader, int _nSize)
+{
+        int nLast = 8;
+        int nNext = 8;
+        int i;
+        for (i = 0; i < _nSize && nNext != 0; i++) {
+                nNext = (nLast + readSe(_pReader) + 256) % 256;
+                if (nNext != 0) {
+                        nLast = nNext;
+                }
+        }
+}
+
+static int parseH264Sps(BitReader *_pReader, LinkSpsInfo *_pInfo)
+{
+        int nProfile = readBits(_pReader, 8);
+        readBits(_pReader, 16); //constraint_set, level_idc
+        readUe(_pReader);
+        _pInfo->nChromaFormat = 1;
+        _pInfo->nBitDepthLuma = 8;
+        _pInfo->nBitDepthChroma = 8;
+        if (nProfile == 100 || nProfile == 110 || nProfile == 122 || nProfile == 244 || nProfile == 44 ||
+            nProfile == 83 || nProfile == 86 || nProfile == 118 || nProfile == 128 || nProfile == 138 ||
+            nProfile == 139 || nProfile == 134 || nProfile == 135) {
+                _pInfo->nChromaFormat = readUe(_pReader);
+                if (_pInfo->nChromaFormat == 3) {
+                        readBit(_pReader);
+                }
+                _pInfo->nBitDepthLuma = readUe(_pReader) + 8;
+                _pInfo->nBitDepthChroma = readUe(_pReader) + 8;
+                readBit(_pReader);
+                if (readBit(_pReader)) {
+                        int i;
+                        for (i = 0; i < (_pInfo->nChromaFormat != 3 ? 8 : 12); i++) {
+                                if (readBit(_pReader)) {
+                                        skipScalingList(_pReader, i < 6 ? 16 : 64);
+                                }
+                        }
+                }
+        }
+        readUe(_pReader); //log2_max_frame_num_minus4
+        int nPocType = readUe(_pReader);
+        if (nPocType == 0) {
+                readUe(_pReader);
+        } else if (nPocType == 1) {
+                readBit(_pReader);
+                readSe(_pReader);
+                readSe(_pReader);
+                uint32_t nCycle = readUe(_pReader);
+                uint32_t i;
+                for (i = 0; i < nCycle && _pReader->nPos < _pReader->nBits; i++) {
+                        readSe(_pReader);
+                }
+        }
+        readUe(_pReader); //max_num_ref_frames
+        readBit(_pReader);
+        int nWidthMbs = readUe(_pReader) + 1;
+        int nHeightMaps = readUe(_pReader) + 1;
+        int nFrameMbsOnly = readBit(_pReader);
+        if (!nFrameMbsOnly) {
+                readBit(_pReader);
+        }
+        readBit(_pReader); //direct_8x8_inference_flag
+        int nCropLeft = 0, nCropRight = 0, nCropTop = 0, nCropBottom = 0;
+        if (readBit(_pReader)) {
+                nCropLeft = readUe(_pReader);
+                nCropRight = readUe(_pReader);
+                nCropTop = readUe(_pReader);
+                nCropBottom = readUe(_pReader);
+        }
+        int nCropUnitX = 1;
+        int nCropUnitY = 2 - nFrameMbsOnly;
+        if (_pInfo->nChromaFormat == 1 || _pInfo->nChromaFormat == 2) {
+                nCropUnitX = 2;
+        }
+        if (_pInfo->nChromaFormat == 1) {
+                nCropUnitY *= 2;
+        }
+        _pInfo->nWidth = nWidthMbs * 16 - nCropUnitX * (nCropLeft + nCropRight);
+        _pInfo->nHeight = (2 - nFrameMbsOnly) * nHeightMaps * 16 - nCropUnitY * (nCropTop + nCropBottom);
+        return 0;
+}
+
+static int parseH265Sps(BitReader *_pReader, LinkSpsInfo *_pInfo)
+{
+        readBits(_pReader, 4); //sps_video_parameter_set_id
+        int nMaxSubLayersMinus1 = readBits(_pReader, 3);
+        _pInfo->nMaxSubLayers = nMaxSubLayersMinus1 + 1;
+        _pInfo->nTemporalIdNested = readBit(_pReader);
+        //这里还是字节对齐的，general的profile_tier_level直接拷贝
+        if (_pReader->nBits < _pReader->nPos + 96) {
+                return LINK_ARG_ERROR;
+        }
+        memcpy(_pInfo->profileTierLevel, _pReader->pData + _pReader->nPos / 8, 12);
+        _pReader->nPos += 96;
+        int nProfilePresent[8] = {0};
+        int nLevelPresent[8] = {0};
+        int i;
+        for (i = 0; i < nMaxSubLayersMinus1; i++) {
+                nProfilePresent[i] = readBit(_pReader);
+                nLevelPresent[i] = readBit(_pReader);
+        }
+        if (nMaxSubLayersMinus1 > 0) {
+                _pReader->nPos += (8 - nMaxSubLayersMinus1) * 2;
+        }
+        for (i = 0; i < nMaxSubLayersMinus1; i++) {
+                _pReader->nPos += nProfilePresent[i] ? 88 : 0;
+                _pReader->nPos += nLevelPresent[i] ? 8 : 0;
+        }
+        readUe(_pReader); //sps_seq_parameter_set_id
+        _pInfo->nChromaFormat = readUe(_pReader);
+        if (_pInfo->nChromaFormat == 3) {
+                readBit(_pReader);
+        }
+        int nWidth = readUe(_pReader);
+        int nHeight = readUe(_pReader);
+        if (readBit(_pReader)) {
+                int nSubWidth = (_pInfo->nChromaFormat == 1 || _pInfo->nChromaFormat == 2) ? 2 : 1;
+                int nSubHeight = _pInfo->nChromaFormat == 1 ? 2 : 1;
+                int nLeft = readUe(_pReader);
+                int nRight = readUe(_pReader);
+                int nTop = readUe(_pReader);
+                int nBottom = readUe(_pReader);
+                nWidth -= nSubWidth * (nLeft + nRight);
+                nHeight -= nSubHeight * (nTop + nBottom);
+        }
+        _pInfo->nWidth = nWidth;
+        _pInfo->nHeight = nHeight;
+        _pInfo->nBitDepthLuma = readUe(_pReader) + 8;
+        _pInfo->nBitDepthChroma = readUe(_pReader) + 8;
+        return 0;
+}
+
+int LinkParseSps(LinkVideoFormat _fmt, const uint8_t *_pData, int _nLen, LinkSpsInfo *_pInfo)
+{
+        uint8_t rbsp[SPS_MAX_LEN];
+        int nHeaderLen = _fmt == LINK_VIDEO_H264 ? 1 : 2;
+        memset(_pInfo, 0, sizeof(LinkSpsInfo));
+        if (_nLen <= nHeaderLen) {
+                return LINK_ARG_ERROR;
+        }
+        BitReader reader;
+        reader.pData = rbsp;
+        reader.nBits = unescapeRbsp(_pData + nHeaderLen, _nLen - nHeaderLen, rbsp, sizeof(rbsp)) * 8;
+        reader.nPos = 0;
+        int nRet = _fmt == LINK_VIDEO_H264 ? parseH264Sps(&reader, _pInfo) : parseH265Sps(&reader, _pInfo);
+        if (nRet != 0 || reader.nPos > reader.nBits || _pInfo->nWidth <= 0 || _pInfo->nHeight <= 0) {
+                return LINK_ARG_ERROR;
+        }
+        return 0;
+}
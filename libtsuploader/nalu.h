@@ -0,0 +1,46 @@
+#ifndef __LINK_NALU_H__
+#define __LINK_NALU_H__
+
+#include <stdint.h>
+#include "base.h"
+
+#define LINK_PARAM_SET_MAX 1024
+
+//sps/pps(h265还有vps)，带4字节start code，按在帧里出现的顺序存放
+typedef struct _LinkParamSetCache {
+        uint8_t data[LINK_PARAM_SET_MAX];
+        int nLen;
+}LinkParamSetCache;
+
+typedef struct _LinkVideoFrameInfo {
+        int nIsKeyFrame;   //h264 IDR, h265 IRAP
+        int nIsReference;  //第一个VCL NAL是不是参考帧
+        int nHasParamSet;  //帧里自己带了sps/pps/vps
+        int nHasAud;       //第一个NAL是aud
+        int nAudLen;       //aud(包括start code)的长度，参数集要插到aud后面
+}LinkVideoFrameInfo;
+
+//fmp4的avcC/hvcC和tkhd要用的sps字段
+typedef struct _LinkSpsInfo {
+        int nWidth;
+        int nHeight;
+        int nChromaFormat;
+        int nBitDepthLuma;
+        int nBitDepthChroma;
+        int nMaxSubLayers;     //h265
+        int nTemporalIdNested; //h265
+        uint8_t profileTierLevel[12]; //h265 general_profile_space到general_level_idc
+}LinkSpsInfo;
+
+//返回start code(00 00 01或者00 00 00 01)开始的位置，start code后面至少要有一个字节，找不到返回pEnd
+const uint8_t *LinkFindStartCode(const uint8_t *pData, const uint8_t *pEnd);
+
+//只扫描第一个VCL NAL之前的部分。pCache不为NULL时用帧里的参数集更新它
+void LinkAnalyzeVideoFrame(LinkVideoFormat fmt, const uint8_t *pData, int nLen, LinkVideoFrameInfo *pInfo, LinkParamSetCache *pCache);
+
+int LinkIsAudPrefixed(LinkVideoFormat fmt, const uint8_t *pData, int nLen);
+
+//pData是不带start code的sps，返回0成功
+int LinkParseSps(LinkVideoFormat fmt, const uint8_t *pData, int nLen, LinkSpsInfo *pInfo);
+
+#endif
@@ -1,5 +1,8 @@
 #include "queue.h"
+#include "spscqueue.h"
 #include "base.h"
+#include <limits.h>
+#include <time.h>
 
 
 #define QUEUE_READ_ONLY_STATE 1
@@ -19,11 +22,46 @@ typedef struct _CircleQueueImp{
         enum CircleQueuePolicy policy;
         LinkUploaderStatInfo statInfo;
 	int nIsAvailableAfterTimeout;
+        int nWaiting_; //消费者正在等数据
+        int nWakeupThreshold_;
 }CircleQueueImp;
 
-static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
+static inline char * getInlineData(CircleQueueImp *pQueueImp)
+{
+        return (char *)pQueueImp + sizeof(CircleQueueImp);
+}
+
+// 统计都在mutex_里更新，getStatInfo加锁拿到的是一致的快照
+static inline void updatePushStat(CircleQueueImp *pQueueImp, int nDataLen)
+{
+        pQueueImp->statInfo.nPushDataBytes_ += nDataLen;
+        if (pQueueImp->nLen_ > pQueueImp->statInfo.nHighWaterMark) {
+                pQueueImp->statInfo.nHighWaterMark = pQueueImp->nLen_;
+        }
+}
+
+// 只有消费者在等，并且数据够了才唤醒。在mutex_里调用
+static inline int shouldWakeup(CircleQueueImp *pQueueImp)
+{
+        return pQueueImp->nWaiting_ && pQueueImp->nLen_ >= pQueueImp->nWakeupThreshold_;
+}
+
+static void writeItem(CircleQueueImp *pQueueImp, int nPos, const struct iovec *_pVec, int _nVecCount, int nDataLen)
+{
+        char *pItem = pQueueImp->pData_ + nPos * pQueueImp->nItemLen_;
+        int i;
+        memcpy(pItem, &nDataLen, sizeof(int));
+        pItem += sizeof(int);
+        for (i = 0; i < _nVecCount; i++) {
+                memcpy(pItem, _pVec[i].iov_base, _pVec[i].iov_len);
+                pItem += _pVec[i].iov_len;
+        }
+}
+
+static int PushQueueVec(LinkCircleQueue *_pQueue, const struct iovec *_pVec, int _nVecCount)
 {
         CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
+        int nDataLen = LinkGetIovecLen(_pVec, _nVecCount);
         assert(pQueueImp->nItemLen_ - sizeof(int) >= nDataLen);
 
         pthread_mutex_lock(&pQueueImp->mutex_);
@@ -48,12 +86,14 @@ static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
                 } else {
                         pQueueImp->nEnd_++;
                 }
-                memcpy(pQueueImp->pData_ + nPos * pQueueImp->nItemLen_, &nDataLen, sizeof(int));
-                memcpy(pQueueImp->pData_ + nPos * pQueueImp->nItemLen_ + sizeof(int), pData_, nDataLen);
+                writeItem(pQueueImp, nPos, _pVec, _nVecCount, nDataLen);
                 pQueueImp->nLen_++;
+                updatePushStat(pQueueImp, nDataLen);
+                int nWakeup = shouldWakeup(pQueueImp);
                 pthread_mutex_unlock(&pQueueImp->mutex_);
-                pthread_cond_signal(&pQueueImp->condition_);
-                pQueueImp->statInfo.nPushDataBytes_ += nDataLen;
+                if (nWakeup) {
+                        pthread_cond_signal(&pQueueImp->condition_);
+                }
                 return nDataLen;
         }
         
@@ -66,13 +106,14 @@ static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
                                 pQueueImp->nEnd_++;
                                 pQueueImp->nStart_++;
                         }
-                        memcpy(pQueueImp->pData_ + nPos * pQueueImp->nItemLen_, &nDataLen, sizeof(int));
-                        memcpy(pQueueImp->pData_ + nPos * pQueueImp->nItemLen_  + sizeof(int), pData_, nDataLen);
-                        pthread_mutex_unlock(&pQueueImp->mutex_);
-                        pthread_cond_signal(&pQueueImp->condition_);
-
-                        pQueueImp->statInfo.nPushDataBytes_ += nDataLen;
+                        writeItem(pQueueImp, nPos, _pVec, _nVecCount, nDataLen);
+                        updatePushStat(pQueueImp, nDataLen);
                         pQueueImp->statInfo.nOverwriteCnt++;
+                        int nWakeup = shouldWakeup(pQueueImp);
+                        pthread_mutex_unlock(&pQueueImp->mutex_);
+                        if (nWakeup) {
+                                pthread_cond_signal(&pQueueImp->condition_);
+                        }
                         return LINK_Q_OVERWRIT;
                 } else{
                         char *pTmp = (char *)malloc(pQueueImp->nItemLen_ * pQueueImp->nCap_ * 2);
@@ -81,28 +122,30 @@ static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
                                 pthread_mutex_unlock(&pQueueImp->mutex_);
                                 return -1;
                         }
-                        pQueueImp->nCap_ *= 2;
-                        //TODO
-                        free(pQueueImp->pData_);
-                        pQueueImp->pData_ = pTmp;
-                        
-                        
+                        //队列是满的，nStart_ == nEnd_。按先后顺序搬到新内存的开头
                         memcpy(pTmp,
                                pQueueImp->pData_ + pQueueImp->nStart_ * pQueueImp->nItemLen_,
                                (nOriginCap - pQueueImp->nStart_) * pQueueImp->nItemLen_);
                         memcpy(pTmp + (nOriginCap - pQueueImp->nStart_) * pQueueImp->nItemLen_,
-                               pQueueImp->pData_ + pQueueImp->nEnd_ * pQueueImp->nItemLen_,
-                               pQueueImp->nEnd_ * pQueueImp->nItemLen_);
+                               pQueueImp->pData_,
+                               pQueueImp->nStart_ * pQueueImp->nItemLen_);
+                        if (pQueueImp->pData_ != getInlineData(pQueueImp)) {
+                                free(pQueueImp->pData_);
+                        }
+                        pQueueImp->pData_ = pTmp;
+                        pQueueImp->nCap_ *= 2;
                         pQueueImp->nStart_ = 0;
+                        nPos = nOriginCap;
                         pQueueImp->nEnd_ = nOriginCap + 1;
-                        memcpy(pQueueImp->pData_ + nPos * pQueueImp->nItemLen_, &nDataLen, sizeof(int));
-                        memcpy(pTmp + nOriginCap * pQueueImp->nItemLen_ + sizeof(int), pData_, nDataLen);
+                        writeItem(pQueueImp, nPos, _pVec, _nVecCount, nDataLen);
                         
                         pQueueImp->nLen_++;
+                        updatePushStat(pQueueImp, nDataLen);
+                        int nWakeup = shouldWakeup(pQueueImp);
                         pthread_mutex_unlock(&pQueueImp->mutex_);
-                        pthread_cond_signal(&pQueueImp->condition_);
-
-                        pQueueImp->statInfo.nPushDataBytes_ += nDataLen;
+                        if (nWakeup) {
+                                pthread_cond_signal(&pQueueImp->condition_);
+                        }
                         return nDataLen;
                 }
         }
@@ -112,6 +155,12 @@ static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
         return -1;
 }
 
+static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
+{
+        struct iovec vec = {pData_, nDataLen};
+        return PushQueueVec(_pQueue, &vec, 1);
+}
+
 static int PopQueueWithTimeout(LinkCircleQueue *_pQueue, char *pBuf_, int nBufLen, int64_t nUSec)
 {
         CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
@@ -126,21 +175,24 @@ static int PopQueueWithTimeout(LinkCircleQueue *_pQueue, char *pBuf_, int nBufLe
                 return 0;
         }
         
-        int ret = 0;
-        while (pQueueImp->nLen_ == 0) {
-                struct timeval now;
-                gettimeofday(&now, NULL);
+        if (pQueueImp->nLen_ == 0) {
+                int ret = 0;
                 struct timespec timeout;
-                timeout.tv_sec = now.tv_sec + nUSec / 1000000;
-                timeout.tv_nsec = (now.tv_usec + nUSec % 1000000) * 1000;
-                
-                ret = pthread_cond_timedwait(&pQueueImp->condition_, &pQueueImp->mutex_, &timeout);
-                if (ret == ETIMEDOUT) {
-                        pthread_mutex_unlock(&pQueueImp->mutex_);
-                        pQueueImp->nQState_ = QUEUE_TIMEOUT_STATE;
-                        return LINK_TIMEOUT;
+                LinkGetCondDeadline(&timeout, nUSec);
+                pQueueImp->nWaiting_ = 1;
+                while (pQueueImp->nLen_ < pQueueImp->nWakeupThreshold_ && pQueueImp->nQState_ != QUEUE_READ_ONLY_STATE) {
+                        ret = pthread_cond_timedwait(&pQueueImp->condition_, &pQueueImp->mutex_, &timeout);
+                        if (ret == ETIMEDOUT) {
+                                break;
+                        }
                 }
+                pQueueImp->nWaiting_ = 0;
                 if (pQueueImp->nLen_ == 0) {
+                        if (ret == ETIMEDOUT) {
+                                pQueueImp->nQState_ = QUEUE_TIMEOUT_STATE;
+                                pthread_mutex_unlock(&pQueueImp->mutex_);
+                                return LINK_TIMEOUT;
+                        }
                         pthread_mutex_unlock(&pQueueImp->mutex_);
                         return 0;
                 }
@@ -209,19 +261,85 @@ static void StopPush(LinkCircleQueue *_pQueue)
         return;
 }
 
+static char * reserve(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        return NULL;
+}
+
+static int commit(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        return LINK_Q_WRONGSTATE;
+}
+
+static int peekWithNoOverwrite(LinkCircleQueue *_pQueue, LinkQueueSpan *pSpans)
+{
+        pSpans[0].nLen = 0;
+        pSpans[1].nLen = 0;
+        return LINK_Q_WRONGSTATE;
+}
+
+static void consume(LinkCircleQueue *_pQueue, int nLen)
+{
+        return;
+}
+
+static int getFreeSize(LinkCircleQueue *_pQueue)
+{
+        CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
+        
+        if (pQueueImp->policy == TSQ_VAR_LENGTH) {
+                return INT_MAX; //满了会自动增长
+        }
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        int nFree = (pQueueImp->nCap_ - pQueueImp->nLen_) * (pQueueImp->nItemLen_ - sizeof(int));
+        pthread_mutex_unlock(&pQueueImp->mutex_);
+        return nFree;
+}
+
+static void setWakeupThreshold(LinkCircleQueue *_pQueue, int nThreshold)
+{
+        CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
+
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        if (nThreshold < 1) {
+                nThreshold = 1;
+        }
+        if (pQueueImp->policy == TSQ_FIX_LENGTH && nThreshold > pQueueImp->nCap_) {
+                nThreshold = pQueueImp->nCap_;
+        }
+        pQueueImp->nWakeupThreshold_ = nThreshold;
+        pthread_mutex_unlock(&pQueueImp->mutex_);
+}
+
 static void getStatInfo(LinkCircleQueue *_pQueue, LinkUploaderStatInfo *_pStatInfo)
 {
         CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
         
-        _pStatInfo->nPushDataBytes_ = pQueueImp->statInfo.nPushDataBytes_;
-        _pStatInfo->nPopDataBytes_ = pQueueImp->statInfo.nPopDataBytes_;
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        *_pStatInfo = pQueueImp->statInfo;
         _pStatInfo->nLen_ = pQueueImp->nLen_;
-        _pStatInfo->nDropped = pQueueImp->statInfo.nDropped;
         _pStatInfo->nIsReadOnly = pQueueImp->nQState_;
+        pthread_mutex_unlock(&pQueueImp->mutex_);
         return;
 }
 
-int LinkNewCircleQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount)
+static void destroyQueue(LinkCircleQueue *_pQueue)
+{
+        CircleQueueImp *pQueueImp = (CircleQueueImp *)_pQueue;
+
+        StopPush(_pQueue);
+        
+        pthread_mutex_destroy(&pQueueImp->mutex_);
+        pthread_cond_destroy(&pQueueImp->condition_);
+
+        if (pQueueImp->pData_ != getInlineData(pQueueImp)) {
+                free(pQueueImp->pData_);
+        }
+        free(pQueueImp);
+        return;
+}
+
+static int newLockedQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount)
 {
         int ret;
         CircleQueueImp *pQueueImp = (CircleQueueImp *)malloc(sizeof(CircleQueueImp) +
@@ -235,37 +353,92 @@ int LinkNewCircleQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout,
         if (ret != 0){
                 return LINK_MUTEX_ERROR;
         }
-        ret = pthread_cond_init(&pQueueImp->condition_, NULL);
+        ret = LinkInitMonotonicCond(&pQueueImp->condition_);
         if (ret != 0){
                 pthread_mutex_destroy(&pQueueImp->mutex_);
                 return LINK_COND_ERROR;
         }
         
         pQueueImp->policy = _policy;
-        pQueueImp->pData_ = (char *)pQueueImp + sizeof(CircleQueueImp);
+        pQueueImp->pData_ = getInlineData(pQueueImp);
         pQueueImp->nCap_ = _nInitItemCount;
         pQueueImp->nItemLen_ = _nMaxItemLen + sizeof(int); //前缀int类型的一个长度
         pQueueImp->circleQueue.PopWithTimeout = PopQueue;
         pQueueImp->circleQueue.Push = PushQueue;
+        pQueueImp->circleQueue.PushVec = PushQueueVec;
         pQueueImp->circleQueue.PopWithNoOverwrite = PopQueueWithNoOverwrite;
         pQueueImp->circleQueue.StopPush = StopPush;
+        pQueueImp->circleQueue.Reserve = reserve;
+        pQueueImp->circleQueue.Commit = commit;
+        pQueueImp->circleQueue.PeekWithNoOverwrite = peekWithNoOverwrite;
+        pQueueImp->circleQueue.Consume = consume;
+        pQueueImp->circleQueue.GetFreeSize = getFreeSize;
+        pQueueImp->circleQueue.SetWakeupThreshold = setWakeupThreshold;
         pQueueImp->circleQueue.GetStatInfo = getStatInfo;
+        pQueueImp->circleQueue.Destroy = destroyQueue;
         pQueueImp->nIsAvailableAfterTimeout = nIsAvailableAfterTimeout;
+        pQueueImp->nWakeupThreshold_ = 1;
         
         *_pQueue = (LinkCircleQueue*)pQueueImp;
         return LINK_SUCCESS;
 }
 
-void LinkDestroyQueue(LinkCircleQueue **_pQueue)
+int LinkNewCircleQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount,
+                       enum CircleQueueType _type)
 {
-        CircleQueueImp *pQueueImp = (CircleQueueImp *)(*_pQueue);
-
-        StopPush(*_pQueue);
-        
-        pthread_mutex_destroy(&pQueueImp->mutex_);
-        pthread_cond_destroy(&pQueueImp->condition_);
+        if (_nMaxItemLen <= 0 || _nInitItemCount <= 0) {
+                return LINK_ARG_ERROR;
+        }
+        switch (_type) {
+                case TSQ_LOCKED:
+                        return newLockedQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount);
+                case TSQ_SPSC:
+                        return LinkNewSpscQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount);
+                case TSQ_BYTE_STREAM:
+                        return LinkNewByteStreamQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount);
+                default:
+                        return LINK_ARG_ERROR;
+        }
+}
 
-        free(pQueueImp);
+void LinkDestroyQueue(LinkCircleQueue **_pQueue)
+{
+        (*_pQueue)->Destroy(*_pQueue);
         *_pQueue = NULL;
         return;
 }
+
+int LinkInitMonotonicCond(pthread_cond_t *_pCond)
+{
+#ifdef __APPLE__
+        return pthread_cond_init(_pCond, NULL);
+#else
+        pthread_condattr_t attr;
+        int ret = pthread_condattr_init(&attr);
+        if (ret != 0) {
+                return ret;
+        }
+        ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        if (ret == 0) {
+                ret = pthread_cond_init(_pCond, &attr);
+        }
+        pthread_condattr_destroy(&attr);
+        return ret;
+#endif
+}
+
+void LinkGetCondDeadline(struct timespec *_pDeadline, int64_t _nUSec)
+{
+        struct timespec now;
+#ifdef __APPLE__
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now.tv_sec = tv.tv_sec;
+        now.tv_nsec = tv.tv_usec * 1000;
+#else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+        int64_t nNsec = now.tv_nsec + (_nUSec % 1000000) * 1000;
+        _pDeadline->tv_sec = now.tv_sec + _nUSec / 1000000 + nNsec / 1000000000;
+        _pDeadline->tv_nsec = nNsec % 1000000000;
+}
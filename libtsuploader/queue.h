@@ -2,6 +2,7 @@
 #define __LINK_CIRCLE_QUEUE_H__
 
 #include <pthread.h>
+#include <sys/uio.h>
 #ifndef __APPLE__
 #include <stdint.h>
 #endif
@@ -11,32 +12,83 @@ enum CircleQueuePolicy{
         TSQ_VAR_LENGTH
 };
 
+//TSQ_LOCKED: mutex protected. any number of producer and consumer
+//TSQ_SPSC: lock free. only one producer and one consumer at the same time. not support TSQ_VAR_LENGTH
+//TSQ_BYTE_STREAM: lock free like TSQ_SPSC, but a byte stream without item boundary.
+//                 capacity is nMaxItemLen * nInitItemCount bytes, pop could get any size of data
+enum CircleQueueType{
+        TSQ_LOCKED,
+        TSQ_SPSC,
+        TSQ_BYTE_STREAM
+};
+
 typedef struct _LinkCircleQueue LinkCircleQueue;
 
 
 typedef int(*LinkCircleQueuePush)(LinkCircleQueue *pQueue, char * pData, int nDataLen);
+//和Push一样，几段数据作为一次push(item模式是一个item)，调用者不用先拼到一起
+typedef int(*LinkCircleQueuePushVec)(LinkCircleQueue *pQueue, const struct iovec *pVec, int nVecCount);
 typedef int(*LinkCircleQueuePopWithTimeoutNoOverwrite)(LinkCircleQueue *pQueue, char * pBuf, int nBufLen, int64_t nUsec);
 typedef int(*LinkCircleQueuePopWithNoOverwrite)(LinkCircleQueue *pQueue, char * pBuf, int nBufLen);
 typedef void(*LinkCircleQueueStopPush)(LinkCircleQueue *pQueue);
+//Reserve返回可以直接写入的连续内存，写完后Commit。返回NULL表示现在不能直接写(满了，状态不对，或者不连续)，应该用Push
+//TSQ_LOCKED不支持，总是返回NULL
+typedef char *(*LinkCircleQueueReserve)(LinkCircleQueue *pQueue, int nDataLen);
+typedef int(*LinkCircleQueueCommit)(LinkCircleQueue *pQueue, int nDataLen);
+
+typedef struct _LinkQueueSpan {
+        char *pData;
+        int nLen;
+}LinkQueueSpan;
+//不拷贝数据，返回可读的区域(最多两段，pSpans[2])和总长度，读完后用Consume释放。返回值和PopWithNoOverwrite一样
+//TSQ_LOCKED不支持，返回LINK_Q_WRONGSTATE
+typedef int(*LinkCircleQueuePeekWithNoOverwrite)(LinkCircleQueue *pQueue, LinkQueueSpan *pSpans);
+typedef void(*LinkCircleQueueConsume)(LinkCircleQueue *pQueue, int nLen);
+//还能push多少字节，由生产者调用
+typedef int(*LinkCircleQueueGetFreeSize)(LinkCircleQueue *pQueue);
+//消费者在队列空的时候睡眠，队列里至少有nThreshold(item个数，字节流模式是字节数)才唤醒，默认是1
+//等待超时的时候不够nThreshold也会返回已有的数据
+typedef void(*LinkCircleQueueSetWakeupThreshold)(LinkCircleQueue *pQueue, int nThreshold);
+
+#define LINK_LATENCY_BUCKET_COUNT 16
 
 typedef struct _UploaderStatInfo {
-        int nPushDataBytes_;
-        int nPopDataBytes_;
+        int64_t nPushDataBytes_;
+        int64_t nPopDataBytes_;
         int nLen_;
         int nOverwriteCnt;
         int nIsReadOnly;
-	int nDropped;
+        int64_t nDropped;
+        int nHighWaterMark; //nLen_的最大值
+        int nSpillLen_; //磁盘上还没读的字节数
+        int nIsSpilled_; //写过磁盘。磁盘上的读完了数据也可能还在socket缓冲里没发出去
+        //数据在队列里停留的时间(TSQ_LOCKED不统计)。nLatencyHist[0]小于1毫秒，nLatencyHist[i]是[2^(i-1), 2^i)毫秒，最后一个包括更长的
+        int64_t nLatencyHist[LINK_LATENCY_BUCKET_COUNT];
 }LinkUploaderStatInfo;
 
 typedef struct _LinkCircleQueue{
         LinkCircleQueuePush Push;
+        LinkCircleQueuePushVec PushVec;
         LinkCircleQueuePopWithTimeoutNoOverwrite PopWithTimeout;
         LinkCircleQueuePopWithNoOverwrite PopWithNoOverwrite;
         LinkCircleQueueStopPush StopPush;
+        LinkCircleQueueReserve Reserve;
+        LinkCircleQueueCommit Commit;
+        LinkCircleQueuePeekWithNoOverwrite PeekWithNoOverwrite;
+        LinkCircleQueueConsume Consume;
+        LinkCircleQueueGetFreeSize GetFreeSize;
+        LinkCircleQueueSetWakeupThreshold SetWakeupThreshold;
         void (*GetStatInfo)(LinkCircleQueue *pQueue, LinkUploaderStatInfo *pStatInfo);
+        void (*Destroy)(LinkCircleQueue *pQueue);
 }LinkCircleQueue;
 
-int LinkNewCircleQueue(LinkCircleQueue **pQueue, int nIsAvailableAfterTimeout,  enum CircleQueuePolicy policy, int nMaxItemLen, int nInitItemCount);
+int LinkNewCircleQueue(LinkCircleQueue **pQueue, int nIsAvailableAfterTimeout,  enum CircleQueuePolicy policy, int nMaxItemLen, int nInitItemCount,
+                       enum CircleQueueType type);
 void LinkDestroyQueue(LinkCircleQueue **_pQueue);
 
+//队列实现共用。condition用CLOCK_MONOTONIC，不受ntp等修改系统时间的影响(__APPLE__不支持，还是用系统时间)
+int LinkInitMonotonicCond(pthread_cond_t *pCond);
+//现在开始nUSec微秒以后的时间，用于LinkInitMonotonicCond初始化的condition的pthread_cond_timedwait
+void LinkGetCondDeadline(struct timespec *pDeadline, int64_t nUSec);
+
 #endif
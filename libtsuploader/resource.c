@@ -13,9 +13,9 @@ static ResourceMgr manager;
 
 static void * recycle(void *_pOpaque)
 {
-        LinkUploaderStatInfo info = {0};
-        manager.pQueue_->GetStatInfo(manager.pQueue_, &info);
-        while(!manager.nQuit_ && info.nLen_ == 0) {
+        //创建后马上就可能有任务(比如准备备用分片上下文)，不能看队列是不是空来决定要不要退出。
+        //LinkStopMgr放进来的NULL之前的任务(比如销毁uploader)都要做完
+        while(1) {
                 LinkAsyncInterface *pAsync = NULL;
                 int ret = manager.pQueue_->PopWithTimeout(manager.pQueue_, (char *)(&pAsync), sizeof(LinkAsyncInterface *), 24 * 60 * 60 * 1000000);
                 LinkUploaderStatInfo info;
@@ -27,14 +27,17 @@ static void * recycle(void *_pOpaque)
                 if (ret == sizeof(LinkTsUploader *)) {
                         LinkLogInfo("pop from mgr:%p\n", pAsync);
                         if (pAsync == NULL) {
+                                if (manager.nQuit_) {
+                                        break;
+                                }
                                 LinkLogWarn("NULL function");
                         } else {
                                 LinkAsynFunction func = pAsync->function;
                                 func(pAsync);
                         }
                 }
-                manager.pQueue_->GetStatInfo(manager.pQueue_, &info);
         }
+        return NULL;
 }
 
 int LinkPushFunction(void *_pAsyncInterface)
@@ -51,7 +54,8 @@ int LinkStartMgr()
                 return LINK_SUCCESS;
         }
         
-        int ret = LinkNewCircleQueue(&manager.pQueue_, 1, TSQ_FIX_LENGTH, sizeof(void *), 100);
+        //销毁和准备任务丢了会泄漏上下文，队列满了要扩容，不能覆盖
+        int ret = LinkNewCircleQueue(&manager.pQueue_, 1, TSQ_VAR_LENGTH, sizeof(void *), 100, TSQ_LOCKED);
         if (ret != 0){
                 return ret;
         }
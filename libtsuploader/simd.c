@@ -0,0 +1,384 @@
+#include "simd.h"
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+//gcc4.9以后可以用target属性单独给函数打开avx2/pclmul，运行时再判断cpu支不支持
+#define LINK_SIMD_X86_DISPATCH
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LINK_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LINK_SIMD_ARM_CRC32
+#include <arm_acle.h>
+#endif
+
+typedef const uint8_t *(*FindStartCodeFunc)(const uint8_t *pData, const uint8_t *pEnd);
+typedef uint32_t (*Crc32Func)(uint32_t nCrc, const uint8_t *pData, size_t nLen);
+
+static pthread_once_t simdOnce = PTHREAD_ONCE_INIT;
+static int nDetectedFlags;
+static int nCpuFlags;
+static FindStartCodeFunc findStartCodeImpl;
+static Crc32Func crc32Impl;
+static uint32_t crcTable[8][256];
+
+/*============================================================================*/
+/* start code */
+
+//一次看4个字节，没有0字节的时候直接跳过
+static const uint8_t *findStartCodeScalar(const uint8_t *p, const uint8_t *end)
+{
+        const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+
+        if (end - p < 4) {
+                return end;
+        }
+
+        for (end -= 3; p < a && p < end; p++) {
+                if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+                        return p;
+        }
+
+        for (end -= 3; p < end; p += 4) {
+                uint32_t x;
+                memcpy(&x, p, sizeof(x));
+                if ((x - 0x01010101) & (~x) & 0x80808080) {
+                        if (p[1] == 0) {
+                                if (p[0] == 0 && p[2] == 1)
+                                        return p;
+                                if (p[2] == 0 && p[3] == 1)
+                                        return p+1;
+                        }
+                        if (p[3] == 0) {
+                                if (p[2] == 0 && p[4] == 1)
+                                        return p+2;
+                                if (p[4] == 0 && p[5] == 1)
+                                        return p+3;
+                        }
+                }
+        }
+
+        for (end += 3; p < end; p++) {
+                if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+                        return p;
+        }
+
+        return end + 3;
+}
+
+//p, p+1, p+2三次错位加载，一次比较16(32)个位置是不是00 00 01。剩下不到一块的交给标量
+#ifdef __SSE2__
+static const uint8_t *findStartCodeSse2(const uint8_t *p, const uint8_t *end)
+{
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi8(1);
+        while (end - p >= 19) {
+                __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+                __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero);
+                __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+                int nMask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+                if (nMask) {
+                        return p + __builtin_ctz(nMask);
+                }
+                p += 16;
+        }
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+#ifdef LINK_SIMD_X86_DISPATCH
+__attribute__((target("avx2")))
+static const uint8_t *findStartCodeAvx2(const uint8_t *p, const uint8_t *end)
+{
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi8(1);
+        while (end - p >= 35) {
+                __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), zero);
+                __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), zero);
+                __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one);
+                uint32_t nMask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+                if (nMask) {
+                        return p + __builtin_ctz(nMask);
+                }
+                p += 32;
+        }
+        //gcc尾调用标量时不会插vzeroupper，ymm高位是脏的话之后所有非vex的sse指令都变慢，这里自己清
+        _mm256_zeroupper();
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+#ifdef LINK_SIMD_NEON
+static const uint8_t *findStartCodeNeon(const uint8_t *p, const uint8_t *end)
+{
+        const uint8x16_t zero = vdupq_n_u8(0);
+        const uint8x16_t one = vdupq_n_u8(1);
+        while (end - p >= 19) {
+                uint8x16_t a = vceqq_u8(vld1q_u8(p), zero);
+                uint8x16_t b = vceqq_u8(vld1q_u8(p + 1), zero);
+                uint8x16_t c = vceqq_u8(vld1q_u8(p + 2), one);
+                uint64x2_t m = vreinterpretq_u64_u8(vandq_u8(vandq_u8(a, b), c));
+                if (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) {
+                        //neon没有movemask，在这16个字节里用标量找
+                        break;
+                }
+                p += 16;
+        }
+        return findStartCodeScalar(p, end);
+}
+#endif
+
+/*============================================================================*/
+/* crc32(zlib) */
+
+static void initCrcTable()
+{
+        uint32_t i, j;
+        for (i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (j = 0; j < 8; j++) {
+                        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+                }
+                crcTable[0][i] = c;
+        }
+        for (i = 0; i < 256; i++) {
+                for (j = 1; j < 8; j++) {
+                        crcTable[j][i] = (crcTable[j-1][i] >> 8) ^ crcTable[0][crcTable[j-1][i] & 0xff];
+                }
+        }
+}
+
+//slicing-by-8，按字节取数据所以大小端都可以用
+static uint32_t crc32Scalar(uint32_t nCrc, const uint8_t *p, size_t nLen)
+{
+        while (nLen >= 8) {
+                uint32_t a = nCrc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+                nCrc = crcTable[7][a & 0xff] ^ crcTable[6][(a >> 8) & 0xff] ^
+                       crcTable[5][(a >> 16) & 0xff] ^ crcTable[4][a >> 24] ^
+                       crcTable[3][p[4]] ^ crcTable[2][p[5]] ^ crcTable[1][p[6]] ^ crcTable[0][p[7]];
+                p += 8;
+                nLen -= 8;
+        }
+        while (nLen--) {
+                nCrc = (nCrc >> 8) ^ crcTable[0][(nCrc ^ *p++) & 0xff];
+        }
+        return nCrc;
+}
+
+#ifdef LINK_SIMD_X86_DISPATCH
+//Intel "Fast CRC Computation Using PCLMULQDQ"的折叠算法，一次并行折叠64字节
+//nLen >= 64并且是16的倍数
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32PclmulFold(uint32_t nCrc, const uint8_t *p, size_t nLen)
+{
+        static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+        static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+        static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+        static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+        x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(nCrc));
+        x0 = _mm_load_si128((const __m128i *)k1k2);
+        p += 64;
+        nLen -= 64;
+
+        while (nLen >= 64) {
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+                x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+                x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+                x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+                x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+                y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+                y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+                y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+                y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+                x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+                x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+                x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+                p += 64;
+                nLen -= 64;
+        }
+
+        //4个128位折叠成1个
+        x0 = _mm_load_si128((const __m128i *)k3k4);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+        while (nLen >= 16) {
+                x2 = _mm_loadu_si128((const __m128i *)p);
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+                p += 16;
+                nLen -= 16;
+        }
+
+        //128位到64位
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+        x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        //barrett约减到32位
+        x0 = _mm_load_si128((const __m128i *)poly);
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t nCrc, const uint8_t *p, size_t nLen)
+{
+        if (nLen >= 64) {
+                size_t nFoldLen = nLen & ~(size_t)15;
+                nCrc = crc32PclmulFold(nCrc, p, nFoldLen);
+                p += nFoldLen;
+                nLen -= nFoldLen;
+        }
+        return crc32Scalar(nCrc, p, nLen);
+}
+#endif
+
+#ifdef LINK_SIMD_ARM_CRC32
+static uint32_t crc32Arm(uint32_t nCrc, const uint8_t *p, size_t nLen)
+{
+        while (nLen && ((uintptr_t)p & 7)) {
+                nCrc = __crc32b(nCrc, *p++);
+                nLen--;
+        }
+        while (nLen >= 8) {
+                uint64_t v;
+                memcpy(&v, p, sizeof(v));
+                nCrc = __crc32d(nCrc, v);
+                p += 8;
+                nLen -= 8;
+        }
+        while (nLen--) {
+                nCrc = __crc32b(nCrc, *p++);
+        }
+        return nCrc;
+}
+#endif
+
+/*============================================================================*/
+/* dispatch */
+
+static void selectKernels(int _nFlags)
+{
+        FindStartCodeFunc findStartCode = findStartCodeScalar;
+        Crc32Func crc32 = crc32Scalar;
+        int nUsed = 0;
+
+#ifdef __SSE2__
+        if (_nFlags & LINK_CPU_SSE2) {
+                findStartCode = findStartCodeSse2;
+                nUsed |= LINK_CPU_SSE2;
+        }
+#endif
+#ifdef LINK_SIMD_X86_DISPATCH
+        if (_nFlags & LINK_CPU_AVX2) {
+                findStartCode = findStartCodeAvx2;
+                nUsed |= LINK_CPU_AVX2;
+        }
+        if (_nFlags & LINK_CPU_PCLMUL) {
+                crc32 = crc32Pclmul;
+                nUsed |= LINK_CPU_PCLMUL;
+        }
+#endif
+#ifdef LINK_SIMD_NEON
+        if (_nFlags & LINK_CPU_NEON) {
+                findStartCode = findStartCodeNeon;
+                nUsed |= LINK_CPU_NEON;
+        }
+#endif
+#ifdef LINK_SIMD_ARM_CRC32
+        if (_nFlags & LINK_CPU_CRC32) {
+                crc32 = crc32Arm;
+                nUsed |= LINK_CPU_CRC32;
+        }
+#endif
+        findStartCodeImpl = findStartCode;
+        crc32Impl = crc32;
+        nCpuFlags = nUsed;
+}
+
+static void initSimd()
+{
+        int nFlags = 0;
+#ifdef __SSE2__
+        nFlags |= LINK_CPU_SSE2;
+#endif
+#ifdef LINK_SIMD_X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                nFlags |= LINK_CPU_AVX2;
+        }
+        if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+                nFlags |= LINK_CPU_PCLMUL;
+        }
+#endif
+#ifdef LINK_SIMD_NEON
+        nFlags |= LINK_CPU_NEON;
+#endif
+#ifdef LINK_SIMD_ARM_CRC32
+        nFlags |= LINK_CPU_CRC32;
+#endif
+        initCrcTable();
+        nDetectedFlags = nFlags;
+        selectKernels(nFlags);
+}
+
+const uint8_t *LinkSimdFindStartCode(const uint8_t *_pData, const uint8_t *_pEnd)
+{
+        pthread_once(&simdOnce, initSimd);
+        return findStartCodeImpl(_pData, _pEnd);
+}
+
+uint32_t LinkSimdCrc32(uint32_t _nCrc, const void *_pData, size_t _nLen)
+{
+        pthread_once(&simdOnce, initSimd);
+        return ~crc32Impl(~_nCrc, (const uint8_t *)_pData, _nLen);
+}
+
+int LinkSimdGetCpuFlags()
+{
+        pthread_once(&simdOnce, initSimd);
+        return nCpuFlags;
+}
+
+void LinkSimdSetCpuFlagsMask(int _nMask)
+{
+        pthread_once(&simdOnce, initSimd);
+        selectKernels(nDetectedFlags & _nMask);
+}
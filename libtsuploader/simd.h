@@ -0,0 +1,26 @@
+#ifndef __LINK_SIMD_H__
+#define __LINK_SIMD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+//热点循环的向量化实现。x86上SSE2编译期打开，AVX2/PCLMUL运行时检测；
+//ARM上NEON和crc32指令由编译选项决定；其他平台(mips)用标量实现
+#define LINK_CPU_SSE2   0x01
+#define LINK_CPU_AVX2   0x02
+#define LINK_CPU_PCLMUL 0x04
+#define LINK_CPU_NEON   0x08
+#define LINK_CPU_CRC32  0x10 //armv8 crc32指令
+
+//返回start code(00 00 01)第一个字节的位置，start code后面至少要有一个字节，找不到返回pEnd
+const uint8_t *LinkSimdFindStartCode(const uint8_t *pData, const uint8_t *pEnd);
+
+//和zlib crc32()一样的多项式和初始值，nCrc传上一次的返回值，第一次传0
+uint32_t LinkSimdCrc32(uint32_t nCrc, const void *pData, size_t nLen);
+
+//当前在用的指令集
+int LinkSimdGetCpuFlags();
+//只用nMask里的指令集，0表示全部用标量实现。调试和比较性能用
+void LinkSimdSetCpuFlagsMask(int nMask);
+
+#endif
@@ -0,0 +1,1039 @@
+#include "spscqueue.h"
+#include "base.h"
+#include "arenapool.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define QUEUE_READ_ONLY_STATE 1
+#define QUEUE_TIMEOUT_STATE 2
+
+/*
+ 单生产者单消费者的无锁环形队列。
+ nHead_只由消费者修改，nTail_只由生产者修改，取值范围都是[0, 2*nCap_)，这样不需要额外的标志就能区分空和满。
+ push/pop都不加锁，只有消费者在队列为空需要睡眠时，才使用mutex_和condition_。消费者睡眠以后，数据达到nWakeupThreshold_生产者才唤醒它，
+ 避免每个ts包唤醒一次上传线程
+ item模式下nCap_是item个数，每个item前缀一个int长度；字节流模式下nCap_是字节数，没有任何前缀
+ 字节流模式可以再带一个mmap的磁盘文件环形区(spill)。内存满了以后生产者改写磁盘，直到消费者把磁盘上的读完才回到内存。
+ 文件第一次要写磁盘时才从spillPool拿，队列销毁时还回去给之后的分片用，不用每个分片都新建文件、预分配磁盘。
+ 消费者总是先读内存再读磁盘，因为写磁盘期间内存不会有新数据，磁盘读完时内存也一定是空的，所以顺序不会乱
+ 统计不加锁：生产者写的字段和消费者写的字段各用一个seqlock，getStatInfo在别的线程读，写失败就重读，不会阻塞push/pop。
+ 每个slot(item模式一个item，字节流模式nItemLen_字节，也就是一个ts包)记录进队列的时间，出队列时算出停留时间放进直方图
+ */
+typedef struct _SpillFile SpillFile;
+struct _SpillFile {
+        SpillFile *pNext;
+        char *pData_; //mmap的文件
+        uint32_t *pStamps_; //每个slot进队列的时间
+        int nSize_;
+        int nSlots_;
+        int nGeneration_;
+};
+
+#define LINK_SPILL_DEFAULT_CACHE 2
+
+//进程内共享的spill文件，用法和arenapool一样。spill目录改了以后旧文件还回来时直接释放
+static struct {
+        pthread_mutex_t mutex_;
+        SpillFile *pFree_;
+        int nFreeCount_;
+        int nOutstanding_;
+        int nGeneration_;
+} spillPool = {
+        .mutex_ = PTHREAD_MUTEX_INITIALIZER,
+};
+
+typedef struct _SpscQueueImp{
+        LinkCircleQueue circleQueue;
+        char *pData_;
+        int nCap_;
+        int nItemLen_;
+        int nIsByteStream_;
+        int nHead_;
+        int nTail_;
+        int nReadOffset_; //消费者私有，队头item已经被读走的长度
+        volatile int nQState_;
+        int nConsumerWaiting_;
+        int nWakeupThreshold_;
+        pthread_mutex_t mutex_;
+        pthread_cond_t condition_;
+        enum CircleQueuePolicy policy;
+        LinkUploaderStatInfo statInfo;
+        int nIsAvailableAfterTimeout;
+        char *pSpill_; //第一次写磁盘时生产者设置，之前是NULL
+        int nSpillCap_; //0表示不用磁盘
+        int nSpillHead_;
+        int nSpillTail_;
+        int nSpilling_; //生产者私有
+        char *pSpillDir_;
+        SpillFile *pSpillFile_;
+        uint32_t *pStamps_; //内存里每个slot进队列的时间，毫秒
+        uint32_t *pSpillStamps_; //磁盘上每个slot进队列的时间
+        unsigned int nPushSeq_; //保护nPushDataBytes_ nDropped nOverwriteCnt nHighWaterMark，奇数表示正在写
+        unsigned int nPopSeq_; //保护nPopDataBytes_ nLatencyHist
+}SpscQueueImp;
+
+static inline int ringUsed(int nCap, int nHead, int nTail)
+{
+        int nCount = nTail - nHead;
+        if (nCount < 0) {
+                nCount += nCap * 2;
+        }
+        return nCount;
+}
+
+static inline int ringAdd(int nCap, int nIndex, int nCount)
+{
+        nIndex += nCount;
+        if (nIndex >= nCap * 2) {
+                nIndex -= nCap * 2;
+        }
+        return nIndex;
+}
+
+static inline int ringOffset(int nCap, int nIndex)
+{
+        if (nIndex >= nCap) {
+                return nIndex - nCap;
+        }
+        return nIndex;
+}
+
+static inline int getUsedCount(SpscQueueImp *pQueueImp, int nHead, int nTail)
+{
+        return ringUsed(pQueueImp->nCap_, nHead, nTail);
+}
+
+static inline int getNextIndex(SpscQueueImp *pQueueImp, int nIndex)
+{
+        nIndex++;
+        if (nIndex == pQueueImp->nCap_ * 2) {
+                nIndex = 0;
+        }
+        return nIndex;
+}
+
+static inline int addIndex(SpscQueueImp *pQueueImp, int nIndex, int nCount)
+{
+        return ringAdd(pQueueImp->nCap_, nIndex, nCount);
+}
+
+static inline int getOffset(SpscQueueImp *pQueueImp, int nIndex)
+{
+        return ringOffset(pQueueImp->nCap_, nIndex);
+}
+
+static inline char * getItem(SpscQueueImp *pQueueImp, int nIndex)
+{
+        return pQueueImp->pData_ + getOffset(pQueueImp, nIndex) * pQueueImp->nItemLen_;
+}
+
+// 字节流模式下最多两次memcpy
+static void copyToRing(char *pRing, int nCap, int nIndex, const char *pData, int nLen)
+{
+        int nOffset = ringOffset(nCap, nIndex);
+        int nFirst = nCap - nOffset;
+        if (nFirst > nLen) {
+                nFirst = nLen;
+        }
+        memcpy(pRing + nOffset, pData, nFirst);
+        if (nLen > nFirst) {
+                memcpy(pRing, pData + nFirst, nLen - nFirst);
+        }
+}
+
+static void copyVecToRing(char *pRing, int nCap, int nIndex, const struct iovec *pVec, int nVecCount)
+{
+        int i;
+        for (i = 0; i < nVecCount; i++) {
+                copyToRing(pRing, nCap, nIndex, (const char *)pVec[i].iov_base, pVec[i].iov_len);
+                nIndex = ringAdd(nCap, nIndex, pVec[i].iov_len);
+        }
+}
+
+static void copyFromRing(char *pRing, int nCap, int nIndex, char *pBuf, int nLen)
+{
+        int nOffset = ringOffset(nCap, nIndex);
+        int nFirst = nCap - nOffset;
+        if (nFirst > nLen) {
+                nFirst = nLen;
+        }
+        memcpy(pBuf, pRing + nOffset, nFirst);
+        if (nLen > nFirst) {
+                memcpy(pBuf + nFirst, pRing, nLen - nFirst);
+        }
+}
+
+static int getSpillCount(SpscQueueImp *pQueueImp, int nHead, int nTail)
+{
+        if (LinkLoadAcquire(&pQueueImp->pSpill_) == NULL) {
+                return 0;
+        }
+        return ringUsed(pQueueImp->nSpillCap_, nHead, nTail);
+}
+
+//内存和磁盘上一共可以读的
+static int getReadableCount(SpscQueueImp *pQueueImp)
+{
+        int nCount = getUsedCount(pQueueImp, pQueueImp->nHead_, LinkLoadAcquire(&pQueueImp->nTail_));
+        return nCount + getSpillCount(pQueueImp, pQueueImp->nSpillHead_, LinkLoadAcquire(&pQueueImp->nSpillTail_));
+}
+
+//生产者看到的内存和磁盘上一共有多少数据
+static int getQueuedCount(SpscQueueImp *pQueueImp)
+{
+        int nCount = getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), pQueueImp->nTail_);
+        return nCount + getSpillCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nSpillHead_), pQueueImp->nSpillTail_);
+}
+
+//字节流模式下现在应该读的区域：内存里有数据就读内存，否则读磁盘
+static int getStreamReadRegion(SpscQueueImp *pQueueImp, char **ppRing, int *pCap, int **ppHead)
+{
+        int nCount = getUsedCount(pQueueImp, pQueueImp->nHead_, LinkLoadAcquire(&pQueueImp->nTail_));
+        char *pSpill = LinkLoadAcquire(&pQueueImp->pSpill_);
+        if (nCount > 0 || pSpill == NULL) {
+                *ppRing = pQueueImp->pData_;
+                *pCap = pQueueImp->nCap_;
+                *ppHead = &pQueueImp->nHead_;
+                return nCount;
+        }
+        *ppRing = pSpill;
+        *pCap = pQueueImp->nSpillCap_;
+        *ppHead = &pQueueImp->nSpillHead_;
+        return getSpillCount(pQueueImp, pQueueImp->nSpillHead_, LinkLoadAcquire(&pQueueImp->nSpillTail_));
+}
+
+static inline uint32_t getNowMs()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint32_t)now.tv_sec * 1000 + (uint32_t)(now.tv_nsec / 1000000);
+}
+
+static inline int getLatencyBucket(uint32_t nMs)
+{
+        int nBucket = 0;
+        while (nMs > 0 && nBucket < LINK_LATENCY_BUCKET_COUNT - 1) {
+                nMs >>= 1;
+                nBucket++;
+        }
+        return nBucket;
+}
+
+static inline void statWriteBegin(unsigned int *pSeq)
+{
+        LinkStoreRelease(pSeq, *pSeq + 1);
+        LinkReleaseFence();
+}
+
+static inline void statWriteEnd(unsigned int *pSeq)
+{
+        LinkStoreRelease(pSeq, *pSeq + 1);
+}
+
+static inline int getSlotLen(SpscQueueImp *pQueueImp)
+{
+        return pQueueImp->nIsByteStream_ ? pQueueImp->nItemLen_ : 1;
+}
+
+// 在发布nTail_之前调用，[nIndex, nIndex+nCount)里开始的slot记下当前时间
+static void stampSlots(SpscQueueImp *pQueueImp, int nIsSpill, int nIndex, int nCount)
+{
+        int nSlotLen = getSlotLen(pQueueImp);
+        int nFirst = (nIndex + nSlotLen - 1) / nSlotLen;
+        int nEnd = (nIndex + nCount + nSlotLen - 1) / nSlotLen;
+        if (nFirst >= nEnd) {
+                return;
+        }
+        uint32_t *pStamps = nIsSpill ? pQueueImp->pSpillStamps_ : pQueueImp->pStamps_;
+        int nSlots = (nIsSpill ? pQueueImp->nSpillCap_ : pQueueImp->nCap_) / nSlotLen;
+        uint32_t nNow = getNowMs();
+        for (int i = nFirst; i < nEnd; i++) {
+                pStamps[i % nSlots] = nNow;
+        }
+}
+
+// 在发布nTail_之后调用
+static void statPushed(SpscQueueImp *pQueueImp, int nDataLen)
+{
+        int nUsed = getQueuedCount(pQueueImp);
+        if (pQueueImp->nIsByteStream_) {
+                nUsed = (nUsed + pQueueImp->nItemLen_ - 1) / pQueueImp->nItemLen_;
+        }
+        statWriteBegin(&pQueueImp->nPushSeq_);
+        pQueueImp->statInfo.nPushDataBytes_ += nDataLen;
+        if (nUsed > pQueueImp->statInfo.nHighWaterMark) {
+                pQueueImp->statInfo.nHighWaterMark = nUsed;
+        }
+        statWriteEnd(&pQueueImp->nPushSeq_);
+}
+
+static void statDropped(SpscQueueImp *pQueueImp, int nDataLen, int nIsOverwrite)
+{
+        statWriteBegin(&pQueueImp->nPushSeq_);
+        pQueueImp->statInfo.nDropped += nDataLen;
+        pQueueImp->statInfo.nOverwriteCnt += nIsOverwrite;
+        statWriteEnd(&pQueueImp->nPushSeq_);
+}
+
+// 在移动nHead_之前调用，[nIndex, nIndex+nCount)里读完的slot计入直方图
+static void statPopped(SpscQueueImp *pQueueImp, int nIsSpill, int nIndex, int nCount, int nDataLen)
+{
+        int nSlotLen = getSlotLen(pQueueImp);
+        int nFirst = nIndex / nSlotLen;
+        int nEnd = (nIndex + nCount) / nSlotLen;
+        uint32_t *pStamps = nIsSpill ? pQueueImp->pSpillStamps_ : pQueueImp->pStamps_;
+        int nSlots = (nIsSpill ? pQueueImp->nSpillCap_ : pQueueImp->nCap_) / nSlotLen;
+        uint32_t nNow = nFirst < nEnd ? getNowMs() : 0;
+
+        statWriteBegin(&pQueueImp->nPopSeq_);
+        pQueueImp->statInfo.nPopDataBytes_ += nDataLen;
+        for (int i = nFirst; i < nEnd; i++) {
+                pQueueImp->statInfo.nLatencyHist[getLatencyBucket(nNow - pStamps[i % nSlots])]++;
+        }
+        statWriteEnd(&pQueueImp->nPopSeq_);
+}
+
+static void wakeupConsumer(SpscQueueImp *pQueueImp)
+{
+        //和waitForData配对: 要么消费者看到新的nTail_，要么这里看到nConsumerWaiting_
+        LinkFullBarrier();
+        if (LinkLoadAcquire(&pQueueImp->nConsumerWaiting_) && getQueuedCount(pQueueImp) >= pQueueImp->nWakeupThreshold_) {
+                pthread_mutex_lock(&pQueueImp->mutex_);
+                pthread_cond_signal(&pQueueImp->condition_);
+                pthread_mutex_unlock(&pQueueImp->mutex_);
+        }
+}
+
+// return used count(item or byte) in queue, 0 means read only now, or LINK_TIMEOUT
+static int waitForData(SpscQueueImp *pQueueImp, int64_t nUSec)
+{
+        int nCount = getReadableCount(pQueueImp);
+        if (nCount > 0) {
+                return nCount;
+        }
+
+        struct timespec timeout;
+        LinkGetCondDeadline(&timeout, nUSec);
+
+        int ret = 0;
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        LinkStoreRelease(&pQueueImp->nConsumerWaiting_, 1);
+        LinkFullBarrier();
+        while (1) {
+                nCount = getReadableCount(pQueueImp);
+                if (nCount >= pQueueImp->nWakeupThreshold_ || pQueueImp->nQState_ == QUEUE_READ_ONLY_STATE) {
+                        break;
+                }
+                ret = pthread_cond_timedwait(&pQueueImp->condition_, &pQueueImp->mutex_, &timeout);
+                if (ret == ETIMEDOUT) {
+                        nCount = getReadableCount(pQueueImp);
+                        if (nCount == 0) {
+                                nCount = LINK_TIMEOUT;
+                        }
+                        break;
+                }
+        }
+        LinkStoreRelease(&pQueueImp->nConsumerWaiting_, 0);
+        pthread_mutex_unlock(&pQueueImp->mutex_);
+        return nCount;
+}
+
+// return 1 if could push, otherwise *pRet is the return value of push
+static int isPushable(SpscQueueImp *pQueueImp, int nDataLen, int nNeedCount, int *pRet)
+{
+        if (!pQueueImp->nIsAvailableAfterTimeout && pQueueImp->nQState_ == QUEUE_TIMEOUT_STATE) {
+                statDropped(pQueueImp, nDataLen, 0);
+                LinkLogWarn("queue is timeout dropped:%p", pQueueImp);
+                *pRet = 0;
+                return 0;
+        }
+        if (pQueueImp->nQState_ == QUEUE_READ_ONLY_STATE) {
+                statDropped(pQueueImp, nDataLen, 0);
+                LinkLogWarn("queue is only readable now");
+                *pRet = LINK_NO_PUSH;
+                return 0;
+        }
+        int nUsed = getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), pQueueImp->nTail_);
+        if (pQueueImp->nCap_ - nUsed < nNeedCount) {
+                //生产者不能移动nHead_，所以满的时候丢弃新数据。对消费者来说和覆盖一样，都是这段数据不完整了
+                statDropped(pQueueImp, nDataLen, 1);
+                *pRet = LINK_Q_OVERWRIT;
+                return 0;
+        }
+        return 1;
+}
+
+static int PushQueueVec(LinkCircleQueue *_pQueue, const struct iovec *_pVec, int _nVecCount)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+        int nDataLen = LinkGetIovecLen(_pVec, _nVecCount);
+        assert(pQueueImp->nItemLen_ - sizeof(int) >= nDataLen);
+
+        int ret = 0;
+        if (!isPushable(pQueueImp, nDataLen, 1, &ret)) {
+                return ret;
+        }
+
+        int nTail = pQueueImp->nTail_;
+        char *pItem = getItem(pQueueImp, nTail);
+        memcpy(pItem, &nDataLen, sizeof(int));
+        pItem += sizeof(int);
+        int i;
+        for (i = 0; i < _nVecCount; i++) {
+                memcpy(pItem, _pVec[i].iov_base, _pVec[i].iov_len);
+                pItem += _pVec[i].iov_len;
+        }
+        stampSlots(pQueueImp, 0, nTail, 1);
+        LinkStoreRelease(&pQueueImp->nTail_, getNextIndex(pQueueImp, nTail));
+        statPushed(pQueueImp, nDataLen);
+
+        wakeupConsumer(pQueueImp);
+        return nDataLen;
+}
+
+static int PushQueue(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
+{
+        struct iovec vec = {pData_, nDataLen};
+        return PushQueueVec(_pQueue, &vec, 1);
+}
+
+static SpillFile * getSpillFile(const char *_pDir, int _nSize, int _nSlots);
+
+//生产者第一次要写磁盘时调用
+static int attachSpill(SpscQueueImp *pQueueImp)
+{
+        SpillFile *pFile = getSpillFile(pQueueImp->pSpillDir_, pQueueImp->nSpillCap_, pQueueImp->nSpillCap_ / pQueueImp->nItemLen_);
+        if (pFile == NULL) {
+                return LINK_NO_MEMORY;
+        }
+        pQueueImp->pSpillFile_ = pFile;
+        pQueueImp->pSpillStamps_ = pFile->pStamps_;
+        LinkStoreRelease(&pQueueImp->pSpill_, pFile->pData_);
+        return LINK_SUCCESS;
+}
+
+// return 1 if data is written to spill, 0 if should write to memory, or LINK_Q_OVERWRIT
+static int pushToSpill(SpscQueueImp *pQueueImp, const struct iovec *_pVec, int _nVecCount, int nDataLen)
+{
+        if (pQueueImp->nSpilling_ && LinkLoadAcquire(&pQueueImp->nSpillHead_) == pQueueImp->nSpillTail_) {
+                //磁盘上的已经读完了，这时内存也是空的，回到内存
+                pQueueImp->nSpilling_ = 0;
+                LinkLogInfo("spill drained, back to memory:%p", pQueueImp);
+        }
+        if (!pQueueImp->nSpilling_) {
+                int nUsed = getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), pQueueImp->nTail_);
+                if (pQueueImp->nCap_ - nUsed >= nDataLen) {
+                        return 0;
+                }
+                if (pQueueImp->pSpill_ == NULL && attachSpill(pQueueImp) != LINK_SUCCESS) {
+                        //拿不到文件就和没有磁盘一样，内存满了丢新数据
+                        LinkLogWarn("queue without spill:%p", pQueueImp);
+                        pQueueImp->nSpillCap_ = 0;
+                        statDropped(pQueueImp, nDataLen, 1);
+                        return LINK_Q_OVERWRIT;
+                }
+                pQueueImp->nSpilling_ = 1;
+                LinkLogWarn("queue is full, spill to disk:%p", pQueueImp);
+        }
+
+        int nTail = pQueueImp->nSpillTail_;
+        int nUsed = getSpillCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nSpillHead_), nTail);
+        if (pQueueImp->nSpillCap_ - nUsed < nDataLen) {
+                //磁盘也满了，不能再写内存(顺序会乱)，只能丢弃
+                statDropped(pQueueImp, nDataLen, 1);
+                return LINK_Q_OVERWRIT;
+        }
+        copyVecToRing(pQueueImp->pSpill_, pQueueImp->nSpillCap_, nTail, _pVec, _nVecCount);
+        stampSlots(pQueueImp, 1, nTail, nDataLen);
+        LinkStoreRelease(&pQueueImp->nSpillTail_, ringAdd(pQueueImp->nSpillCap_, nTail, nDataLen));
+        statPushed(pQueueImp, nDataLen);
+
+        wakeupConsumer(pQueueImp);
+        return 1;
+}
+
+static int PushStreamVec(LinkCircleQueue *_pQueue, const struct iovec *_pVec, int _nVecCount)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+        int nDataLen = LinkGetIovecLen(_pVec, _nVecCount);
+
+        int ret = 0;
+        //有磁盘时容量在pushToSpill里判断
+        if (!isPushable(pQueueImp, nDataLen, pQueueImp->nSpillCap_ ? 0 : nDataLen, &ret)) {
+                return ret;
+        }
+        if (pQueueImp->nSpillCap_) {
+                ret = pushToSpill(pQueueImp, _pVec, _nVecCount, nDataLen);
+                if (ret < 0) {
+                        return ret;
+                }
+                if (ret == 1) {
+                        return nDataLen;
+                }
+        }
+
+        int nTail = pQueueImp->nTail_;
+        copyVecToRing(pQueueImp->pData_, pQueueImp->nCap_, nTail, _pVec, _nVecCount);
+        stampSlots(pQueueImp, 0, nTail, nDataLen);
+        LinkStoreRelease(&pQueueImp->nTail_, addIndex(pQueueImp, nTail, nDataLen));
+        statPushed(pQueueImp, nDataLen);
+
+        wakeupConsumer(pQueueImp);
+        return nDataLen;
+}
+
+static int PushStream(LinkCircleQueue *_pQueue, char *pData_, int nDataLen)
+{
+        struct iovec vec = {pData_, nDataLen};
+        return PushStreamVec(_pQueue, &vec, 1);
+}
+
+static int isReservable(SpscQueueImp *pQueueImp)
+{
+        if (!pQueueImp->nIsAvailableAfterTimeout && pQueueImp->nQState_ == QUEUE_TIMEOUT_STATE) {
+                return 0;
+        }
+        if (pQueueImp->nQState_ == QUEUE_READ_ONLY_STATE) {
+                return 0;
+        }
+        return 1;
+}
+
+// Reserve不修改任何状态，失败时调用者用Push，由Push统计丢弃
+static char * ReserveQueue(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        if (pQueueImp->nItemLen_ - (int)sizeof(int) < nDataLen || !isReservable(pQueueImp)) {
+                return NULL;
+        }
+        int nTail = pQueueImp->nTail_;
+        if (getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), nTail) == pQueueImp->nCap_) {
+                return NULL;
+        }
+        return getItem(pQueueImp, nTail) + sizeof(int);
+}
+
+static int CommitQueue(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        int nTail = pQueueImp->nTail_;
+        memcpy(getItem(pQueueImp, nTail), &nDataLen, sizeof(int));
+        stampSlots(pQueueImp, 0, nTail, 1);
+        LinkStoreRelease(&pQueueImp->nTail_, getNextIndex(pQueueImp, nTail));
+        statPushed(pQueueImp, nDataLen);
+
+        wakeupConsumer(pQueueImp);
+        return nDataLen;
+}
+
+static char * ReserveStream(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        if (!isReservable(pQueueImp) || pQueueImp->nSpilling_) {
+                return NULL;
+        }
+        int nTail = pQueueImp->nTail_;
+        if (pQueueImp->nCap_ - getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), nTail) < nDataLen) {
+                return NULL;
+        }
+        //容量是nItemLen_的整数倍，每次按nItemLen_写入时总是连续的
+        int nOffset = getOffset(pQueueImp, nTail);
+        if (pQueueImp->nCap_ - nOffset < nDataLen) {
+                return NULL;
+        }
+        return pQueueImp->pData_ + nOffset;
+}
+
+static int CommitStream(LinkCircleQueue *_pQueue, int nDataLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        int nTail = pQueueImp->nTail_;
+        stampSlots(pQueueImp, 0, nTail, nDataLen);
+        LinkStoreRelease(&pQueueImp->nTail_, addIndex(pQueueImp, nTail, nDataLen));
+        statPushed(pQueueImp, nDataLen);
+
+        wakeupConsumer(pQueueImp);
+        return nDataLen;
+}
+
+static int PopQueueWithTimeout(LinkCircleQueue *_pQueue, char *pBuf_, int nBufLen, int64_t nUSec)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        if (!pQueueImp->nIsAvailableAfterTimeout && pQueueImp->nQState_ == QUEUE_TIMEOUT_STATE) {
+                return LINK_TIMEOUT;
+        }
+
+        int nCount = waitForData(pQueueImp, nUSec);
+        if (nCount == LINK_TIMEOUT) {
+                pQueueImp->nQState_ = QUEUE_TIMEOUT_STATE;
+                return LINK_TIMEOUT;
+        }
+        if (nCount == 0) {
+                return 0;
+        }
+
+        int nHead = pQueueImp->nHead_;
+        if (pQueueImp->nIsByteStream_) {
+                char *pRing = NULL;
+                int nCap = 0;
+                int *pHead = NULL;
+                nCount = getStreamReadRegion(pQueueImp, &pRing, &nCap, &pHead);
+                int nPopLen = nCount > nBufLen ? nBufLen : nCount;
+                copyFromRing(pRing, nCap, *pHead, pBuf_, nPopLen);
+                statPopped(pQueueImp, pHead == &pQueueImp->nSpillHead_, *pHead, nPopLen, nPopLen);
+                LinkStoreRelease(pHead, ringAdd(nCap, *pHead, nPopLen));
+                return nPopLen;
+        }
+
+        char *pItem = getItem(pQueueImp, nHead);
+        int nDataLen = 0;
+        memcpy(&nDataLen, pItem, sizeof(int));
+        int nRemain = nDataLen - pQueueImp->nReadOffset_;
+        LinkLogTrace("pop remain:%d pop:%d buflen:%d len:%d", nRemain, nDataLen, nBufLen, nCount);
+        if (nRemain > nBufLen) {
+                memcpy(pBuf_, pItem + sizeof(int) + pQueueImp->nReadOffset_, nBufLen);
+                pQueueImp->nReadOffset_ += nBufLen;
+                statPopped(pQueueImp, 0, nHead, 0, nBufLen);
+                return nBufLen;
+        }
+        memcpy(pBuf_, pItem + sizeof(int) + pQueueImp->nReadOffset_, nRemain);
+        pQueueImp->nReadOffset_ = 0;
+        statPopped(pQueueImp, 0, nHead, 1, nRemain);
+        LinkStoreRelease(&pQueueImp->nHead_, getNextIndex(pQueueImp, nHead));
+        return nRemain;
+}
+
+static int PopQueue(LinkCircleQueue *_pQueue, char *pBuf_, int nBufLen, int64_t nUSec)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+        if (pQueueImp->statInfo.nOverwriteCnt > 0) {
+                return LINK_Q_OVERWRIT;
+        }
+        return PopQueueWithTimeout(_pQueue, pBuf_, nBufLen, nUSec);
+}
+
+static int64_t getNoOverwriteTimeout(SpscQueueImp *pQueueImp)
+{
+        int64_t usec = 1000000;
+        if (pQueueImp->statInfo.nPushDataBytes_> 0) {
+                return usec * 1;
+        } else {
+                return usec * 60 * 60 * 24 * 365;
+        }
+}
+
+static int PopQueueWithNoOverwrite(LinkCircleQueue *_pQueue, char *pBuf_, int nBufLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+        if (pQueueImp->statInfo.nOverwriteCnt > 0) {
+                return LINK_Q_OVERWRIT;
+        }
+        return PopQueueWithTimeout(_pQueue, pBuf_, nBufLen, getNoOverwriteTimeout(pQueueImp));
+}
+
+static int PeekQueueWithNoOverwrite(LinkCircleQueue *_pQueue, LinkQueueSpan *pSpans)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        pSpans[0].nLen = 0;
+        pSpans[1].nLen = 0;
+        if (pQueueImp->statInfo.nOverwriteCnt > 0) {
+                return LINK_Q_OVERWRIT;
+        }
+        if (!pQueueImp->nIsAvailableAfterTimeout && pQueueImp->nQState_ == QUEUE_TIMEOUT_STATE) {
+                return LINK_TIMEOUT;
+        }
+
+        int nCount = waitForData(pQueueImp, getNoOverwriteTimeout(pQueueImp));
+        if (nCount == LINK_TIMEOUT) {
+                pQueueImp->nQState_ = QUEUE_TIMEOUT_STATE;
+                return LINK_TIMEOUT;
+        }
+        if (nCount == 0) {
+                return 0;
+        }
+
+        int nHead = pQueueImp->nHead_;
+        if (pQueueImp->nIsByteStream_) {
+                char *pRing = NULL;
+                int nCap = 0;
+                int *pHead = NULL;
+                nCount = getStreamReadRegion(pQueueImp, &pRing, &nCap, &pHead);
+                int nOffset = ringOffset(nCap, *pHead);
+                int nFirst = nCap - nOffset;
+                if (nFirst > nCount) {
+                        nFirst = nCount;
+                }
+                pSpans[0].pData = pRing + nOffset;
+                pSpans[0].nLen = nFirst;
+                pSpans[1].pData = pRing;
+                pSpans[1].nLen = nCount - nFirst;
+                return nCount;
+        }
+
+        //一次只返回一个item
+        char *pItem = getItem(pQueueImp, nHead);
+        int nDataLen = 0;
+        memcpy(&nDataLen, pItem, sizeof(int));
+        pSpans[0].pData = pItem + sizeof(int) + pQueueImp->nReadOffset_;
+        pSpans[0].nLen = nDataLen - pQueueImp->nReadOffset_;
+        return pSpans[0].nLen;
+}
+
+static void Consume(LinkCircleQueue *_pQueue, int nLen)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        int nHead = pQueueImp->nHead_;
+        if (pQueueImp->nIsByteStream_) {
+                //Peek和Consume之间读的区域不会变：读磁盘时内存不会有新数据
+                char *pRing = NULL;
+                int nCap = 0;
+                int *pHead = NULL;
+                int nCount = getStreamReadRegion(pQueueImp, &pRing, &nCap, &pHead);
+                assert(nLen <= nCount);
+                statPopped(pQueueImp, pHead == &pQueueImp->nSpillHead_, *pHead, nLen, nLen);
+                LinkStoreRelease(pHead, ringAdd(nCap, *pHead, nLen));
+                return;
+        }
+
+        int nDataLen = 0;
+        memcpy(&nDataLen, getItem(pQueueImp, nHead), sizeof(int));
+        assert(pQueueImp->nReadOffset_ + nLen <= nDataLen);
+        pQueueImp->nReadOffset_ += nLen;
+        if (pQueueImp->nReadOffset_ < nDataLen) {
+                statPopped(pQueueImp, 0, nHead, 0, nLen);
+                return;
+        }
+        pQueueImp->nReadOffset_ = 0;
+        statPopped(pQueueImp, 0, nHead, 1, nLen);
+        LinkStoreRelease(&pQueueImp->nHead_, getNextIndex(pQueueImp, nHead));
+}
+
+static int GetFreeSize(LinkCircleQueue *_pQueue)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        int nFree = pQueueImp->nCap_ - getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), pQueueImp->nTail_);
+        if (!pQueueImp->nIsByteStream_) {
+                return nFree * (pQueueImp->nItemLen_ - sizeof(int));
+        }
+        if (pQueueImp->nSpillCap_) {
+                int nSpillFree = pQueueImp->nSpillCap_ - getSpillCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nSpillHead_), pQueueImp->nSpillTail_);
+                //写磁盘期间只能写磁盘，否则内存写满了接着写磁盘
+                if (pQueueImp->nSpilling_) {
+                        return nSpillFree;
+                }
+                return nFree + nSpillFree;
+        }
+        return nFree;
+}
+
+static void SetWakeupThreshold(LinkCircleQueue *_pQueue, int nThreshold)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        if (nThreshold < 1) {
+                nThreshold = 1;
+        }
+        if (nThreshold > pQueueImp->nCap_) {
+                nThreshold = pQueueImp->nCap_;
+        }
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        pQueueImp->nWakeupThreshold_ = nThreshold;
+        pthread_mutex_unlock(&pQueueImp->mutex_);
+}
+
+static void StopPush(LinkCircleQueue *_pQueue)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        pthread_mutex_lock(&pQueueImp->mutex_);
+        pQueueImp->nQState_ = QUEUE_READ_ONLY_STATE;
+        pthread_cond_signal(&pQueueImp->condition_);
+        pthread_mutex_unlock(&pQueueImp->mutex_);
+        return;
+}
+
+static void getStatInfo(LinkCircleQueue *_pQueue, LinkUploaderStatInfo *_pStatInfo)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+        unsigned int nSeq;
+
+        //先读消费者的再读生产者的，快照里nPopDataBytes_不会大于nPushDataBytes_
+        do {
+                nSeq = LinkLoadAcquire(&pQueueImp->nPopSeq_);
+                _pStatInfo->nPopDataBytes_ = pQueueImp->statInfo.nPopDataBytes_;
+                memcpy(_pStatInfo->nLatencyHist, pQueueImp->statInfo.nLatencyHist, sizeof(_pStatInfo->nLatencyHist));
+                LinkAcquireFence();
+        } while ((nSeq & 1) || LinkLoadAcquire(&pQueueImp->nPopSeq_) != nSeq);
+        do {
+                nSeq = LinkLoadAcquire(&pQueueImp->nPushSeq_);
+                _pStatInfo->nPushDataBytes_ = pQueueImp->statInfo.nPushDataBytes_;
+                _pStatInfo->nOverwriteCnt = pQueueImp->statInfo.nOverwriteCnt;
+                _pStatInfo->nDropped = pQueueImp->statInfo.nDropped;
+                _pStatInfo->nHighWaterMark = pQueueImp->statInfo.nHighWaterMark;
+                LinkAcquireFence();
+        } while ((nSeq & 1) || LinkLoadAcquire(&pQueueImp->nPushSeq_) != nSeq);
+
+        _pStatInfo->nLen_ = getUsedCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nHead_), LinkLoadAcquire(&pQueueImp->nTail_));
+        _pStatInfo->nSpillLen_ = 0;
+        _pStatInfo->nIsSpilled_ = LinkLoadAcquire(&pQueueImp->pSpill_) != NULL;
+        if (pQueueImp->nIsByteStream_) {
+                _pStatInfo->nSpillLen_ = getSpillCount(pQueueImp, LinkLoadAcquire(&pQueueImp->nSpillHead_), LinkLoadAcquire(&pQueueImp->nSpillTail_));
+                _pStatInfo->nLen_ += _pStatInfo->nSpillLen_;
+                _pStatInfo->nLen_ = (_pStatInfo->nLen_ + pQueueImp->nItemLen_ - 1) / pQueueImp->nItemLen_;
+        }
+        _pStatInfo->nIsReadOnly = pQueueImp->nQState_;
+        return;
+}
+
+static void putSpillFile(SpillFile *pFile);
+
+static void destroyQueue(LinkCircleQueue *_pQueue)
+{
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)_pQueue;
+
+        StopPush(_pQueue);
+
+        pthread_mutex_destroy(&pQueueImp->mutex_);
+        pthread_cond_destroy(&pQueueImp->condition_);
+
+        if (pQueueImp->pSpillFile_) {
+                putSpillFile(pQueueImp->pSpillFile_);
+        }
+        free(pQueueImp->pSpillDir_);
+        LinkPutArena(pQueueImp);
+        return;
+}
+
+static char * mapSpillFile(const char *_pDir, int _nSize)
+{
+        static int nSeq = 0;
+        char path[256];
+        int nLen = snprintf(path, sizeof(path), "%s/linkspill-%d-%d", _pDir, (int)getpid(), __sync_fetch_and_add(&nSeq, 1));
+        if (nLen >= sizeof(path)) {
+                LinkLogError("spill dir too long:%s", _pDir);
+                return NULL;
+        }
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+                LinkLogError("open spill file fail:%s %d", path, errno);
+                return NULL;
+        }
+        unlink(path); //只在mmap期间存在，进程退出或者崩溃都不会留下文件
+#ifdef __APPLE__
+        int ret = ftruncate(fd, _nSize);
+#else
+        int ret = posix_fallocate(fd, 0, _nSize); //先分配好，避免写的时候磁盘满了收到SIGBUS
+#endif
+        if (ret != 0) {
+                LinkLogError("alloc spill file fail:%s %d", path, ret);
+                close(fd);
+                return NULL;
+        }
+        void *pSpill = mmap(NULL, _nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (pSpill == MAP_FAILED) {
+                LinkLogError("mmap spill file fail:%s %d", path, errno);
+                return NULL;
+        }
+        return (char *)pSpill;
+}
+
+static void freeSpillFile(SpillFile *pFile)
+{
+        munmap(pFile->pData_, pFile->nSize_);
+        free(pFile->pStamps_);
+        free(pFile);
+}
+
+static SpillFile * getSpillFile(const char *_pDir, int _nSize, int _nSlots)
+{
+        SpillFile *pFile = NULL;
+
+        pthread_mutex_lock(&spillPool.mutex_);
+        SpillFile **ppFile = &spillPool.pFree_;
+        while (*ppFile) {
+                if ((*ppFile)->nSize_ == _nSize && (*ppFile)->nSlots_ == _nSlots) {
+                        pFile = *ppFile;
+                        *ppFile = pFile->pNext;
+                        spillPool.nFreeCount_--;
+                        break;
+                }
+                ppFile = &(*ppFile)->pNext;
+        }
+        spillPool.nOutstanding_++;
+        int nGeneration = spillPool.nGeneration_;
+        pthread_mutex_unlock(&spillPool.mutex_);
+
+        if (pFile == NULL) {
+                pFile = (SpillFile *)malloc(sizeof(SpillFile));
+                if (pFile) {
+                        pFile->pStamps_ = (uint32_t *)malloc(sizeof(uint32_t) * _nSlots);
+                        pFile->pData_ = pFile->pStamps_ ? mapSpillFile(_pDir, _nSize) : NULL;
+                }
+                if (pFile == NULL || pFile->pData_ == NULL) {
+                        if (pFile) {
+                                free(pFile->pStamps_);
+                                free(pFile);
+                        }
+                        pthread_mutex_lock(&spillPool.mutex_);
+                        spillPool.nOutstanding_--;
+                        pthread_mutex_unlock(&spillPool.mutex_);
+                        return NULL;
+                }
+                pFile->nSize_ = _nSize;
+                pFile->nSlots_ = _nSlots;
+                pFile->nGeneration_ = nGeneration;
+        }
+        pFile->pNext = NULL;
+        return pFile;
+}
+
+static void putSpillFile(SpillFile *pFile)
+{
+        pthread_mutex_lock(&spillPool.mutex_);
+        spillPool.nOutstanding_--;
+        if (pFile->nGeneration_ == spillPool.nGeneration_) {
+                //和arenapool一样，每个借出去的可以对应缓存一个
+                int nMaxCache = LINK_SPILL_DEFAULT_CACHE;
+                if (spillPool.nOutstanding_ > nMaxCache) {
+                        nMaxCache = spillPool.nOutstanding_;
+                }
+                pFile->pNext = spillPool.pFree_;
+                spillPool.pFree_ = pFile;
+                spillPool.nFreeCount_++;
+                pFile = NULL;
+                if (spillPool.nFreeCount_ > nMaxCache) {
+                        SpillFile **ppTail = &spillPool.pFree_;
+                        while ((*ppTail)->pNext) {
+                                ppTail = &(*ppTail)->pNext;
+                        }
+                        pFile = *ppTail;
+                        *ppTail = NULL;
+                        spillPool.nFreeCount_--;
+                }
+        }
+        pthread_mutex_unlock(&spillPool.mutex_);
+
+        if (pFile) {
+                freeSpillFile(pFile);
+        }
+}
+
+void LinkCleanSpillPool()
+{
+        pthread_mutex_lock(&spillPool.mutex_);
+        SpillFile *pFree = spillPool.pFree_;
+        spillPool.pFree_ = NULL;
+        spillPool.nFreeCount_ = 0;
+        spillPool.nGeneration_++;
+        pthread_mutex_unlock(&spillPool.mutex_);
+
+        while (pFree) {
+                SpillFile *pNext = pFree->pNext;
+                freeSpillFile(pFree);
+                pFree = pNext;
+        }
+}
+
+static int newSpscQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount,
+                        int _nIsByteStream, const char *_pSpillDir, int _nSpillSize)
+{
+        if (_policy != TSQ_FIX_LENGTH) {
+                LinkLogError("spsc queue can not grow. only support TSQ_FIX_LENGTH");
+                return LINK_ARG_ERROR;
+        }
+
+        int ret;
+        int nItemLen = _nIsByteStream ? _nMaxItemLen : _nMaxItemLen + sizeof(int); //item模式前缀int类型的一个长度
+        //内存从池里借，分片之间复用。每个item一个时间戳，放在数据前面保证对齐
+        int nStampsLen = sizeof(uint32_t) * _nInitItemCount;
+        SpscQueueImp *pQueueImp = (SpscQueueImp *)LinkGetArena(sizeof(SpscQueueImp) + nStampsLen + nItemLen * _nInitItemCount);
+        if (pQueueImp == NULL) {
+                return LINK_NO_MEMORY;
+        }
+        memset(pQueueImp, 0, sizeof(SpscQueueImp));
+
+        ret = pthread_mutex_init(&pQueueImp->mutex_, NULL);
+        if (ret != 0){
+                LinkPutArena(pQueueImp);
+                return LINK_MUTEX_ERROR;
+        }
+        ret = LinkInitMonotonicCond(&pQueueImp->condition_);
+        if (ret != 0){
+                pthread_mutex_destroy(&pQueueImp->mutex_);
+                LinkPutArena(pQueueImp);
+                return LINK_COND_ERROR;
+        }
+
+        pQueueImp->policy = _policy;
+        pQueueImp->pStamps_ = (uint32_t *)((char *)pQueueImp + sizeof(SpscQueueImp));
+        pQueueImp->pData_ = (char *)pQueueImp->pStamps_ + nStampsLen;
+        pQueueImp->nItemLen_ = nItemLen;
+        pQueueImp->nIsByteStream_ = _nIsByteStream;
+        if (_nIsByteStream) {
+                pQueueImp->nCap_ = nItemLen * _nInitItemCount;
+                pQueueImp->circleQueue.Push = PushStream;
+                pQueueImp->circleQueue.PushVec = PushStreamVec;
+                pQueueImp->circleQueue.Reserve = ReserveStream;
+                pQueueImp->circleQueue.Commit = CommitStream;
+        } else {
+                pQueueImp->nCap_ = _nInitItemCount;
+                pQueueImp->circleQueue.Push = PushQueue;
+                pQueueImp->circleQueue.PushVec = PushQueueVec;
+                pQueueImp->circleQueue.Reserve = ReserveQueue;
+                pQueueImp->circleQueue.Commit = CommitQueue;
+        }
+        pQueueImp->circleQueue.PopWithTimeout = PopQueue;
+        pQueueImp->circleQueue.PopWithNoOverwrite = PopQueueWithNoOverwrite;
+        pQueueImp->circleQueue.PeekWithNoOverwrite = PeekQueueWithNoOverwrite;
+        pQueueImp->circleQueue.Consume = Consume;
+        pQueueImp->circleQueue.GetFreeSize = GetFreeSize;
+        pQueueImp->circleQueue.SetWakeupThreshold = SetWakeupThreshold;
+        pQueueImp->circleQueue.StopPush = StopPush;
+        pQueueImp->circleQueue.GetStatInfo = getStatInfo;
+        pQueueImp->circleQueue.Destroy = destroyQueue;
+        pQueueImp->nIsAvailableAfterTimeout = nIsAvailableAfterTimeout;
+        pQueueImp->nWakeupThreshold_ = 1;
+
+        if (_pSpillDir != NULL) {
+                //和内存一样按nItemLen_对齐。文件等到要写磁盘时再拿
+                int nSpillCap = _nSpillSize / nItemLen * nItemLen;
+                if (nSpillCap > 0) {
+                        pQueueImp->pSpillDir_ = strdup(_pSpillDir);
+                }
+                if (pQueueImp->pSpillDir_) {
+                        pQueueImp->nSpillCap_ = nSpillCap;
+                } else {
+                        LinkLogWarn("queue without spill:%s %d", _pSpillDir, _nSpillSize);
+                }
+        }
+
+        *_pQueue = (LinkCircleQueue*)pQueueImp;
+        return LINK_SUCCESS;
+}
+
+int LinkNewSpscQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount)
+{
+        return newSpscQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount, 0, NULL, 0);
+}
+
+int LinkNewByteStreamQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount)
+{
+        return newSpscQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount, 1, NULL, 0);
+}
+
+int LinkNewSpillQueue(LinkCircleQueue **_pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount,
+                      const char *_pSpillDir, int _nSpillSize)
+{
+        return newSpscQueue(_pQueue, nIsAvailableAfterTimeout, _policy, _nMaxItemLen, _nInitItemCount, 1, _pSpillDir, _nSpillSize);
+}
@@ -0,0 +1,40 @@
+#ifndef __LINK_SPSC_QUEUE_H__
+#define __LINK_SPSC_QUEUE_H__
+
+#include "queue.h"
+
+// gcc >= 4.7 and clang have __atomic builtins. older cross toolchain only have __sync builtins
+#ifdef __ATOMIC_ACQUIRE
+#define LinkLoadAcquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LinkStoreRelease(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LinkFullBarrier()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define LinkReleaseFence()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#define LinkAcquireFence()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define LinkLoadAcquire(p)     ({ __typeof__(*(p)) _v = *(volatile __typeof__(*(p)) *)(p); __sync_synchronize(); _v; })
+#define LinkStoreRelease(p, v) do { __sync_synchronize(); *(volatile __typeof__(*(p)) *)(p) = (v); } while(0)
+#define LinkFullBarrier()      __sync_synchronize()
+#define LinkReleaseFence()     __sync_synchronize()
+#define LinkAcquireFence()     __sync_synchronize()
+#endif
+
+static inline int LinkGetIovecLen(const struct iovec *pVec, int nVecCount)
+{
+        int nLen = 0;
+        int i;
+        for (i = 0; i < nVecCount; i++) {
+                nLen += pVec[i].iov_len;
+        }
+        return nLen;
+}
+
+int LinkNewSpscQueue(LinkCircleQueue **pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy policy, int nMaxItemLen, int nInitItemCount);
+int LinkNewByteStreamQueue(LinkCircleQueue **pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy policy, int nMaxItemLen, int nInitItemCount);
+//字节流队列，内存满了以后写到pSpillDir下的一个mmap文件(最大nSpillSize字节)。文件在第一次写磁盘时才拿，
+//之前用过的同样大小的文件会复用。拿不到文件时和LinkNewByteStreamQueue一样
+int LinkNewSpillQueue(LinkCircleQueue **pQueue, int nIsAvailableAfterTimeout, enum CircleQueuePolicy policy, int nMaxItemLen, int nInitItemCount,
+                      const char *pSpillDir, int nSpillSize);
+//释放缓存的spill文件，正在用的还回来时也不再缓存。spill目录改了以后要调用
+void LinkCleanSpillPool();
+
+#endif
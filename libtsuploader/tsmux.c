@@ -1,5 +1,7 @@
 #include "tsmux.h"
 #include "base.h"
+#include "nalu.h"
+#include "fmp4mux.h"
 #include <pthread.h>
 
 #define STREAM_TYPE_PRIVATE_SECTION 0x05
@@ -7,27 +9,92 @@
 #define STREAM_TYPE_AUDIO_AAC       0x0f
 #define STREAM_TYPE_VIDEO_H264      0x1b
 #define STREAM_TYPE_VIDEO_HEVC      0x24
+#define STREAM_TYPE_METADATA        0x15 //metadata carried in PES
+
+#define METADATA_MAX 16384 //和音频一样，pes长度不能超过65535
+#define ID3_PRIV_OWNER "com.qiniu.link"
+#define ID3_PRIV_HEADER_LEN (10 + 10 + sizeof(ID3_PRIV_OWNER)) //id3头，PRIV帧头，owner(包括结尾的0)
+
+#define AUDIO_AGGREGATE_MAX 16384 //音频pes的长度不能超过65535
+#define INTERLEAVE_MAX_FRAMES 128
+
+#define INTERLEAVE_VIDEO 0
+#define INTERLEAVE_AUDIO 1
+#define INTERLEAVE_METADATA_BASE (LINK_TS_MAX_PROGRAMS * 2) //metadata的nType是这个加节目号，不在nStreams里
+
+typedef struct _PsiPackets PsiPackets;
 
 typedef struct PIDCounter {
         uint16_t nPID;
         uint16_t nCounter;
 }PIDCounter;
 
+//等待排序的一帧。pData在帧之间复用，只在放不下时才realloc
+typedef struct _InterleaveFrame {
+        int64_t nPts;
+        uint32_t nSeq; //pts相同时按调用顺序
+        int nType; //节目号*2 + INTERLEAVE_VIDEO/INTERLEAVE_AUDIO，或者INTERLEAVE_METADATA_BASE + 节目号
+        int nIsKeyFrame;
+        uint8_t *pData;
+        int nLen;
+        int nCap;
+}InterleaveFrame;
+
+//每个节目自己的pid、模板和pcr状态。单节目ts只有programs[0]
+typedef struct _TsProgram {
+        LinkAudioFormat nAudioFormat;
+        LinkVideoFormat nVideoFormat;
+        LinkTsProgram pids;
+        LinkPESTemplate videoTemplate;
+        LinkPESTemplate audioTemplate;
+        LinkPESTemplate metadataTemplate;
+        const uint8_t *pPmt;
+        int64_t nLastTablePts;
+        
+        uint8_t nPcrFlag; //分析ffmpeg，pcr只在pes中出现一次在最开头
+        
+        uint8_t *pAudioBuf; //还没有mux的音频帧，凑够nAudioAggregateDuration再作为一个pes输出
+        int nAudioBufLen;
+        int64_t nAudioBufPts;
+}TsProgram;
+
 typedef struct _LinkTsMuxerContext{
         LinkTsMuxerArg arg;
         LinkPES pes;
         int nMillisecondPatPeriod;
         uint8_t tsPacket[188];
         
-        int nPidCounterMapLen;
-        PIDCounter pidCounterMap[5];
-        uint64_t nLastPts;
+        int nPrograms;
+        TsProgram programs[LINK_TS_MAX_PROGRAMS];
+        
+        int nPidCounterMapLen; //只用于pat/pmt/sdt，音视频的continuity_counter在模板里
+        PIDCounter pidCounterMap[LINK_TS_MAX_PROGRAMS + 2];
+        const uint8_t *pPat;
+        uint8_t *pPsi; //多节目(或者缓存满了)时pat和每个节目的pmt，每个context自己生成。否则用缓存的PsiPackets
         pthread_mutex_t tsMutex_;
         int isTableWrited;
         
-        uint8_t nPcrFlag; //分析ffmpeg，pcr只在pes中出现一次在最开头
+        LinkFmp4MuxerContext *pFmp4; //输出fmp4时不为NULL，音视频直接交给它
+        
+        //nInterleaveWindow大于0时用。frames是预先分配的，pHeap是按(pts, nSeq)排的小顶堆，pFree是空闲的
+        InterleaveFrame *pFrames;
+        InterleaveFrame *pHeap[INTERLEAVE_MAX_FRAMES];
+        InterleaveFrame *pFree[INTERLEAVE_MAX_FRAMES];
+        int nHeapLen;
+        int nFreeLen;
+        uint32_t nSeq;
+        int64_t nNewestPts;
+        int nQueued[LINK_TS_MAX_PROGRAMS * 3]; //每路流在堆里的帧数
+        int nHeapTsBytes; //堆里的帧输出以后大概要多少字节的ts
+        uint32_t nStreams; //配置了的流，按InterleaveFrame.nType的位
 }LinkTsMuxerContext;
 
+//一帧打成ts以后的大概大小，pes头和pat/pmt按最多两个包算
+static int estimateTsSize(int _nLen)
+{
+        return ((_nLen + 40 + 183) / 184 + 2) * 188;
+}
+
 static uint16_t getPidCounter(LinkTsMuxerContext* _pMuxCtx, uint64_t _nPID)
 {
         int nCount = 0;
@@ -53,87 +120,290 @@ static int writeTsHeader(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pBuf, int _nUin
         return LinkWriteTsHeader(_pBuf, _nUinitStartIndicator, counter, _nPid, _nAdaptationField);
 }
 
-static void writeTable(LinkTsMuxerContext* _pMuxCtx, int64_t _nPts)
+//不同的音视频格式组合很少，pat/pmt(连同crc)只生成一次，输出时只改continuity_counter
+struct _PsiPackets {
+        int nVideoType;
+        int nAudioType;
+        int nMetadataType;
+        int nVersion;
+        uint8_t pat[188];
+        uint8_t pmt[188];
+};
+
+#define PSI_CACHE_SIZE 8
+static PsiPackets gPsiCache[PSI_CACHE_SIZE];
+static int gPsiCacheLen;
+static pthread_mutex_t gPsiCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const PsiPackets * getPsiPackets(const LinkTsProgram *_pPids)
 {
-        if (_pMuxCtx->isTableWrited) {
-                return;
+        const PsiPackets *pPsi = NULL;
+        int i;
+        pthread_mutex_lock(&gPsiCacheMutex);
+        for (i = 0; i < gPsiCacheLen; i++) {
+                if (gPsiCache[i].nVideoType == _pPids->nVideoStreamType && gPsiCache[i].nAudioType == _pPids->nAudioStreamType
+                    && gPsiCache[i].nMetadataType == _pPids->nMetadataStreamType && gPsiCache[i].nVersion == _pPids->nVersion) {
+                        pPsi = &gPsiCache[i];
+                        break;
+                }
         }
-        pthread_mutex_lock(&_pMuxCtx->tsMutex_);
-        if (_pMuxCtx->isTableWrited) {
-                pthread_mutex_unlock(&_pMuxCtx->tsMutex_);
-                return;
+        if (pPsi == NULL && gPsiCacheLen < PSI_CACHE_SIZE) {
+                PsiPackets *pNew = &gPsiCache[gPsiCacheLen];
+                pNew->nVideoType = _pPids->nVideoStreamType;
+                pNew->nAudioType = _pPids->nAudioStreamType;
+                pNew->nMetadataType = _pPids->nMetadataStreamType;
+                pNew->nVersion = _pPids->nVersion;
+                int nLen = LinkWritePAT(pNew->pat, 1, 0, LINK_ADAPTATION_JUST_PAYLOAD);
+                memset(&pNew->pat[nLen], 0xff, 188 - nLen);
+                nLen = LinkWriteProgramPMT(pNew->pmt, 1, 0, LINK_ADAPTATION_JUST_PAYLOAD, _pPids);
+                memset(&pNew->pmt[nLen], 0xff, 188 - nLen);
+                gPsiCacheLen++;
+                pPsi = pNew;
         }
-        int nLen = 0;
-        int nCount = 0;
-        if (_pMuxCtx->nLastPts == 0 || _nPts - _pMuxCtx->nLastPts > 300 * 90) { //300毫米间隔
-                /*
-                 nCount =getPidCounter(_pMuxCtx, 0x11);
-                 nLen = WriteSDT(_pMuxCtx->tsPacket, 1, nCount, ADAPTATION_JUST_PAYLOAD);
-                 memset(&_pMuxCtx->tsPacket[nLen], 0xff, 188 - nLen);
-                 _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque,_pMuxCtx->tsPacket, 188);
-                 */
-                
-                nCount =getPidCounter(_pMuxCtx, 0x00);
-                nLen = LinkWritePAT(_pMuxCtx->tsPacket, 1, nCount, LINK_ADAPTATION_JUST_PAYLOAD);
-                memset(&_pMuxCtx->tsPacket[nLen], 0xff, 188 - nLen);
-                _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque,_pMuxCtx->tsPacket, 188);
-                
-                nCount =getPidCounter(_pMuxCtx, 0x1000);
-                int nAudioType = 0;
-                int nVideoType = 0;
-                if (_pMuxCtx->arg.nAudioFormat == LINK_AUDIO_AAC) {
-                        nAudioType = STREAM_TYPE_AUDIO_AAC;
-                } else if (_pMuxCtx->arg.nAudioFormat == LINK_AUDIO_PCMU || _pMuxCtx->arg.nAudioFormat == LINK_AUDIO_PCMA) {
-                        nAudioType = STREAM_TYPE_PRIVATE_DATA;
-                }
-                if (_pMuxCtx->arg.nVideoFormat == LINK_VIDEO_H264) {
-                        nVideoType = STREAM_TYPE_VIDEO_H264;
-                } else if (_pMuxCtx->arg.nVideoFormat == LINK_VIDEO_H265) {
-                        nVideoType = STREAM_TYPE_VIDEO_HEVC;
-                }
-                nLen = LinkWritePMT(_pMuxCtx->tsPacket, 1, nCount, LINK_ADAPTATION_JUST_PAYLOAD, nVideoType, nAudioType);
-                memset(&_pMuxCtx->tsPacket[nLen], 0xff, 188 - nLen);
-                _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque,_pMuxCtx->tsPacket, 188);
+        pthread_mutex_unlock(&gPsiCacheMutex);
+        return pPsi;
+}
+
+//多节目的pat/pmt由节目个数和每个节目的格式决定，组合太多不缓存。单节目缓存满了(比如格式改了很多次)也用这个
+static int makePsi(LinkTsMuxerContext* _pMuxCtx)
+{
+        LinkTsProgram pids[LINK_TS_MAX_PROGRAMS];
+        int i;
+        _pMuxCtx->pPsi = (uint8_t *)malloc(188 * (_pMuxCtx->nPrograms + 1));
+        if (_pMuxCtx->pPsi == NULL) {
+                return LINK_NO_MEMORY;
+        }
+        for (i = 0; i < _pMuxCtx->nPrograms; i++) {
+                pids[i] = _pMuxCtx->programs[i].pids;
+        }
+        uint8_t *pPacket = _pMuxCtx->pPsi;
+        int nLen = LinkWriteProgramPAT(pPacket, 1, 0, LINK_ADAPTATION_JUST_PAYLOAD, pids, _pMuxCtx->nPrograms);
+        memset(&pPacket[nLen], 0xff, 188 - nLen);
+        _pMuxCtx->pPat = pPacket;
+        for (i = 0; i < _pMuxCtx->nPrograms; i++) {
+                pPacket += 188;
+                nLen = LinkWriteProgramPMT(pPacket, 1, 0, LINK_ADAPTATION_JUST_PAYLOAD, &pids[i]);
+                memset(&pPacket[nLen], 0xff, 188 - nLen);
+                _pMuxCtx->programs[i].pPmt = pPacket;
+        }
+        return 0;
+}
+
+static int outputPacket(LinkTsMuxerContext* _pMuxCtx, const uint8_t *_pPacket, int _nPid)
+{
+        uint8_t *pPacket = NULL;
+        if (_pMuxCtx->arg.reserve) {
+                pPacket = _pMuxCtx->arg.reserve(_pMuxCtx->arg.pOpaque, 188);
+        }
+        if (pPacket == NULL) {
+                pPacket = _pMuxCtx->tsPacket;
+        }
+        memcpy(pPacket, _pPacket, 188);
+        LinkWriteContinuityCounter(pPacket, getPidCounter(_pMuxCtx, _nPid));
+        if (pPacket != _pMuxCtx->tsPacket) {
+                return _pMuxCtx->arg.commit(_pMuxCtx->arg.pOpaque, 188);
+        }
+        return _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque, pPacket, 188);
+}
+
+//在tsMutex_里调用。分片开头写pat和所有节目的pmt，之后只写pat和这个节目的pmt
+static int writeTable(LinkTsMuxerContext* _pMuxCtx, int _nProgram, int64_t _nPts)
+{
+        int i;
+        int nRet = outputPacket(_pMuxCtx, _pMuxCtx->pPat, LINK_PAT_PID);
+        if (nRet < 0) {
+                return nRet;
+        }
+        for (i = 0; i < _pMuxCtx->nPrograms; i++) {
+                TsProgram *pProgram = &_pMuxCtx->programs[i];
+                if (_pMuxCtx->isTableWrited && i != _nProgram) {
+                        continue;
+                }
+                nRet = outputPacket(_pMuxCtx, pProgram->pPmt, pProgram->pids.nPmtPid);
+                if (nRet < 0) {
+                        return nRet;
+                }
+                pProgram->nLastTablePts = _nPts;
         }
         _pMuxCtx->isTableWrited = 1;
-        pthread_mutex_unlock(&_pMuxCtx->tsMutex_);
+        return 0;
+}
+
+//分片开始时写一次，之后在间隔了nTableInterval毫秒以后的第一个关键帧前面再写，中途加入的播放器可以马上开始解码
+static int needWriteTable(LinkTsMuxerContext* _pMuxCtx, TsProgram *_pProgram, int _nIsKeyFrame, int64_t _nPts)
+{
+        if (!_pMuxCtx->isTableWrited) {
+                return 1;
+        }
+        if (!_nIsKeyFrame || _pMuxCtx->arg.nTableInterval < 0) {
+                return 0;
+        }
+        return _nPts - _pProgram->nLastTablePts >= _pMuxCtx->arg.nTableInterval;
+}
+
+static void initProgram(TsProgram *_pProgram, int _nIndex, LinkVideoFormat _nVideoFormat, LinkAudioFormat _nAudioFormat,
+                        int _nWithMetadata, int _nVersion)
+{
+        LinkTsProgram *pPids = &_pProgram->pids;
+        pPids->nVersion = _nVersion & 0x1F;
+        _pProgram->nVideoFormat = _nVideoFormat;
+        _pProgram->nAudioFormat = _nAudioFormat;
+        pPids->nProgramNumber = _nIndex + 1;
+        pPids->nPmtPid = LINK_PROGRAM_PMT_PID(_nIndex);
+        pPids->nVideoPid = LINK_PROGRAM_VIDEO_PID(_nIndex);
+        pPids->nAudioPid = LINK_PROGRAM_AUDIO_PID(_nIndex);
+        if (_nAudioFormat == LINK_AUDIO_AAC) {
+                pPids->nAudioStreamType = STREAM_TYPE_AUDIO_AAC;
+        } else if (_nAudioFormat == LINK_AUDIO_PCMU || _nAudioFormat == LINK_AUDIO_PCMA) {
+                pPids->nAudioStreamType = STREAM_TYPE_PRIVATE_DATA;
+        }
+        if (_nVideoFormat == LINK_VIDEO_H264) {
+                pPids->nVideoStreamType = STREAM_TYPE_VIDEO_H264;
+        } else if (_nVideoFormat == LINK_VIDEO_H265) {
+                pPids->nVideoStreamType = STREAM_TYPE_VIDEO_HEVC;
+        }
+        LinkInitPESTemplate(&_pProgram->videoTemplate, pPids->nVideoPid, 0xE0, _nVideoFormat);
+        LinkInitPESTemplate(&_pProgram->audioTemplate, pPids->nAudioPid,
+                            _nAudioFormat == LINK_AUDIO_AAC ? 0xC0 : 0xBD, (LinkVideoFormat)0);
+        if (_nWithMetadata) {
+                pPids->nMetadataPid = LINK_PROGRAM_METADATA_PID(_nIndex);
+                pPids->nMetadataStreamType = STREAM_TYPE_METADATA;
+                LinkInitPESTemplate(&_pProgram->metadataTemplate, pPids->nMetadataPid, 0xBD, (LinkVideoFormat)0);
+        }
+}
+
+static void destroyTsMuxerContext(LinkTsMuxerContext *_pTsMuxerCtx)
+{
+        int i;
+        for (i = 0; i < _pTsMuxerCtx->nPrograms; i++) {
+                if (_pTsMuxerCtx->programs[i].pAudioBuf) {
+                        free(_pTsMuxerCtx->programs[i].pAudioBuf);
+                }
+        }
+        if (_pTsMuxerCtx->pFrames) {
+                for (i = 0; i < INTERLEAVE_MAX_FRAMES; i++) {
+                        if (_pTsMuxerCtx->pFrames[i].pData) {
+                                free(_pTsMuxerCtx->pFrames[i].pData);
+                        }
+                }
+                free(_pTsMuxerCtx->pFrames);
+        }
+        if (_pTsMuxerCtx->pPsi) {
+                free(_pTsMuxerCtx->pPsi);
+        }
+        LinkDestroyFmp4MuxerContext(_pTsMuxerCtx->pFmp4);
+        free(_pTsMuxerCtx);
 }
 
-uint16_t Pids[5] = {LINK_AUDIO_PID, LINK_VIDEO_PID, LINK_PAT_PID, LINK_PMT_PID, LINK_SDT_PID};
 int LinkNewTsMuxerContext(LinkTsMuxerArg *pArg, LinkTsMuxerContext **_pTsMuxerCtx)
 {
         int i;
+        int nPrograms = pArg->nProgramCount > 1 ? pArg->nProgramCount : 1;
+        if (nPrograms > LINK_TS_MAX_PROGRAMS || (nPrograms > 1 && (pArg->pPrograms == NULL || pArg->nContainer != LINK_CONTAINER_TS))
+            || (pArg->nWithMetadata && pArg->nContainer != LINK_CONTAINER_TS)) {
+                LinkLogError("wrong program arg:%d %d", pArg->nProgramCount, pArg->nContainer);
+                return LINK_ARG_ERROR;
+        }
         LinkTsMuxerContext *pTsMuxerCtx = (LinkTsMuxerContext *)malloc(sizeof(LinkTsMuxerContext));
         if (pTsMuxerCtx == NULL) {
                 return LINK_NO_MEMORY;
         }
         memset(pTsMuxerCtx, 0, sizeof(LinkTsMuxerContext));
         pTsMuxerCtx->arg = *pArg;
-        pTsMuxerCtx->nPidCounterMapLen = 5;
-        for ( i = 0; i < pTsMuxerCtx->nPidCounterMapLen; i++){
-                pTsMuxerCtx->pidCounterMap[i].nPID = Pids[i];
-                pTsMuxerCtx->pidCounterMap[i].nCounter = 0;
+        pTsMuxerCtx->arg.pPrograms = NULL; //创建以后不再用
+        pTsMuxerCtx->nPrograms = nPrograms;
+        
+        pTsMuxerCtx->pidCounterMap[0].nPID = LINK_PAT_PID;
+        pTsMuxerCtx->pidCounterMap[1].nPID = LINK_SDT_PID;
+        pTsMuxerCtx->nPidCounterMapLen = 2 + nPrograms;
+        for (i = 0; i < nPrograms; i++) {
+                pTsMuxerCtx->pidCounterMap[2 + i].nPID = LINK_PROGRAM_PMT_PID(i);
+                if (nPrograms == 1) {
+                        initProgram(&pTsMuxerCtx->programs[i], i, pArg->nVideoFormat, pArg->nAudioFormat,
+                                    pArg->nWithMetadata, pArg->nPmtVersion);
+                } else {
+                        initProgram(&pTsMuxerCtx->programs[i], i, pArg->pPrograms[i].nVideoFormat, pArg->pPrograms[i].nAudioFormat,
+                                    pArg->nWithMetadata, pArg->nPmtVersion);
+                }
+        }
+        
+        const PsiPackets *pPsi = NULL;
+        if (nPrograms == 1) {
+                pPsi = getPsiPackets(&pTsMuxerCtx->programs[0].pids);
+        }
+        if (pPsi) {
+                pTsMuxerCtx->pPat = pPsi->pat;
+                pTsMuxerCtx->programs[0].pPmt = pPsi->pmt;
+        } else if (makePsi(pTsMuxerCtx) != 0) {
+                free(pTsMuxerCtx);
+                return LINK_NO_MEMORY;
+        }
+        
+        if (pArg->nContainer == LINK_CONTAINER_FMP4) {
+                int ret = LinkNewFmp4MuxerContext(pArg, &pTsMuxerCtx->pFmp4);
+                if (ret != 0) {
+                        destroyTsMuxerContext(pTsMuxerCtx);
+                        return ret;
+                }
+        } else if (pArg->nInterleaveWindow > 0) {
+                pTsMuxerCtx->pFrames = (InterleaveFrame *)malloc(sizeof(InterleaveFrame) * INTERLEAVE_MAX_FRAMES);
+                if (pTsMuxerCtx->pFrames == NULL) {
+                        destroyTsMuxerContext(pTsMuxerCtx);
+                        return LINK_NO_MEMORY;
+                }
+                memset(pTsMuxerCtx->pFrames, 0, sizeof(InterleaveFrame) * INTERLEAVE_MAX_FRAMES);
+                for (i = 0; i < INTERLEAVE_MAX_FRAMES; i++) {
+                        pTsMuxerCtx->pFree[i] = &pTsMuxerCtx->pFrames[i];
+                }
+                pTsMuxerCtx->nFreeLen = INTERLEAVE_MAX_FRAMES;
+                for (i = 0; i < nPrograms; i++) {
+                        if (pTsMuxerCtx->programs[i].nVideoFormat) {
+                                pTsMuxerCtx->nStreams |= 1u << (i * 2 + INTERLEAVE_VIDEO);
+                        }
+                        if (pTsMuxerCtx->programs[i].nAudioFormat) {
+                                pTsMuxerCtx->nStreams |= 1u << (i * 2 + INTERLEAVE_AUDIO);
+                        }
+                }
         }
         int ret = pthread_mutex_init(&pTsMuxerCtx->tsMutex_, NULL);
         if (ret != 0){
-                free(pTsMuxerCtx);
+                destroyTsMuxerContext(pTsMuxerCtx);
                 return LINK_MUTEX_ERROR;
         }
         *_pTsMuxerCtx = pTsMuxerCtx;
         return 0;
 }
 
-static int makeTsPacket(LinkTsMuxerContext* _pMuxCtx, int _nPid)
+static int makeTsPacket(LinkTsMuxerContext* _pMuxCtx, LinkPESTemplate *_pTemplate)
 {
         int nReadLen = 0;
-        int nCount = 0;
         do {
                 int nRet = 0;
-                nReadLen = LinkGetPESData(&_pMuxCtx->pes, 0, _nPid, _pMuxCtx->tsPacket, 188);
+                uint8_t *pPacket = NULL;
+                if (_pMuxCtx->arg.reserve) {
+                        pPacket = _pMuxCtx->arg.reserve(_pMuxCtx->arg.pOpaque, 188);
+                }
+                if (pPacket == NULL && _pMuxCtx->arg.outputVec) {
+                        struct iovec vec[2];
+                        nReadLen = LinkGetTemplatePESDataVec(_pTemplate, &_pMuxCtx->pes, _pMuxCtx->tsPacket, vec);
+                        if (nReadLen == 188) {
+                                nRet = _pMuxCtx->arg.outputVec(_pMuxCtx->arg.pOpaque, vec, 2);
+                                if (nRet < 0) {
+                                        return nRet;
+                                }
+                        }
+                        continue;
+                }
+                if (pPacket == NULL) {
+                        pPacket = _pMuxCtx->tsPacket;
+                }
+                nReadLen = LinkGetTemplatePESData(_pTemplate, &_pMuxCtx->pes, pPacket);
                 if (nReadLen == 188){
-                        nCount = getPidCounter(_pMuxCtx, _nPid);
-                        LinkWriteContinuityCounter(_pMuxCtx->tsPacket, nCount);
-                        nRet = _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque, _pMuxCtx->tsPacket, 188);
+                        if (pPacket != _pMuxCtx->tsPacket) {
+                                nRet = _pMuxCtx->arg.commit(_pMuxCtx->arg.pOpaque, 188);
+                        } else {
+                                nRet = _pMuxCtx->arg.output(_pMuxCtx->arg.pOpaque, pPacket, 188);
+                        }
                         if (nRet < 0) {
                                 return nRet;
                         }
@@ -142,48 +412,427 @@ static int makeTsPacket(LinkTsMuxerContext* _pMuxCtx, int _nPid)
         return 0;
 }
 
-int LinkMuxerAudio(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+//_pHeader不为NULL时(aac的adts头)先于_pData输出，不用拼接
+static int muxAudio(LinkTsMuxerContext* _pMuxCtx, int _nProgram, const uint8_t *_pHeader, int _nHeaderLen,
+                    uint8_t *_pData, int _nDataLen, int64_t _nPts)
 {
-        writeTable(_pMuxCtx, 0);
-        pthread_mutex_lock(&_pMuxCtx->tsMutex_);
-        if (_pMuxCtx->arg.nAudioFormat == LINK_AUDIO_AAC) {
+        TsProgram *pProgram = &_pMuxCtx->programs[_nProgram];
+        if (!_pMuxCtx->isTableWrited) {
+                int nRet = writeTable(_pMuxCtx, _nProgram, _nPts);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        if (_pHeader) {
+                LinkInitAudioPESWithPrefix(&_pMuxCtx->pes, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        } else if (pProgram->nAudioFormat == LINK_AUDIO_AAC) {
                 LinkInitAudioPES(&_pMuxCtx->pes, _pData, _nDataLen, _nPts);
         } else {
                 LinkInitPrivateTypePES(&_pMuxCtx->pes, _pData, _nDataLen, _nPts);
         }
+        return makeTsPacket(_pMuxCtx, &pProgram->audioTemplate);
+}
+
+static int interleave(LinkTsMuxerContext* _pMuxCtx, int _nType, const uint8_t *_pHeader, int _nHeaderLen,
+                      uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame);
+
+//合成以后的音频pes也要排序
+static int outputAudio(LinkTsMuxerContext* _pMuxCtx, int _nProgram, const uint8_t *_pHeader, int _nHeaderLen,
+                       uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        if (_pMuxCtx->pFrames) {
+                return interleave(_pMuxCtx, _nProgram * 2 + INTERLEAVE_AUDIO, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts, 0);
+        }
+        return muxAudio(_pMuxCtx, _nProgram, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+}
+
+static int flushAudio(LinkTsMuxerContext* _pMuxCtx, int _nProgram)
+{
+        TsProgram *pProgram = &_pMuxCtx->programs[_nProgram];
+        if (pProgram->nAudioBufLen == 0) {
+                return 0;
+        }
+        int nLen = pProgram->nAudioBufLen;
+        pProgram->nAudioBufLen = 0;
+        return outputAudio(_pMuxCtx, _nProgram, NULL, 0, pProgram->pAudioBuf, nLen, pProgram->nAudioBufPts);
+}
+
+//g711一帧只有几十到一百多字节，每帧一个pes的话ts头和填充比数据还多。几帧拼成一个pes，pts用第一帧的
+//aac的adts帧可以直接拼接，每帧有自己的adts头
+static int aggregateAudio(LinkTsMuxerContext* _pMuxCtx, int _nProgram, const uint8_t *_pHeader, int _nHeaderLen,
+                          uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        TsProgram *pProgram = &_pMuxCtx->programs[_nProgram];
+        int nLen = _nHeaderLen + _nDataLen;
+        if (pProgram->nAudioBufLen > 0 && (_nPts - pProgram->nAudioBufPts >= _pMuxCtx->arg.nAudioAggregateDuration ||
+                                           pProgram->nAudioBufLen + nLen > AUDIO_AGGREGATE_MAX)) {
+                int nRet = flushAudio(_pMuxCtx, _nProgram);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        if (pProgram->pAudioBuf == NULL) {
+                pProgram->pAudioBuf = (uint8_t *)malloc(AUDIO_AGGREGATE_MAX);
+        }
+        if (pProgram->pAudioBuf == NULL || nLen > AUDIO_AGGREGATE_MAX) {
+                return outputAudio(_pMuxCtx, _nProgram, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        }
+        if (pProgram->nAudioBufLen == 0) {
+                pProgram->nAudioBufPts = _nPts;
+        }
+        if (_nHeaderLen > 0) {
+                memcpy(pProgram->pAudioBuf + pProgram->nAudioBufLen, _pHeader, _nHeaderLen);
+        }
+        memcpy(pProgram->pAudioBuf + pProgram->nAudioBufLen + _nHeaderLen, _pData, _nDataLen);
+        pProgram->nAudioBufLen += nLen;
+        return 0;
+}
+
+static int muxVideo(LinkTsMuxerContext* _pMuxCtx, int _nProgram, uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
+{
+        TsProgram *pProgram = &_pMuxCtx->programs[_nProgram];
+        if (needWriteTable(_pMuxCtx, pProgram, _nIsKeyFrame, _nPts)) {
+                int nRet = writeTable(_pMuxCtx, _nProgram, _nPts);
+                if (nRet < 0) {
+                        return nRet;
+                }
+                pProgram->nPcrFlag = 0; //重新写了pat/pmt的关键帧也带上pcr
+        }
+        if (pProgram->nPcrFlag == 0) {
+                pProgram->nPcrFlag = 1;
+                LinkInitVideoPESWithPcr(&_pMuxCtx->pes, pProgram->nVideoFormat, _pData, _nDataLen, _nPts);
+        } else {
+                LinkInitVideoPES(&_pMuxCtx->pes, pProgram->nVideoFormat, _pData, _nDataLen, _nPts);
+        }
+        _pMuxCtx->pes.nWithoutAud = LinkIsAudPrefixed(pProgram->nVideoFormat, _pData, _nDataLen);
         
-        int nRet = makeTsPacket(_pMuxCtx, LINK_AUDIO_PID);
+        return makeTsPacket(_pMuxCtx, &pProgram->videoTemplate);
+}
+
+static int frameBefore(const InterleaveFrame *_pA, const InterleaveFrame *_pB)
+{
+        if (_pA->nPts != _pB->nPts) {
+                return _pA->nPts < _pB->nPts;
+        }
+        return (int32_t)(_pA->nSeq - _pB->nSeq) < 0;
+}
+
+static void heapPush(LinkTsMuxerContext* _pMuxCtx, InterleaveFrame *_pFrame)
+{
+        InterleaveFrame **pHeap = _pMuxCtx->pHeap;
+        int i = _pMuxCtx->nHeapLen++;
+        while (i > 0) {
+                int nParent = (i - 1) / 2;
+                if (!frameBefore(_pFrame, pHeap[nParent])) {
+                        break;
+                }
+                pHeap[i] = pHeap[nParent];
+                i = nParent;
+        }
+        pHeap[i] = _pFrame;
+}
+
+static InterleaveFrame * heapPop(LinkTsMuxerContext* _pMuxCtx)
+{
+        InterleaveFrame **pHeap = _pMuxCtx->pHeap;
+        InterleaveFrame *pTop = pHeap[0];
+        InterleaveFrame *pLast = pHeap[--_pMuxCtx->nHeapLen];
+        int nLen = _pMuxCtx->nHeapLen;
+        int i = 0;
+        while (2 * i + 1 < nLen) {
+                int nChild = 2 * i + 1;
+                if (nChild + 1 < nLen && frameBefore(pHeap[nChild + 1], pHeap[nChild])) {
+                        nChild++;
+                }
+                if (!frameBefore(pHeap[nChild], pLast)) {
+                        break;
+                }
+                pHeap[i] = pHeap[nChild];
+                i = nChild;
+        }
+        if (nLen > 0) {
+                pHeap[i] = pLast;
+        }
+        return pTop;
+}
+
+static int muxMetadata(LinkTsMuxerContext* _pMuxCtx, int _nProgram, const uint8_t *_pHeader, int _nHeaderLen,
+                       uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        TsProgram *pProgram = &_pMuxCtx->programs[_nProgram];
+        if (!_pMuxCtx->isTableWrited) {
+                int nRet = writeTable(_pMuxCtx, _nProgram, _nPts);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        if (_pHeader) {
+                LinkInitPrivateTypePESWithPrefix(&_pMuxCtx->pes, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        } else {
+                LinkInitPrivateTypePES(&_pMuxCtx->pes, _pData, _nDataLen, _nPts);
+        }
+        return makeTsPacket(_pMuxCtx, &pProgram->metadataTemplate);
+}
+
+static int muxInterleaveFrame(LinkTsMuxerContext* _pMuxCtx, int _nType, const uint8_t *_pHeader, int _nHeaderLen,
+                              uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
+{
+        if (_nType >= INTERLEAVE_METADATA_BASE) {
+                return muxMetadata(_pMuxCtx, _nType - INTERLEAVE_METADATA_BASE, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        }
+        if (_nType % 2 == INTERLEAVE_VIDEO) {
+                return muxVideo(_pMuxCtx, _nType / 2, _pData, _nDataLen, _nPts, _nIsKeyFrame);
+        }
+        return muxAudio(_pMuxCtx, _nType / 2, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+}
+
+//堆顶的帧在下面的情况下可以输出：配置了的流都有帧在等(后面来的帧时间戳不会更小)，
+//或者已经等了nInterleaveWindow，或者堆满了。_nAll表示全部输出
+static int drainInterleave(LinkTsMuxerContext* _pMuxCtx, int _nAll)
+{
+        while (_pMuxCtx->nHeapLen > 0) {
+                InterleaveFrame *pTop = _pMuxCtx->pHeap[0];
+                int nAllQueued = 1;
+                int i;
+                for (i = 0; i < _pMuxCtx->nPrograms * 2; i++) {
+                        if ((_pMuxCtx->nStreams & (1u << i)) && _pMuxCtx->nQueued[i] == 0) {
+                                nAllQueued = 0;
+                                break;
+                        }
+                }
+                if (!_nAll && !nAllQueued && _pMuxCtx->nFreeLen > 0 &&
+                    _pMuxCtx->nNewestPts - pTop->nPts < _pMuxCtx->arg.nInterleaveWindow) {
+                        break;
+                }
+                heapPop(_pMuxCtx);
+                _pMuxCtx->nQueued[pTop->nType]--;
+                _pMuxCtx->nHeapTsBytes -= estimateTsSize(pTop->nLen);
+                _pMuxCtx->pFree[_pMuxCtx->nFreeLen++] = pTop;
+                int nRet = muxInterleaveFrame(_pMuxCtx, pTop->nType, NULL, 0, pTop->pData, pTop->nLen, pTop->nPts, pTop->nIsKeyFrame);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        return 0;
+}
+
+//比堆里的帧都早，别的流也都有帧在等(后面来的不会更早)，排序以后也是马上输出，不用拷贝到堆里
+static int canMuxDirectly(LinkTsMuxerContext* _pMuxCtx, int _nType, int64_t _nPts)
+{
+        int i;
+        if (_pMuxCtx->nHeapLen > 0 && _nPts >= _pMuxCtx->pHeap[0]->nPts) {
+                return 0;
+        }
+        for (i = 0; i < _pMuxCtx->nPrograms * 2; i++) {
+                if (i != _nType && (_pMuxCtx->nStreams & (1u << i)) && _pMuxCtx->nQueued[i] == 0) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+//摄像头的音频经常是一次来几百毫秒，按调用顺序写的话播放器要缓冲很多才能开始播。
+//在nInterleaveWindow内按时间戳排序再输出。没有b帧，pts就是dts。音频是合成pes以后再排序的
+static int interleave(LinkTsMuxerContext* _pMuxCtx, int _nType, const uint8_t *_pHeader, int _nHeaderLen,
+                      uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
+{
+        int nLen = _nHeaderLen + _nDataLen;
+        if (canMuxDirectly(_pMuxCtx, _nType, _nPts)) {
+                return muxInterleaveFrame(_pMuxCtx, _nType, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts, _nIsKeyFrame);
+        }
+        if (_pMuxCtx->nFreeLen == 0) {
+                int nRet = drainInterleave(_pMuxCtx, 0);
+                if (nRet < 0) {
+                        return nRet;
+                }
+        }
+        InterleaveFrame *pFrame = _pMuxCtx->pFree[_pMuxCtx->nFreeLen - 1];
+        if (pFrame->nCap < nLen) {
+                uint8_t *pData = (uint8_t *)realloc(pFrame->pData, nLen);
+                if (pData == NULL) {
+                        //放不进去就不排序了，先把前面的输出
+                        int nRet = drainInterleave(_pMuxCtx, 1);
+                        if (nRet < 0) {
+                                return nRet;
+                        }
+                        return muxInterleaveFrame(_pMuxCtx, _nType, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts, _nIsKeyFrame);
+                }
+                pFrame->pData = pData;
+                pFrame->nCap = nLen;
+        }
+        _pMuxCtx->nFreeLen--;
+        if (_nHeaderLen > 0) {
+                memcpy(pFrame->pData, _pHeader, _nHeaderLen);
+        }
+        memcpy(pFrame->pData + _nHeaderLen, _pData, _nDataLen);
+        pFrame->nLen = nLen;
+        pFrame->nPts = _nPts;
+        pFrame->nSeq = _pMuxCtx->nSeq++;
+        pFrame->nType = _nType;
+        pFrame->nIsKeyFrame = _nIsKeyFrame;
+        heapPush(_pMuxCtx, pFrame);
+        _pMuxCtx->nQueued[_nType]++;
+        _pMuxCtx->nHeapTsBytes += estimateTsSize(nLen);
+        if (_pMuxCtx->nHeapLen == 1 || _nPts > _pMuxCtx->nNewestPts) {
+                _pMuxCtx->nNewestPts = _nPts;
+        }
+        return drainInterleave(_pMuxCtx, 0);
+}
+
+int LinkMuxerProgramAudioWithHeader(LinkTsMuxerContext* _pMuxCtx, int _nProgram, const uint8_t *_pHeader, int _nHeaderLen,
+                                    uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        int nRet = 0;
+        if (_nProgram < 0 || _nProgram >= _pMuxCtx->nPrograms || (_pHeader == NULL && _nHeaderLen != 0)) {
+                return LINK_ARG_ERROR;
+        }
+        pthread_mutex_lock(&_pMuxCtx->tsMutex_);
+        if (_pMuxCtx->pFmp4) {
+                //mp4里的aac本来就不要adts头
+                nRet = LinkFmp4MuxerAudio(_pMuxCtx->pFmp4, _pData, _nDataLen, _nPts);
+        } else if (_pMuxCtx->arg.nAudioAggregateDuration > 0) {
+                nRet = aggregateAudio(_pMuxCtx, _nProgram, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        } else {
+                nRet = outputAudio(_pMuxCtx, _nProgram, _pHeader, _nHeaderLen, _pData, _nDataLen, _nPts);
+        }
         pthread_mutex_unlock(&_pMuxCtx->tsMutex_);
         if (nRet < 0)
                 return nRet;
         return 0;
 }
 
-int LinkMuxerVideo(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+int LinkMuxerProgramVideo(LinkTsMuxerContext* _pMuxCtx, int _nProgram, uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
 {
-        writeTable(_pMuxCtx, 0);
+        int nRet = 0;
+        if (_nProgram < 0 || _nProgram >= _pMuxCtx->nPrograms) {
+                return LINK_ARG_ERROR;
+        }
         pthread_mutex_lock(&_pMuxCtx->tsMutex_);
-        if (_pMuxCtx->nPcrFlag == 0) {
-                _pMuxCtx->nPcrFlag = 1;
-                LinkInitVideoPESWithPcr(&_pMuxCtx->pes, _pMuxCtx->arg.nVideoFormat, _pData, _nDataLen, _nPts);
+        if (_pMuxCtx->pFmp4) {
+                nRet = LinkFmp4MuxerVideo(_pMuxCtx->pFmp4, _pData, _nDataLen, _nPts, _nIsKeyFrame);
+        } else if (_pMuxCtx->pFrames) {
+                nRet = interleave(_pMuxCtx, _nProgram * 2 + INTERLEAVE_VIDEO, NULL, 0, _pData, _nDataLen, _nPts, _nIsKeyFrame);
         } else {
-                LinkInitVideoPES(&_pMuxCtx->pes, _pMuxCtx->arg.nVideoFormat, _pData, _nDataLen, _nPts);
+                nRet = muxVideo(_pMuxCtx, _nProgram, _pData, _nDataLen, _nPts, _nIsKeyFrame);
         }
-        
-        int nRet = makeTsPacket(_pMuxCtx, LINK_VIDEO_PID);
         pthread_mutex_unlock(&_pMuxCtx->tsMutex_);
         if (nRet < 0)
                 return nRet;
         return 0;
 }
 
-int LinkMuxerFlush(LinkTsMuxerContext* pMuxerCtx)
+int LinkMuxerProgramAudio(LinkTsMuxerContext* _pMuxCtx, int _nProgram, uint8_t *_pData, int _nDataLen, int64_t _nPts)
 {
+        return LinkMuxerProgramAudioWithHeader(_pMuxCtx, _nProgram, NULL, 0, _pData, _nDataLen, _nPts);
+}
+
+int LinkMuxerAudio(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        return LinkMuxerProgramAudio(_pMuxCtx, 0, _pData, _nDataLen, _nPts);
+}
+
+int LinkMuxerVideo(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts, int _nIsKeyFrame)
+{
+        return LinkMuxerProgramVideo(_pMuxCtx, 0, _pData, _nDataLen, _nPts, _nIsKeyFrame);
+}
+
+//id3v2.4的tag，里面一个PRIV帧。大小都是syncsafe整数(每字节7位)
+static void writeSyncsafe(uint8_t *_pBuf, int _nValue)
+{
+        _pBuf[0] = (_nValue >> 21) & 0x7f;
+        _pBuf[1] = (_nValue >> 14) & 0x7f;
+        _pBuf[2] = (_nValue >> 7) & 0x7f;
+        _pBuf[3] = _nValue & 0x7f;
+}
+
+static int writeId3PrivHeader(uint8_t *_pBuf, int _nDataLen)
+{
+        int nFrameLen = sizeof(ID3_PRIV_OWNER) + _nDataLen;
+        memcpy(_pBuf, "ID3", 3);
+        _pBuf[3] = 0x04; //version 2.4.0
+        _pBuf[4] = 0x00;
+        _pBuf[5] = 0x00; //flags
+        writeSyncsafe(_pBuf + 6, 10 + nFrameLen);
+        memcpy(_pBuf + 10, "PRIV", 4);
+        writeSyncsafe(_pBuf + 14, nFrameLen);
+        _pBuf[18] = 0x00; //flags
+        _pBuf[19] = 0x00;
+        memcpy(_pBuf + 20, ID3_PRIV_OWNER, sizeof(ID3_PRIV_OWNER));
+        return ID3_PRIV_HEADER_LEN;
+}
+
+int LinkMuxerProgramMetadata(LinkTsMuxerContext* _pMuxCtx, int _nProgram, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        if (_nProgram < 0 || _nProgram >= _pMuxCtx->nPrograms || _pMuxCtx->programs[_nProgram].pids.nMetadataStreamType == 0
+            || _nDataLen <= 0 || _nDataLen + (int)ID3_PRIV_HEADER_LEN > METADATA_MAX) {
+                return LINK_ARG_ERROR;
+        }
+        uint8_t header[ID3_PRIV_HEADER_LEN];
+        int nHeaderLen = 0;
+        if (_nDataLen < 3 || memcmp(_pData, "ID3", 3) != 0) {
+                nHeaderLen = writeId3PrivHeader(header, _nDataLen);
+        }
+        int nRet = 0;
+        pthread_mutex_lock(&_pMuxCtx->tsMutex_);
+        if (_pMuxCtx->pFrames) {
+                nRet = interleave(_pMuxCtx, INTERLEAVE_METADATA_BASE + _nProgram, nHeaderLen ? header : NULL, nHeaderLen,
+                                  _pData, _nDataLen, _nPts, 0);
+        } else {
+                nRet = muxMetadata(_pMuxCtx, _nProgram, nHeaderLen ? header : NULL, nHeaderLen, _pData, _nDataLen, _nPts);
+        }
+        pthread_mutex_unlock(&_pMuxCtx->tsMutex_);
+        if (nRet < 0)
+                return nRet;
         return 0;
 }
 
+int LinkMuxerMetadata(LinkTsMuxerContext* _pMuxCtx, uint8_t *_pData, int _nDataLen, int64_t _nPts)
+{
+        return LinkMuxerProgramMetadata(_pMuxCtx, 0, _pData, _nDataLen, _nPts);
+}
+
+int LinkMuxerFlush(LinkTsMuxerContext* pMuxerCtx)
+{
+        pthread_mutex_lock(&pMuxerCtx->tsMutex_);
+        int nRet = 0;
+        int i;
+        if (pMuxerCtx->pFmp4) {
+                nRet = LinkFmp4MuxerFlush(pMuxerCtx->pFmp4);
+        } else {
+                for (i = 0; i < pMuxerCtx->nPrograms && nRet == 0; i++) {
+                        nRet = flushAudio(pMuxerCtx, i);
+                }
+                if (nRet == 0) {
+                        nRet = drainInterleave(pMuxerCtx, 1);
+                }
+        }
+        pthread_mutex_unlock(&pMuxerCtx->tsMutex_);
+        return nRet;
+}
+
+int LinkMuxerPendingBytes(LinkTsMuxerContext* pMuxerCtx)
+{
+        int nBytes = 0;
+        int i;
+        pthread_mutex_lock(&pMuxerCtx->tsMutex_);
+        if (pMuxerCtx->pFmp4) {
+                nBytes = LinkFmp4MuxerPendingBytes(pMuxerCtx->pFmp4);
+        } else {
+                nBytes = pMuxerCtx->nHeapTsBytes;
+                for (i = 0; i < pMuxerCtx->nPrograms; i++) {
+                        if (pMuxerCtx->programs[i].nAudioBufLen > 0) {
+                                nBytes += estimateTsSize(pMuxerCtx->programs[i].nAudioBufLen);
+                        }
+                }
+        }
+        pthread_mutex_unlock(&pMuxerCtx->tsMutex_);
+        return nBytes;
+}
+
 void LinkDestroyTsMuxerContext(LinkTsMuxerContext *pTsMuxerCtx)
 {
-        if (pTsMuxerCtx)
-                free(pTsMuxerCtx);
+        if (pTsMuxerCtx) {
+                pthread_mutex_destroy(&pTsMuxerCtx->tsMutex_);
+                destroyTsMuxerContext(pTsMuxerCtx);
+        }
 }
@@ -6,19 +6,47 @@
 typedef struct _LinkTsMuxerContext LinkTsMuxerContext;
 
 
+//fmp4的init segment(ftyp+moov)
+typedef int (*LinkInitSegmentCallback)(void *pOpaque, const uint8_t *pData, int nDataLen);
+
 typedef struct {
         LinkAudioFormat nAudioFormat;
         int nAudioSampleRate;
         int nAudioChannels;
         LinkVideoFormat nVideoFormat;
         LinkTsPacketCallback output;
+        LinkTsPacketReserve reserve; //可以为NULL
+        LinkTsPacketCommit commit;
+        LinkTsPacketVecCallback outputVec; //可以为NULL。不为NULL时reserve不到内存的ts包用这个输出，不用先拷贝到临时buffer
+        int nTableInterval; //毫秒。pat/pmt除了分片开头，间隔这么久以后在关键帧前面再写一次。0表示每个关键帧，小于0表示只在开头写
+        int nAudioAggregateDuration; //毫秒。大于0时这么长时间的音频帧合成一个pes，分片结束前要调用LinkMuxerFlush
+        int nInterleaveWindow; //毫秒。大于0时音视频帧先按时间戳排序，最多等这么久再输出，分片结束前要调用LinkMuxerFlush
+        int nProgramCount; //大于1时输出多节目ts(mpts)，pPrograms[i]是第i个节目的音视频格式，上面的音视频格式不用。只支持ts
+        const LinkMediaArg *pPrograms; //只在创建时读取
+        int nWithMetadata; //不为0时每个节目多一路id3 timed metadata流(LinkMuxerMetadata)，只支持ts
+        int nPmtVersion; //pmt的version_number(0-31)，媒体格式中途改变以后加1，播放器据此重新解析pmt
+        LinkContainerFormat nContainer; //LINK_CONTAINER_FMP4时output/outputVec输出的是moof+mdat，不用reserve/commit和上面两个ts的参数
+        LinkInitSegmentCallback initOutput; //fmp4用，第一个带参数集的关键帧时调用一次，可以为NULL
+        int nFragmentDuration; //毫秒。fmp4的一个moof最多包含多长时间的帧，关键帧总是开始新的moof。0表示每帧一个moof
         void *pOpaque;
 }LinkTsMuxerArg;
 
 int LinkNewTsMuxerContext(LinkTsMuxerArg *pArg, LinkTsMuxerContext **pTsMuxerContext);
 int LinkMuxerAudio(LinkTsMuxerContext* pMuxerCtx, uint8_t *pData, int nDataLen, int64_t nPts);
-int LinkMuxerVideo(LinkTsMuxerContext* pMuxerCtx, uint8_t *pData, int nDataLen,  int64_t nPts);
+int LinkMuxerVideo(LinkTsMuxerContext* pMuxerCtx, uint8_t *pData, int nDataLen,  int64_t nPts, int nIsKeyFrame);
+//多节目ts的第nProgram个节目，从0开始。LinkMuxerAudio/LinkMuxerVideo是第0个节目
+int LinkMuxerProgramAudio(LinkTsMuxerContext* pMuxerCtx, int nProgram, uint8_t *pData, int nDataLen, int64_t nPts);
+int LinkMuxerProgramVideo(LinkTsMuxerContext* pMuxerCtx, int nProgram, uint8_t *pData, int nDataLen, int64_t nPts, int nIsKeyFrame);
+//裸aac帧加上调用者准备好的adts头(pHeader)，两段直接打包不用先拼到一起。fmp4不用头
+int LinkMuxerProgramAudioWithHeader(LinkTsMuxerContext* pMuxerCtx, int nProgram, const uint8_t *pHeader, int nHeaderLen,
+                                    uint8_t *pData, int nDataLen, int64_t nPts);
+//事件之类的数据，打成id3 tag(pData本身是id3 tag时原样)放到metadata流，nPts和音视频同一个时钟。
+//稀疏流，交织时不等它
+int LinkMuxerMetadata(LinkTsMuxerContext* pMuxerCtx, uint8_t *pData, int nDataLen, int64_t nPts);
+int LinkMuxerProgramMetadata(LinkTsMuxerContext* pMuxerCtx, int nProgram, uint8_t *pData, int nDataLen, int64_t nPts);
 int LinkMuxerFlush(LinkTsMuxerContext* pMuxerCtx);
+//合成音频、交织排序(fmp4是攒着的moof)还没有输出的数据，之后会一起写出去。按输出以后的大小估算
+int LinkMuxerPendingBytes(LinkTsMuxerContext* pMuxerCtx);
 void LinkDestroyTsMuxerContext(LinkTsMuxerContext *pTsMuxerCtx);
 
 #endif
@@ -2,6 +2,7 @@
 #include "base.h"
 #include <unistd.h>
 #include "adts.h"
+#include "nalu.h"
 #ifdef __APPLE__
 #include <sys/types.h>
 #include <sys/sysctl.h>
@@ -18,12 +19,18 @@
 
 #define FF_OUT_LEN 4096
 #define QUEUE_INIT_LEN 150
+#define TS_TABLE_INTERVAL 0 //每个关键帧前面都重复pat/pmt
+#define TS_AUDIO_AGGREGATE_DURATION 200 //毫秒
+#define FMP4_FRAGMENT_DURATION 500 //毫秒
 
 #define LINK_STREAM_TYPE_AUDIO 1
 #define LINK_STREAM_TYPE_VIDEO 2
 
+typedef struct _FFTsMuxUploader FFTsMuxUploader;
+
 typedef struct _FFTsMuxContext{
         LinkAsyncInterface asyncWait;
+        FFTsMuxUploader *pOwner; //上传线程会回调它，销毁时放掉引用
         LinkTsUploader *pTsUploader_;
 #ifdef USE_OWN_TSMUX
         LinkTsMuxerContext *pFmtCtx_;
@@ -32,10 +39,28 @@ typedef struct _FFTsMuxContext{
 #endif
         int nOutVideoindex_;
         int nOutAudioindex_;
+        int nGeneration; //创建时的配置版本，和FFTsMuxUploader的不一样说明格式或者token变了
+}FFTsMuxContext;
+
+//每路音视频自己的状态。多节目ts每个节目一个，单节目只有一个
+typedef struct _ProgramState {
+        LinkMediaArg avArg;
+        unsigned char adtsHeader[7]; //裸aac帧用的adts头，创建时生成，每帧只改长度
+        int nIsAdtsHeaderValid;
+        unsigned char *pAACBuf; //ffmpeg要adts头和数据连在一起
+        int nAACBufLen;
+        unsigned char *pVideoBuf; //关键帧前面插入参数集用
+        int nVideoBufLen;
+        LinkParamSetCache paramSets;
+        int nIsStarted; //收到过关键帧
+        LinkMediaArg pendingArg; //LinkReconfigureMedia设置的新格式，下一个分片开始时生效
+        int nIsReconfigPending;
+        
+        //下面的每个分片重新开始
         int64_t nPrevAudioTimestamp;
         int64_t nPrevVideoTimestamp;
-        LinkTsMuxUploader * pTsMuxUploader;
-}FFTsMuxContext;
+        int nIsParamSetWrited; //分片第一个关键帧要带上参数集，这样每个分片都能单独解码
+}ProgramState;
 
 typedef struct _Token {
         int nQuit;
@@ -46,27 +71,48 @@ typedef struct _Token {
         pthread_mutex_t tokenMutex_;
 }Token;
 
-typedef struct _FFTsMuxUploader{
+//放到资源管理线程里执行的任务
+typedef struct _UploaderJob {
+        LinkAsyncInterface asyncJob;
+        FFTsMuxUploader *pFFTsMuxUploader;
+}UploaderJob;
+
+struct _FFTsMuxUploader{
         LinkTsMuxUploader tsMuxUploader_;
         pthread_mutex_t muxUploaderMutex_;
-        unsigned char *pAACBuf;
-        int nAACBufLen;
+        int nProgramCount;
+        ProgramState *pPrograms; //第0个节目的关键帧决定分片
         FFTsMuxContext *pTsMuxCtx;
+        //后台提前建好的下一个分片的上下文(队列，muxer，上传线程都已经准备好)，切分片时直接换上
+        FFTsMuxContext *pStandbyCtx;
+        int nConfigGeneration; //改格式，token，buffer大小时加1，之前建好的备用上下文就不能用了
+        int nIsStandbyQueued;
+        int nQuit;
+        int nRef; //自己一个，每个还没销毁的分片上下文一个，都放掉了才释放
+
+        UploaderJob prepareJob;
+        UploaderJob destroyJob;
         
         int64_t nLastVideoTimestamp;
         int64_t nFirstTimestamp; //initial to -1
         int nKeyFrameCount;
         int nFrameCount;
-        LinkMediaArg avArg;
         LinkUploadState ffMuxSatte;
         
         int nUploadBufferSize;
         int nNewSegmentInterval;
+        int nWithMetadata;
+        int nInterleaveWindow; //创建以后不变
+        int nReconfigPending; //有节目要改格式，第0个节目的下一个关键帧切分片
+        int nPmtVersion;
         
         char deviceId_[65];
         Token token_;
         LinkUploadArg uploadArg;
-}FFTsMuxUploader;
+        
+        int64_t nInitSegmentId; //fmp4的init已经(或者正在)上传到了哪个segment
+        uint32_t nInitCrc;
+};
 
 static int aAacfreqs[13] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050 ,16000 ,12000, 11025, 8000, 7350};
 
@@ -104,17 +150,59 @@ static int getAacFreqIndex(int _nFreq)
         }
 }
 
-static void pushRecycle(FFTsMuxUploader *_pFFTsMuxUploader)
+static int waitToCompleUploadAndDestroyTsMuxContext(void *_pOpaque);
+
+//不等上传。上传结束后才交给资源管理线程销毁，管理线程不会卡在网络上，调用者也可以持有muxUploaderMutex_
+static void recycleTsMuxContext(FFTsMuxContext *_pTsMuxCtx)
 {
-        if (_pFFTsMuxUploader) {
-                
-                if (_pFFTsMuxUploader->pTsMuxCtx) {
+        LinkLogError("push to mgr:%p", _pTsMuxCtx);
+        _pTsMuxCtx->pTsUploader_->RecycleWhenDone(_pTsMuxCtx->pTsUploader_, &_pTsMuxCtx->asyncWait);
+        return;
+}
+
+static void holdTsMuxUploader(FFTsMuxUploader *_pFFTsMuxUploader, FFTsMuxContext *_pTsMuxCtx)
+{
+        _pTsMuxCtx->pOwner = _pFFTsMuxUploader;
+        __sync_fetch_and_add(&_pFFTsMuxUploader->nRef, 1);
+}
+
+static void releaseTsMuxUploader(FFTsMuxUploader *_pFFTsMuxUploader);
+
+//在muxUploaderMutex_里调用。备用上下文在资源管理线程里建，不占推流线程的时间
+static void requestStandby(FFTsMuxUploader *_pFFTsMuxUploader)
+{
+        if (_pFFTsMuxUploader->nQuit || _pFFTsMuxUploader->nIsStandbyQueued || _pFFTsMuxUploader->pStandbyCtx) {
+                return;
+        }
+        _pFFTsMuxUploader->nIsStandbyQueued = 1;
+        if (LinkPushFunction(&_pFFTsMuxUploader->prepareJob) < 0) {
+                _pFFTsMuxUploader->nIsStandbyQueued = 0;
+        }
+        return;
+}
+
+//把当前分片写完，从uploader上摘下来。调用者再交给recycleTsMuxContext
+static FFTsMuxContext * detachTsMuxContext(FFTsMuxUploader *_pFFTsMuxUploader)
+{
+        FFTsMuxContext *pTsMuxCtx = _pFFTsMuxUploader->pTsMuxCtx;
+        if (pTsMuxCtx) {
+                _pFFTsMuxUploader->pTsMuxCtx = NULL;
 #ifndef USE_OWN_TSMUX
-                        av_write_trailer(_pFFTsMuxUploader->pTsMuxCtx->pFmtCtx_);
+                av_write_trailer(pTsMuxCtx->pFmtCtx_);
+#else
+                LinkMuxerFlush(pTsMuxCtx->pFmtCtx_);
 #endif
-                        LinkLogError("push to mgr:%p", _pFFTsMuxUploader->pTsMuxCtx);
-                        LinkPushFunction(_pFFTsMuxUploader->pTsMuxCtx);
-                        _pFFTsMuxUploader->pTsMuxCtx = NULL;
+                pTsMuxCtx->pTsUploader_->EndSegment(pTsMuxCtx->pTsUploader_);
+        }
+        return pTsMuxCtx;
+}
+
+static void pushRecycle(FFTsMuxUploader *_pFFTsMuxUploader)
+{
+        if (_pFFTsMuxUploader) {
+                FFTsMuxContext *pTsMuxCtx = detachTsMuxContext(_pFFTsMuxUploader);
+                if (pTsMuxCtx) {
+                        recycleTsMuxContext(pTsMuxCtx);
                 }
         }
         return;
@@ -141,17 +229,123 @@ static int writeTsPacketToMem(void *opaque, uint8_t *buf, int buf_size)
         return ret;
 }
 
-static int push(FFTsMuxUploader *pFFTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp, int _nFlag){
+#ifdef USE_OWN_TSMUX
+static uint8_t * reserveTsPacketInMem(void *opaque, int buf_size)
+{
+        FFTsMuxContext *pTsMuxCtx = (FFTsMuxContext *)opaque;
+        
+        return (uint8_t *)pTsMuxCtx->pTsUploader_->Reserve(pTsMuxCtx->pTsUploader_, buf_size);
+}
+
+static int writeTsPacketVecToMem(void *opaque, const struct iovec *pVec, int nVecCount)
+{
+        FFTsMuxContext *pTsMuxCtx = (FFTsMuxContext *)opaque;
+        
+        int ret = pTsMuxCtx->pTsUploader_->PushVec(pTsMuxCtx->pTsUploader_, pVec, nVecCount);
+        if (ret <= 0) {
+                LinkLogDebug("write ts vec to queue fail:%d", ret);
+                return ret < 0 ? ret : LINK_Q_WRONGSTATE;
+        }
+        return ret;
+}
+
+static int writeInitSegmentToUploader(void *opaque, const uint8_t *pData, int nDataLen)
+{
+        FFTsMuxContext *pTsMuxCtx = (FFTsMuxContext *)opaque;
+        
+        return pTsMuxCtx->pTsUploader_->SetInitSegment(pTsMuxCtx->pTsUploader_, (const char *)pData, nDataLen);
+}
+
+static int commitTsPacketToMem(void *opaque, int buf_size)
+{
+        FFTsMuxContext *pTsMuxCtx = (FFTsMuxContext *)opaque;
+        
+        int ret = pTsMuxCtx->pTsUploader_->Commit(pTsMuxCtx->pTsUploader_, buf_size);
+        if (ret <= 0) {
+                LinkLogDebug("commit ts to queue fail:%d", ret);
+                return ret < 0 ? ret : LINK_Q_WRONGSTATE;
+        }
+        return ret;
+}
+#endif
+
+static int isAudioArgChanged(const LinkMediaArg *_pOld, const LinkMediaArg *_pNew)
+{
+        return _pOld->nAudioFormat != _pNew->nAudioFormat || _pOld->nChannels != _pNew->nChannels
+                || _pOld->nSamplerate != _pNew->nSamplerate;
+}
+
+//除了长度，adts头的字段对一路流都是固定的
+static void initAdtsHeader(ProgramState *_pProgram)
+{
+        int nFreqIdx = getAacFreqIndex(_pProgram->avArg.nSamplerate);
+        if (_pProgram->avArg.nAudioFormat != LINK_AUDIO_AAC || _pProgram->avArg.nChannels < 1 || _pProgram->avArg.nChannels > 2
+            || nFreqIdx < 0) {
+                return;
+        }
+        LinkADTSFixheader fixHeader;
+        LinkADTSVariableHeader varHeader;
+        LinkInitAdtsFixedHeader(&fixHeader);
+        LinkInitAdtsVariableHeader(&varHeader, 0);
+        fixHeader.channel_configuration = _pProgram->avArg.nChannels;
+        fixHeader.sampling_frequency_index = nFreqIdx;
+        LinkConvertAdtsHeader2Char(&fixHeader, &varHeader, _pProgram->adtsHeader);
+        _pProgram->nIsAdtsHeaderValid = 1;
+}
+
+//分片开始的关键帧没有带参数集的时候，把缓存的参数集插到aud(如果有)后面
+static int prependParamSets(ProgramState *_pProgram, const LinkVideoFrameInfo *_pFrameInfo, char **_pData, int *_pDataLen)
+{
+        LinkParamSetCache *pCache = &_pProgram->paramSets;
+        int nLen = *_pDataLen + pCache->nLen;
+        if (_pProgram->pVideoBuf == NULL || _pProgram->nVideoBufLen < nLen) {
+                if (_pProgram->pVideoBuf) {
+                        free(_pProgram->pVideoBuf);
+                }
+                _pProgram->pVideoBuf = (unsigned char *)malloc(nLen);
+                if (_pProgram->pVideoBuf == NULL) {
+                        _pProgram->nVideoBufLen = 0;
+                        LinkLogWarn("malloc %d size memory fail", nLen);
+                        return LINK_NO_MEMORY;
+                }
+                _pProgram->nVideoBufLen = nLen;
+        }
+        unsigned char *pBuf = _pProgram->pVideoBuf;
+        memcpy(pBuf, *_pData, _pFrameInfo->nAudLen);
+        memcpy(pBuf + _pFrameInfo->nAudLen, pCache->data, pCache->nLen);
+        memcpy(pBuf + _pFrameInfo->nAudLen + pCache->nLen, *_pData + _pFrameInfo->nAudLen, *_pDataLen - _pFrameInfo->nAudLen);
+        *_pData = (char *)pBuf;
+        *_pDataLen = nLen;
+        return 0;
+}
+
+//包括pes头，pcr，aud，adts头，多算两个包给pat和pmt
+static int getEstimatedTsSize(int _nDataLen)
+{
+        return ((_nDataLen + 40 + 183) / 184 + 2) * 188;
+}
+
+//这一帧加上muxer里还没写出去的(合成的音频、交织排序的帧)。那些帧之后会和这一帧一起写进队列，
+//只看这一帧的话可能放到一半队列就满了
+static int getAdmitSize(FFTsMuxContext *_pTsMuxCtx, int _nDataLen)
+{
+        int nSize = getEstimatedTsSize(_nDataLen);
+#ifdef USE_OWN_TSMUX
+        nSize += LinkMuxerPendingBytes(_pTsMuxCtx->pFmtCtx_);
+#endif
+        return nSize;
+}
+
+static int push(FFTsMuxUploader *pFFTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp, int _nFlag, const LinkVideoFrameInfo *_pFrameInfo){
 #ifndef USE_OWN_TSMUX
         AVPacket pkt;
         av_init_packet(&pkt);
-        pkt.data = (uint8_t *)_pData;
-        pkt.size = _nDataLen;
 #endif
         
         //LinkLogTrace("push thread id:%d\n", (int)pthread_self());
         
         FFTsMuxContext *pTsMuxCtx = NULL;
+        ProgramState *pProgram = &pFFTsMuxUploader->pPrograms[_nProgram];
         int count = 0;
         
         count = 2;
@@ -168,78 +362,95 @@ static int push(FFTsMuxUploader *pFFTsMuxUploader, char * _pData, int _nDataLen,
         }
         
         int ret = 0;
-        int isAdtsAdded = 0;
+        int isParamSetAdded = 0;
+        if (_nFlag == LINK_STREAM_TYPE_VIDEO && _pFrameInfo->nIsKeyFrame && !pProgram->nIsParamSetWrited
+            && !_pFrameInfo->nHasParamSet && pProgram->paramSets.nLen > 0) {
+                ret = prependParamSets(pProgram, _pFrameInfo, &_pData, &_nDataLen);
+                if (ret != 0) {
+                        return ret;
+                }
+                isParamSetAdded = 1;
+        }
+#ifndef USE_OWN_TSMUX
+        pkt.data = (uint8_t *)_pData;
+        pkt.size = _nDataLen;
+#endif
+        
+        //队列放不下的时候整帧丢，不能让半个帧进队列
+        LinkFrameType frameType = LINK_FRAME_AUDIO;
+        if (_nFlag == LINK_STREAM_TYPE_VIDEO) {
+                if (_pFrameInfo->nIsKeyFrame) {
+                        frameType = LINK_FRAME_VIDEO_IDR;
+                } else {
+                        frameType = _pFrameInfo->nIsReference ? LINK_FRAME_VIDEO_REF : LINK_FRAME_VIDEO_NONREF;
+                }
+        }
+        if (!pTsMuxCtx->pTsUploader_->AdmitFrame(pTsMuxCtx->pTsUploader_, frameType, getAdmitSize(pTsMuxCtx, _nDataLen))) {
+                return 0;
+        }
         
         if (_nFlag == LINK_STREAM_TYPE_AUDIO){
                 //fprintf(stderr, "audio frame: len:%d pts:%lld\n", _nDataLen, _nTimestamp);
-                if (pTsMuxCtx->nPrevAudioTimestamp != 0 && _nTimestamp - pTsMuxCtx->nPrevAudioTimestamp <= 0) {
-                        LinkLogWarn("audio pts not monotonically: prev:%lld now:%lld", pTsMuxCtx->nPrevAudioTimestamp, _nTimestamp);
+                if (pProgram->nPrevAudioTimestamp != 0 && _nTimestamp - pProgram->nPrevAudioTimestamp <= 0) {
+                        LinkLogWarn("audio pts not monotonically: prev:%lld now:%lld", pProgram->nPrevAudioTimestamp, _nTimestamp);
                         return 0;
                 }
 #ifndef USE_OWN_TSMUX
                 pkt.pts = _nTimestamp * 90;
                 pkt.stream_index = pTsMuxCtx->nOutAudioindex_;
                 pkt.dts = pkt.pts;
-                pTsMuxCtx->nPrevAudioTimestamp = _nTimestamp;
+                pProgram->nPrevAudioTimestamp = _nTimestamp;
 #endif
                 
                 unsigned char * pAData = (unsigned char * )_pData;
-                if (pFFTsMuxUploader->avArg.nAudioFormat ==  LINK_AUDIO_AAC && (pAData[0] != 0xff || (pAData[1] & 0xf0) != 0xf0)) {
-                        LinkADTSFixheader fixHeader;
-                        LinkADTSVariableHeader varHeader;
-                        LinkInitAdtsFixedHeader(&fixHeader);
-                        LinkInitAdtsVariableHeader(&varHeader, _nDataLen);
-                        fixHeader.channel_configuration = pFFTsMuxUploader->avArg.nChannels;
-                        int nFreqIdx = getAacFreqIndex(pFFTsMuxUploader->avArg.nSamplerate);
-                        fixHeader.sampling_frequency_index = nFreqIdx;
-                        if (pFFTsMuxUploader->pAACBuf == NULL || pFFTsMuxUploader->nAACBufLen < varHeader.aac_frame_length) {
-                                if (pFFTsMuxUploader->pAACBuf) {
-                                        free(pFFTsMuxUploader->pAACBuf);
-                                        pFFTsMuxUploader->pAACBuf = NULL;
-                                }
-                                pFFTsMuxUploader->pAACBuf = (unsigned char *)malloc(varHeader.aac_frame_length);
-                                pFFTsMuxUploader->nAACBufLen = (int)varHeader.aac_frame_length;
+                if (pProgram->avArg.nAudioFormat ==  LINK_AUDIO_AAC && (pAData[0] != 0xff || (pAData[1] & 0xf0) != 0xf0)) {
+                        int nFrameLen = _nDataLen + sizeof(pProgram->adtsHeader);
+                        if (!pProgram->nIsAdtsHeaderValid || nFrameLen > 0x1fff) {
+                                LinkLogWarn("wrong audio arg:channel:%d sameplerate%d len:%d", pProgram->avArg.nChannels,
+                                        pProgram->avArg.nSamplerate, _nDataLen);
+                                return LINK_ARG_ERROR;
                         }
-                        if(pFFTsMuxUploader->pAACBuf == NULL || pFFTsMuxUploader->avArg.nChannels < 1 || pFFTsMuxUploader->avArg.nChannels > 2
-                           || nFreqIdx < 0) {
-                                if (pFFTsMuxUploader->pAACBuf == NULL) {
-                                        LinkLogWarn("malloc %d size memory fail", varHeader.aac_frame_length);
+                        LinkSetAdtsFrameLength(pProgram->adtsHeader, nFrameLen);
+#ifdef USE_OWN_TSMUX
+                        ret = LinkMuxerProgramAudioWithHeader(pTsMuxCtx->pFmtCtx_, _nProgram, pProgram->adtsHeader, sizeof(pProgram->adtsHeader),
+                                                              (uint8_t *)_pData, _nDataLen, _nTimestamp);
+#else
+                        if (pProgram->pAACBuf == NULL || pProgram->nAACBufLen < nFrameLen) {
+                                if (pProgram->pAACBuf) {
+                                        free(pProgram->pAACBuf);
+                                }
+                                pProgram->pAACBuf = (unsigned char *)malloc(nFrameLen);
+                                if (pProgram->pAACBuf == NULL) {
+                                        pProgram->nAACBufLen = 0;
+                                        LinkLogWarn("malloc %d size memory fail", nFrameLen);
                                         return LINK_NO_MEMORY;
-                                } else {
-                                        LinkLogWarn("wrong audio arg:channel:%d sameplerate%d", pFFTsMuxUploader->avArg.nChannels,
-                                                pFFTsMuxUploader->avArg.nSamplerate);
-                                        return LINK_ARG_ERROR;
                                 }
+                                pProgram->nAACBufLen = nFrameLen;
                         }
-                        LinkConvertAdtsHeader2Char(&fixHeader, &varHeader, pFFTsMuxUploader->pAACBuf);
-                        int nHeaderLen = varHeader.aac_frame_length - _nDataLen;
-                        memcpy(pFFTsMuxUploader->pAACBuf + nHeaderLen, _pData, _nDataLen);
-                        isAdtsAdded = 1;
-#ifdef USE_OWN_TSMUX
-                        LinkMuxerAudio(pTsMuxCtx->pFmtCtx_, (uint8_t *)pFFTsMuxUploader->pAACBuf, varHeader.aac_frame_length, _nTimestamp);
-#else
-                        pkt.data = (uint8_t *)pFFTsMuxUploader->pAACBuf;
-                        pkt.size = varHeader.aac_frame_length;
+                        memcpy(pProgram->pAACBuf, pProgram->adtsHeader, sizeof(pProgram->adtsHeader));
+                        memcpy(pProgram->pAACBuf + sizeof(pProgram->adtsHeader), _pData, _nDataLen);
+                        pkt.data = (uint8_t *)pProgram->pAACBuf;
+                        pkt.size = nFrameLen;
 #endif
                 } 
 #ifdef USE_OWN_TSMUX
                 else {
-                        ret = LinkMuxerAudio(pTsMuxCtx->pFmtCtx_, (uint8_t*)_pData, _nDataLen, _nTimestamp);
+                        ret = LinkMuxerProgramAudio(pTsMuxCtx->pFmtCtx_, _nProgram, (uint8_t*)_pData, _nDataLen, _nTimestamp);
                 }
 #endif
         }else{
                 //fprintf(stderr, "video frame: len:%d pts:%lld\n", _nDataLen, _nTimestamp);
-                if (pTsMuxCtx->nPrevVideoTimestamp != 0 && _nTimestamp - pTsMuxCtx->nPrevVideoTimestamp <= 0) {
-                        LinkLogWarn("video pts not monotonically: prev:%lld now:%lld", pTsMuxCtx->nPrevVideoTimestamp, _nTimestamp);
+                if (pProgram->nPrevVideoTimestamp != 0 && _nTimestamp - pProgram->nPrevVideoTimestamp <= 0) {
+                        LinkLogWarn("video pts not monotonically: prev:%lld now:%lld", pProgram->nPrevVideoTimestamp, _nTimestamp);
                         return 0;
                 }
 #ifdef USE_OWN_TSMUX
-                ret = LinkMuxerVideo(pTsMuxCtx->pFmtCtx_, (uint8_t*)_pData, _nDataLen, _nTimestamp);
+                ret = LinkMuxerProgramVideo(pTsMuxCtx->pFmtCtx_, _nProgram, (uint8_t*)_pData, _nDataLen, _nTimestamp, _pFrameInfo->nIsKeyFrame);
 #else
                 pkt.pts = _nTimestamp * 90;
                 pkt.stream_index = pTsMuxCtx->nOutVideoindex_;
                 pkt.dts = pkt.pts;
-                pTsMuxCtx->nPrevVideoTimestamp = _nTimestamp;
+                pProgram->nPrevVideoTimestamp = _nTimestamp;
 #endif
         }
         
@@ -248,18 +459,18 @@ static int push(FFTsMuxUploader *pFFTsMuxUploader, char * _pData, int _nDataLen,
         ret = av_interleaved_write_frame(pTsMuxCtx->pFmtCtx_, &pkt);
 #endif
         if (ret == 0) {
-                pTsMuxCtx->pTsUploader_->RecordTimestamp(pTsMuxCtx->pTsUploader_, _nTimestamp);
+                if (_nFlag == LINK_STREAM_TYPE_VIDEO && (isParamSetAdded || _pFrameInfo->nHasParamSet)) {
+                        pProgram->nIsParamSetWrited = 1;
+                }
+                //各路的时间戳不一定是同一个时钟，分片的时间只按第0路算
+                if (_nProgram == 0) {
+                        pTsMuxCtx->pTsUploader_->RecordTimestamp(pTsMuxCtx->pTsUploader_, _nTimestamp);
+                }
         } else {
                 if (pFFTsMuxUploader->ffMuxSatte != LINK_UPLOAD_FAIL)
                         LinkLogError("Error muxing packet:%d", ret);
                 pFFTsMuxUploader->ffMuxSatte = LINK_UPLOAD_FAIL;
         }
-        
-#ifndef USE_OWN_TSMUX
-        if (isAdtsAdded) {
-                free(pkt.data);
-        }
-#endif
         return ret;
 }
 
@@ -271,6 +482,21 @@ static int checkSwitch(LinkTsMuxUploader *_pTsMuxUploader, int64_t _nTimestamp,
         if (pFFTsMuxUploader->nFirstTimestamp == -1) {
                 pFFTsMuxUploader->nFirstTimestamp = _nTimestamp;
         }
+        if (pFFTsMuxUploader->pTsMuxCtx == NULL) {
+                //上次没有创建成功(比如上传buffer池达到上限)，等到关键帧再重新创建
+                if (!(_isVideo && nIsKeyFrame)) {
+                        return LINK_NO_MEMORY;
+                }
+                ret = LinkTsMuxUploaderStart(_pTsMuxUploader);
+                if (ret != 0) {
+                        return ret;
+                }
+                pFFTsMuxUploader->nKeyFrameCount = 1;
+                pFFTsMuxUploader->nFrameCount = 0;
+                pFFTsMuxUploader->nFirstTimestamp = _nTimestamp;
+                pFFTsMuxUploader->ffMuxSatte = LINK_UPLOAD_INIT;
+                return 0;
+        }
         LinkUploadState ustate = pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->GetUploaderState(pFFTsMuxUploader->pTsMuxCtx->pTsUploader_);
         //if (pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->GetUploaderState(pTsMuxCtx->pTsUploader_) == LINK_UPLOAD_FAIL) {
         if ( ustate != LINK_UPLOAD_INIT) {
@@ -285,17 +511,20 @@ static int checkSwitch(LinkTsMuxUploader *_pTsMuxUploader, int64_t _nTimestamp,
                 if( ((_nTimestamp - pFFTsMuxUploader->nFirstTimestamp) > 4980 && pFFTsMuxUploader->nKeyFrameCount > 0)
                    //at least 1 keyframe and aoubt last 5 second
                    || (_nIsSegStart && pFFTsMuxUploader->nFrameCount != 0)// new segment is specified
+                   || (_isVideo && nIsKeyFrame && pFFTsMuxUploader->nReconfigPending) // media changed
                    ||  pFFTsMuxUploader->ffMuxSatte != LINK_UPLOAD_INIT){   // upload finished
                         //printf("next ts:%d %lld\n", pFFTsMuxUploader->nKeyFrameCount, _nTimestamp - pFFTsMuxUploader->nLastUploadVideoTimestamp);
                         pFFTsMuxUploader->nKeyFrameCount = 0;
                         pFFTsMuxUploader->nFrameCount = 0;
                         pFFTsMuxUploader->nFirstTimestamp = _nTimestamp;
                         pFFTsMuxUploader->ffMuxSatte = LINK_UPLOAD_INIT;
-                        pushRecycle(pFFTsMuxUploader);
+                        FFTsMuxContext *pPrevCtx = detachTsMuxContext(pFFTsMuxUploader);
                         if (_nIsSegStart) {
                                 pFFTsMuxUploader->uploadArg.nSegmentId_ = LinkGetCurrentNanosecond();
                         }
+                        //先换上备用的并让管理线程准备下一个，再把旧的交出去，上传完才销毁
                         ret = LinkTsMuxUploaderStart(_pTsMuxUploader);
+                        recycleTsMuxContext(pPrevCtx);
                         if (ret != 0) {
                                 return ret;
                         }
@@ -307,27 +536,54 @@ static int checkSwitch(LinkTsMuxUploader *_pTsMuxUploader, int64_t _nTimestamp,
         return 0;
 }
 
-static int PushVideo(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp, int nIsKeyFrame, int _nIsSegStart)
+//第0个节目决定什么时候切分片，其他节目的帧写进当前分片
+static int pushProgramVideo(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp,
+                            int nIsKeyFrame, int _nIsSegStart)
 {
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)_pTsMuxUploader;
+        if (_nProgram < 0 || _nProgram >= pFFTsMuxUploader->nProgramCount) {
+                LinkLogError("wrong program:%d", _nProgram);
+                return LINK_ARG_ERROR;
+        }
+        ProgramState *pProgram = &pFFTsMuxUploader->pPrograms[_nProgram];
         pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
         int ret = 0;
-        if (pFFTsMuxUploader->nKeyFrameCount == 0 && !nIsKeyFrame) {
-                LinkLogWarn("first video frame not IDR. drop this frame\n");
+        LinkVideoFrameInfo frameInfo;
+        LinkVideoFormat nVideoFormat = pProgram->nIsReconfigPending ? pProgram->pendingArg.nVideoFormat : pProgram->avArg.nVideoFormat;
+        LinkAnalyzeVideoFrame(nVideoFormat, (const uint8_t *)_pData, _nDataLen, &frameInfo, &pProgram->paramSets);
+        //调用者不知道是不是关键帧的时候可以传0
+        frameInfo.nIsKeyFrame |= (nIsKeyFrame != 0);
+        nIsKeyFrame = frameInfo.nIsKeyFrame;
+        //调用LinkReconfigureMedia以后来的已经是新格式了，新格式从关键帧开始写进新的分片
+        if (pProgram->nIsReconfigPending && (_nProgram != 0 || !nIsKeyFrame)) {
                 pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
                 return 0;
         }
-        ret = checkSwitch(_pTsMuxUploader, _nTimestamp, nIsKeyFrame, 1, _nIsSegStart);
-        if (ret != 0) {
-                return ret;
-        }
-        if (pFFTsMuxUploader->nKeyFrameCount == 0 && !nIsKeyFrame) {
-                LinkLogWarn("first video frame not IDR. drop this frame\n");
-                pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
-                return 0;
+        if (_nProgram == 0) {
+                if (pFFTsMuxUploader->nKeyFrameCount == 0 && !nIsKeyFrame) {
+                        LinkLogWarn("first video frame not IDR. drop this frame\n");
+                        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                        return 0;
+                }
+                ret = checkSwitch(_pTsMuxUploader, _nTimestamp, nIsKeyFrame, 1, _nIsSegStart);
+                if (ret != 0) {
+                        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                        return ret;
+                }
+                if (pFFTsMuxUploader->nKeyFrameCount == 0 && !nIsKeyFrame) {
+                        LinkLogWarn("first video frame not IDR. drop this frame\n");
+                        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                        return 0;
+                }
+        } else {
+                if (pFFTsMuxUploader->nKeyFrameCount == 0 || (!pProgram->nIsStarted && !nIsKeyFrame)) {
+                        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                        return 0;
+                }
+                pProgram->nIsStarted = 1;
         }
         
-        ret = push(pFFTsMuxUploader, _pData, _nDataLen, _nTimestamp, LINK_STREAM_TYPE_VIDEO);
+        ret = push(pFFTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp, LINK_STREAM_TYPE_VIDEO, &frameInfo);
         if (ret == 0){
                 pFFTsMuxUploader->nFrameCount++;
         }
@@ -335,20 +591,35 @@ static int PushVideo(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDa
         return ret;
 }
 
-static int PushAudio(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp)
+static int pushProgramAudio(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp)
 {
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)_pTsMuxUploader;
+        if (_nProgram < 0 || _nProgram >= pFFTsMuxUploader->nProgramCount) {
+                LinkLogError("wrong program:%d", _nProgram);
+                return LINK_ARG_ERROR;
+        }
         pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
-        int ret = checkSwitch(_pTsMuxUploader, _nTimestamp, 0, 0, 0);
-        if (ret != 0) {
-                return ret;
+        int ret = 0;
+        if (_nProgram == 0) {
+                ret = checkSwitch(_pTsMuxUploader, _nTimestamp, 0, 0, 0);
+                if (ret != 0) {
+                        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                        return ret;
+                }
         }
         if (pFFTsMuxUploader->nKeyFrameCount == 0) {
                 pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
                 LinkLogDebug("no keyframe. drop audio frame");
                 return 0;
         }
-        ret = push(pFFTsMuxUploader, _pData, _nDataLen, _nTimestamp, LINK_STREAM_TYPE_AUDIO);
+        ProgramState *pProgram = &pFFTsMuxUploader->pPrograms[_nProgram];
+        //重新配置成没有音频以后，pmt里已经没有音频流了
+        if ((pProgram->nIsReconfigPending && isAudioArgChanged(&pProgram->avArg, &pProgram->pendingArg))
+            || pProgram->avArg.nAudioFormat == 0) {
+                pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                return 0;
+        }
+        ret = push(pFFTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp, LINK_STREAM_TYPE_AUDIO, NULL);
         if (ret == 0){
                 pFFTsMuxUploader->nFrameCount++;
         }
@@ -356,6 +627,101 @@ static int PushAudio(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDa
         return ret;
 }
 
+//metadata不切分片，也不等关键帧，直接写进当前分片。分片还没开始(没有关键帧)时丢掉
+static int PushProgramMetadata(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)_pTsMuxUploader;
+        if (!pFFTsMuxUploader->nWithMetadata || _nProgram < 0 || _nProgram >= pFFTsMuxUploader->nProgramCount) {
+                LinkLogError("metadata not enabled or wrong program:%d", _nProgram);
+                return LINK_ARG_ERROR;
+        }
+#ifdef USE_OWN_TSMUX
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        FFTsMuxContext *pTsMuxCtx = pFFTsMuxUploader->pTsMuxCtx;
+        int ret = 0;
+        if (pFFTsMuxUploader->nKeyFrameCount == 0 || pTsMuxCtx == NULL) {
+                pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                LinkLogDebug("no keyframe. drop metadata");
+                return 0;
+        }
+        //和音频一样，队列快满时先丢
+        if (pTsMuxCtx->pTsUploader_->AdmitFrame(pTsMuxCtx->pTsUploader_, LINK_FRAME_AUDIO, getAdmitSize(pTsMuxCtx, _nDataLen))) {
+                ret = LinkMuxerProgramMetadata(pTsMuxCtx->pFmtCtx_, _nProgram, (uint8_t *)_pData, _nDataLen, _nTimestamp);
+                if (ret == 0) {
+                        pFFTsMuxUploader->nFrameCount++;
+                }
+        }
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        return ret;
+#else
+        return LINK_ARG_ERROR;
+#endif
+}
+
+//只记下新格式。等第0个节目的关键帧切分片的时候再用新格式建muxer(pmt的version加1)，上传线程和缓存都不重建
+static int ReconfigureMedia(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, LinkMediaArg *_pAvArg)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)_pTsMuxUploader;
+        if (_nProgram < 0 || _nProgram >= pFFTsMuxUploader->nProgramCount) {
+                LinkLogError("wrong program:%d", _nProgram);
+                return LINK_ARG_ERROR;
+        }
+        //第0个节目的关键帧决定分片，不能没有视频
+        if (_pAvArg->nVideoFormat < 0 || _pAvArg->nVideoFormat > LINK_VIDEO_H265 || _pAvArg->nAudioFormat < 0
+            || _pAvArg->nAudioFormat > LINK_AUDIO_AAC || (_nProgram == 0 && _pAvArg->nVideoFormat == 0)
+            || (_pAvArg->nVideoFormat == 0 && _pAvArg->nAudioFormat == 0)) {
+                LinkLogError("wrong media arg:%d %d", _pAvArg->nVideoFormat, _pAvArg->nAudioFormat);
+                return LINK_ARG_ERROR;
+        }
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        ProgramState *pProgram = &pFFTsMuxUploader->pPrograms[_nProgram];
+        pProgram->pendingArg = *_pAvArg;
+        pProgram->nIsReconfigPending = 1;
+        pProgram->paramSets.nLen = 0; //分辨率变了sps也变了
+        pFFTsMuxUploader->nReconfigPending = 1;
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        LinkLogInfo("reconfigure program %d: video:%d audio:%d %d %d", _nProgram, _pAvArg->nVideoFormat,
+                    _pAvArg->nAudioFormat, _pAvArg->nChannels, _pAvArg->nSamplerate);
+        return LINK_SUCCESS;
+}
+
+static void applyReconfigure(FFTsMuxUploader *_pFFTsMuxUploader)
+{
+        if (!_pFFTsMuxUploader->nReconfigPending) {
+                return;
+        }
+        int i;
+        for (i = 0; i < _pFFTsMuxUploader->nProgramCount; i++) {
+                ProgramState *pProgram = &_pFFTsMuxUploader->pPrograms[i];
+                if (!pProgram->nIsReconfigPending) {
+                        continue;
+                }
+                pProgram->avArg = pProgram->pendingArg;
+                pProgram->nIsReconfigPending = 0;
+                pProgram->nIsAdtsHeaderValid = 0;
+                initAdtsHeader(pProgram);
+                pProgram->nIsStarted = 0; //其他节目也要从新格式的关键帧开始
+        }
+        _pFFTsMuxUploader->nReconfigPending = 0;
+        _pFFTsMuxUploader->nPmtVersion = (_pFFTsMuxUploader->nPmtVersion + 1) & 0x1F;
+        _pFFTsMuxUploader->nConfigGeneration++;
+}
+
+static int PushVideo(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp, int nIsKeyFrame, int _nIsSegStart)
+{
+        return pushProgramVideo(_pTsMuxUploader, 0, _pData, _nDataLen, _nTimestamp, nIsKeyFrame, _nIsSegStart);
+}
+
+static int PushAudio(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp)
+{
+        return pushProgramAudio(_pTsMuxUploader, 0, _pData, _nDataLen, _nTimestamp);
+}
+
+static int PushProgramVideo(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp, int nIsKeyFrame)
+{
+        return pushProgramVideo(_pTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp, nIsKeyFrame, 0);
+}
+
 static int waitToCompleUploadAndDestroyTsMuxContext(void *_pOpaque)
 {
         FFTsMuxContext *pTsMuxCtx = (FFTsMuxContext*)_pOpaque;
@@ -372,8 +738,8 @@ static int waitToCompleUploadAndDestroyTsMuxContext(void *_pOpaque)
                 
                 LinkUploaderStatInfo statInfo = {0};
                 pTsMuxCtx->pTsUploader_->GetStatInfo(pTsMuxCtx->pTsUploader_, &statInfo);
-                LinkLogDebug("uploader push:%d pop:%d remainItemCount:%d dropped:%d", statInfo.nPushDataBytes_,
-                         statInfo.nPopDataBytes_, statInfo.nLen_, statInfo.nDropped);
+                LinkLogDebug("uploader push:%lld pop:%lld remainItemCount:%d dropped:%lld highwater:%d", (long long)statInfo.nPushDataBytes_,
+                         (long long)statInfo.nPopDataBytes_, statInfo.nLen_, (long long)statInfo.nDropped, statInfo.nHighWaterMark);
                 LinkDestroyUploader(&pTsMuxCtx->pTsUploader_);
 #ifdef USE_OWN_TSMUX
                 LinkDestroyTsMuxerContext(pTsMuxCtx->pFmtCtx_);
@@ -388,26 +754,57 @@ static int waitToCompleUploadAndDestroyTsMuxContext(void *_pOpaque)
                 }
                 avformat_free_context(pTsMuxCtx->pFmtCtx_);
 #endif
-                FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)(pTsMuxCtx->pTsMuxUploader);
-                if (pFFTsMuxUploader) {
-                        if (pFFTsMuxUploader->pAACBuf) {
-                                free(pFFTsMuxUploader->pAACBuf);
-                        }
-                        if (pFFTsMuxUploader->token_.pToken_) {
-                                free(pFFTsMuxUploader->token_.pToken_);
-                                pFFTsMuxUploader->token_.pToken_ = NULL;
-                        }
-                        if (pFFTsMuxUploader->token_.pPrevToken_) {
-                                free(pFFTsMuxUploader->token_.pPrevToken_);
-                        }
-                        free(pFFTsMuxUploader);
-                }
+                FFTsMuxUploader *pOwner = pTsMuxCtx->pOwner;
                 free(pTsMuxCtx);
+                if (pOwner) {
+                        releaseTsMuxUploader(pOwner);
+                }
         }
         
         return LINK_SUCCESS;
 }
 
+//资源管理线程是按顺序执行的，排在这个任务前面的准备任务都已经执行完。
+//已经交出去的分片可能还在上传，会回调uploadArg，最后一个销毁时才释放
+static int destroyTsMuxUploader(void *_pOpaque)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = ((UploaderJob *)_pOpaque)->pFFTsMuxUploader;
+        
+        if (pFFTsMuxUploader->pStandbyCtx) {
+                waitToCompleUploadAndDestroyTsMuxContext(pFFTsMuxUploader->pStandbyCtx);
+                pFFTsMuxUploader->pStandbyCtx = NULL;
+        }
+        releaseTsMuxUploader(pFFTsMuxUploader);
+        return LINK_SUCCESS;
+}
+
+static void releaseTsMuxUploader(FFTsMuxUploader *pFFTsMuxUploader)
+{
+        if (__sync_sub_and_fetch(&pFFTsMuxUploader->nRef, 1) != 0) {
+                return;
+        }
+        int i;
+        for (i = 0; i < pFFTsMuxUploader->nProgramCount; i++) {
+                if (pFFTsMuxUploader->pPrograms[i].pAACBuf) {
+                        free(pFFTsMuxUploader->pPrograms[i].pAACBuf);
+                }
+                if (pFFTsMuxUploader->pPrograms[i].pVideoBuf) {
+                        free(pFFTsMuxUploader->pPrograms[i].pVideoBuf);
+                }
+        }
+        free(pFFTsMuxUploader->pPrograms);
+        if (pFFTsMuxUploader->token_.pToken_) {
+                free(pFFTsMuxUploader->token_.pToken_);
+                pFFTsMuxUploader->token_.pToken_ = NULL;
+        }
+        if (pFFTsMuxUploader->token_.pPrevToken_) {
+                free(pFFTsMuxUploader->token_.pPrevToken_);
+        }
+        pthread_mutex_destroy(&pFFTsMuxUploader->muxUploaderMutex_);
+        free(pFFTsMuxUploader);
+        return;
+}
+
 #define getFFmpegErrorMsg(errcode) char msg[128];\
 av_strerror(errcode, msg, sizeof(msg))
 
@@ -474,9 +871,12 @@ static int getBufferSize(FFTsMuxUploader *pFFTsMuxUploader) {
         }
 }
 
-static int newTsMuxContext(FFTsMuxContext ** _pTsMuxCtx, LinkMediaArg *_pAvArg, LinkUploadArg *_pUploadArg, int nQBufSize)
+static int newTsMuxContext(FFTsMuxContext ** _pTsMuxCtx, const LinkMediaArg *_pAvArgs, int _nProgramCount,
+                           int _nWithMetadata, int _nInterleaveWindow, int _nPmtVersion, LinkUploadArg *_pUploadArg, int nQBufSize)
 #ifdef USE_OWN_TSMUX
 {
+        const LinkMediaArg *_pAvArg = &_pAvArgs[0];
+        
         FFTsMuxContext * pTsMuxCtx = (FFTsMuxContext *)malloc(sizeof(FFTsMuxContext));
         if (pTsMuxCtx == NULL) {
                 return LINK_NO_MEMORY;
@@ -495,7 +895,20 @@ static int newTsMuxContext(FFTsMuxContext ** _pTsMuxCtx, LinkMediaArg *_pAvArg,
         avArg.nAudioSampleRate = _pAvArg->nSamplerate;
         
         avArg.output = writeTsPacketToMem;
+        avArg.reserve = reserveTsPacketInMem;
+        avArg.commit = commitTsPacketToMem;
+        avArg.outputVec = pTsMuxCtx->pTsUploader_->PushVec ? writeTsPacketVecToMem : NULL;
+        avArg.nTableInterval = TS_TABLE_INTERVAL;
+        avArg.nAudioAggregateDuration = TS_AUDIO_AGGREGATE_DURATION;
+        avArg.nInterleaveWindow = _nInterleaveWindow;
         avArg.nVideoFormat = _pAvArg->nVideoFormat;
+        avArg.nContainer = _pUploadArg->nContainerFormat_;
+        avArg.initOutput = pTsMuxCtx->pTsUploader_->SetInitSegment ? writeInitSegmentToUploader : NULL;
+        avArg.nFragmentDuration = FMP4_FRAGMENT_DURATION;
+        avArg.nProgramCount = _nProgramCount;
+        avArg.pPrograms = _pAvArgs;
+        avArg.nWithMetadata = _nWithMetadata;
+        avArg.nPmtVersion = _nPmtVersion;
         avArg.pOpaque = pTsMuxCtx;
         
         ret = LinkNewTsMuxerContext(&avArg, &pTsMuxCtx->pFmtCtx_);
@@ -512,6 +925,7 @@ static int newTsMuxContext(FFTsMuxContext ** _pTsMuxCtx, LinkMediaArg *_pAvArg,
 }
 #else
 {
+        const LinkMediaArg *_pAvArg = &_pAvArgs[0];
         FFTsMuxContext * pTsMuxCtx = (FFTsMuxContext *)malloc(sizeof(FFTsMuxContext));
         if (pTsMuxCtx == NULL) {
                 return LINK_NO_MEMORY;
@@ -635,9 +1049,59 @@ end:
 }
 #endif
 
-static int setToken(LinkTsMuxUploader* _PTsMuxUploader, char *_pToken, int _nTokenLen)
+//在资源管理线程里执行。建的时候不持锁，建好以后配置没变才放进去，变了就直接销毁
+static int prepareStandbyContext(void *_pOpaque)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = ((UploaderJob *)_pOpaque)->pFFTsMuxUploader;
+        LinkMediaArg avArgs[LINK_TS_MAX_PROGRAMS];
+        LinkUploadArg uploadArg;
+
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        pFFTsMuxUploader->nIsStandbyQueued = 0;
+        if (pFFTsMuxUploader->nQuit || pFFTsMuxUploader->pStandbyCtx) {
+                pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+                return LINK_SUCCESS;
+        }
+        int i;
+        int nProgramCount = pFFTsMuxUploader->nProgramCount;
+        for (i = 0; i < nProgramCount; i++) {
+                avArgs[i] = pFFTsMuxUploader->pPrograms[i].avArg;
+        }
+        int nWithMetadata = pFFTsMuxUploader->nWithMetadata;
+        int nPmtVersion = pFFTsMuxUploader->nPmtVersion;
+        int nGeneration = pFFTsMuxUploader->nConfigGeneration;
+        int nBufsize = getBufferSize(pFFTsMuxUploader) * nProgramCount;
+        uploadArg = pFFTsMuxUploader->uploadArg;
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+
+        FFTsMuxContext *pTsMuxCtx = NULL;
+        int ret = newTsMuxContext(&pTsMuxCtx, avArgs, nProgramCount, nWithMetadata, pFFTsMuxUploader->nInterleaveWindow,
+                                  nPmtVersion, &uploadArg, nBufsize);
+        if (ret != 0) {
+                LinkLogWarn("prepare standby context fail:%d", ret);
+                return ret;
+        }
+        holdTsMuxUploader(pFFTsMuxUploader, pTsMuxCtx);
+        pTsMuxCtx->nGeneration = nGeneration;
+        ret = pTsMuxCtx->pTsUploader_->UploadStart(pTsMuxCtx->pTsUploader_);
+
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        if (ret == LINK_SUCCESS && !pFFTsMuxUploader->nQuit && pFFTsMuxUploader->pStandbyCtx == NULL
+            && pFFTsMuxUploader->nConfigGeneration == nGeneration) {
+                pFFTsMuxUploader->pStandbyCtx = pTsMuxCtx;
+                pTsMuxCtx = NULL;
+        }
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+
+        if (pTsMuxCtx) {
+                waitToCompleUploadAndDestroyTsMuxContext(pTsMuxCtx);
+        }
+        return LINK_SUCCESS;
+}
+
+//在muxUploaderMutex_里调用(创建时锁还没初始化，直接调)
+static int updateToken(FFTsMuxUploader * pFFTsMuxUploader, char *_pToken, int _nTokenLen)
 {
-        FFTsMuxUploader * pFFTsMuxUploader = (FFTsMuxUploader *)_PTsMuxUploader;
         if (pFFTsMuxUploader->token_.pToken_ == NULL) {
                 pFFTsMuxUploader->token_.pToken_ = malloc(_nTokenLen + 1);
                 if (pFFTsMuxUploader->token_.pToken_  == NULL) {
@@ -659,28 +1123,64 @@ static int setToken(LinkTsMuxUploader* _PTsMuxUploader, char *_pToken, int _nTok
         pFFTsMuxUploader->token_.nTokenLen_ = _nTokenLen;
         pFFTsMuxUploader->token_.pToken_[_nTokenLen] = 0;
         
-        pFFTsMuxUploader->uploadArg.pToken_ = _pToken;
+        //备用上下文在资源管理线程里拷贝uploadArg，不能指向调用者的内存
+        pFFTsMuxUploader->uploadArg.pToken_ = pFFTsMuxUploader->token_.pToken_;
+        pFFTsMuxUploader->nConfigGeneration++;
         return LINK_SUCCESS;
 }
 
+static int setToken(LinkTsMuxUploader* _PTsMuxUploader, char *_pToken, int _nTokenLen)
+{
+        FFTsMuxUploader * pFFTsMuxUploader = (FFTsMuxUploader *)_PTsMuxUploader;
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        int ret = updateToken(pFFTsMuxUploader, _pToken, _nTokenLen);
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        return ret;
+}
+
 static void upadateUploadArg(void *_pOpaque, void* pArg, int64_t nNow)
 {
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)_pOpaque;
         LinkUploadArg *_pUploadArg = (LinkUploadArg *)pArg;
+        //在上传线程里调用，推流线程和资源管理线程也会读写uploadArg
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
         if (pFFTsMuxUploader->uploadArg.nSegmentId_ == 0) {
                 pFFTsMuxUploader->uploadArg.nLastUploadTsTime_ = _pUploadArg->nLastUploadTsTime_;
                 pFFTsMuxUploader->uploadArg.nSegmentId_ = _pUploadArg->nSegmentId_;
+                pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
                 return;
         }
         int64_t nDiff = pFFTsMuxUploader->nNewSegmentInterval * 1000000000LL;
         if (nNow - pFFTsMuxUploader->uploadArg.nLastUploadTsTime_ >= nDiff) {
                 pFFTsMuxUploader->uploadArg.nSegmentId_ = nNow;
-                _pUploadArg->nSegmentId_ = nNow;
         }
+        //备用上下文是提前建的，拷贝的segment id可能已经旧了，以这里的为准
+        _pUploadArg->nSegmentId_ = pFFTsMuxUploader->uploadArg.nSegmentId_;
         pFFTsMuxUploader->uploadArg.nLastUploadTsTime_ = _pUploadArg->nLastUploadTsTime_;
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
         return;
 }
 
+//上传线程开始时调用。每个分片都带着自己的init，同一个segment里内容没变就不用重复上传
+static int claimInitSegment(void *_pOpaque, int64_t nSegmentId, uint32_t nInitCrc)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)_pOpaque;
+        int nClaimed = 0;
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        if (nInitCrc == 0) {
+                if (pFFTsMuxUploader->nInitSegmentId == nSegmentId) {
+                        pFFTsMuxUploader->nInitSegmentId = 0;
+                        pFFTsMuxUploader->nInitCrc = 0;
+                }
+        } else if (pFFTsMuxUploader->nInitSegmentId != nSegmentId || pFFTsMuxUploader->nInitCrc != nInitCrc) {
+                pFFTsMuxUploader->nInitSegmentId = nSegmentId;
+                pFFTsMuxUploader->nInitCrc = nInitCrc;
+                nClaimed = 1;
+        }
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        return nClaimed;
+}
+
 static void setUploaderBufferSize(LinkTsMuxUploader* _pTsMuxUploader, int nBufferSize)
 {
         if (nBufferSize < 256) {
@@ -688,7 +1188,10 @@ static void setUploaderBufferSize(LinkTsMuxUploader* _pTsMuxUploader, int nBuffe
                 return;
         }
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)_pTsMuxUploader;
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
         pFFTsMuxUploader->nUploadBufferSize = nBufferSize * 1024;
+        pFFTsMuxUploader->nConfigGeneration++;
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
 }
 
 static int getUploaderBufferUsedSize(LinkTsMuxUploader* _pTsMuxUploader)
@@ -699,12 +1202,26 @@ static int getUploaderBufferUsedSize(LinkTsMuxUploader* _pTsMuxUploader)
         int nUsed = 0;
         if (pFFTsMuxUploader->pTsMuxCtx) {
                 pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->GetStatInfo(pFFTsMuxUploader->pTsMuxCtx->pTsUploader_, &info);
-                nUsed = info.nPushDataBytes_ - info.nPopDataBytes_;
+                nUsed = (int)(info.nPushDataBytes_ - info.nPopDataBytes_);
+        }
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        return nUsed;
+}
+
+static int getUploaderStatInfo(LinkTsMuxUploader* _pTsMuxUploader, LinkUploaderStatInfo *_pStatInfo)
+{
+        FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)_pTsMuxUploader;
+        int ret = LINK_SUCCESS;
+        //队列的快照不加队列的锁，这里的锁只保证pTsMuxCtx不会被换掉
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
+        if (pFFTsMuxUploader->pTsMuxCtx) {
+                pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->GetStatInfo(pFFTsMuxUploader->pTsMuxCtx->pTsUploader_, _pStatInfo);
         } else {
-                return 0;
+                memset(_pStatInfo, 0, sizeof(LinkUploaderStatInfo));
+                ret = LINK_NO_MEMORY;
         }
         pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
-        return nUsed + (nUsed/188) * 4;
+        return ret;
 }
 
 static void setNewSegmentInterval(LinkTsMuxUploader* _pTsMuxUploader, int nInterval)
@@ -714,11 +1231,34 @@ static void setNewSegmentInterval(LinkTsMuxUploader* _pTsMuxUploader, int nInter
                 return;
         }
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)_pTsMuxUploader;
+        pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
         pFFTsMuxUploader->nNewSegmentInterval = nInterval;
+        pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
 }
 
 int LinkNewTsMuxUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAvArg, LinkUserUploadArg *_pUserUploadArg)
 {
+        return LinkNewTsMuxUploaderWithPrograms(_pTsMuxUploader, _pAvArg, 1, _pUserUploadArg);
+}
+
+int LinkNewTsMuxUploaderWithPrograms(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAvArgs, int _nProgramCount,
+                                     LinkUserUploadArg *_pUserUploadArg)
+{
+        if (_nProgramCount < 1 || _nProgramCount > LINK_TS_MAX_PROGRAMS) {
+                LinkLogError("wrong program count:%d", _nProgramCount);
+                return LINK_ARG_ERROR;
+        }
+#ifndef USE_OWN_TSMUX
+        if (_nProgramCount > 1) {
+                LinkLogError("multi program need own tsmux");
+                return LINK_ARG_ERROR;
+        }
+#else
+        if (_nProgramCount > 1 && _pUserUploadArg->nContainerFormat != LINK_CONTAINER_TS) {
+                LinkLogError("multi program only support ts");
+                return LINK_ARG_ERROR;
+        }
+#endif
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader*)malloc(sizeof(FFTsMuxUploader));
         if (pFFTsMuxUploader == NULL) {
                 return LINK_NO_MEMORY;
@@ -726,7 +1266,7 @@ int LinkNewTsMuxUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAv
         memset(pFFTsMuxUploader, 0, sizeof(FFTsMuxUploader));
         
         int ret = 0;
-        ret = setToken((LinkTsMuxUploader *)pFFTsMuxUploader, _pUserUploadArg->pToken_, _pUserUploadArg->nTokenLen_);
+        ret = updateToken(pFFTsMuxUploader, _pUserUploadArg->pToken_, _pUserUploadArg->nTokenLen_);
         if (ret != 0) {
                 return ret;
         }
@@ -742,10 +1282,31 @@ int LinkNewTsMuxUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAv
         pFFTsMuxUploader->uploadArg.pUploadArgKeeper_ = pFFTsMuxUploader;
         pFFTsMuxUploader->uploadArg.UploadArgUpadate = upadateUploadArg;
         pFFTsMuxUploader->uploadArg.uploadZone = _pUserUploadArg->uploadZone_;
+        pFFTsMuxUploader->uploadArg.nContainerFormat_ = _pUserUploadArg->nContainerFormat;
+        pFFTsMuxUploader->uploadArg.InitSegmentClaim = claimInitSegment;
+#ifndef USE_OWN_TSMUX
+        if (_pUserUploadArg->nContainerFormat != LINK_CONTAINER_TS) {
+                LinkLogWarn("fmp4 need own tsmux. use ts");
+                pFFTsMuxUploader->uploadArg.nContainerFormat_ = LINK_CONTAINER_TS;
+        }
+        if (_pUserUploadArg->nWithMetadata) {
+                LinkLogWarn("metadata need own tsmux. ignore");
+        }
+#else
+        if (_pUserUploadArg->nWithMetadata && _pUserUploadArg->nContainerFormat != LINK_CONTAINER_TS) {
+                LinkLogWarn("metadata only support ts. ignore");
+        } else {
+                pFFTsMuxUploader->nWithMetadata = (_pUserUploadArg->nWithMetadata != 0);
+        }
+        if (_pUserUploadArg->nInterleaveWindow > 0) {
+                pFFTsMuxUploader->nInterleaveWindow = _pUserUploadArg->nInterleaveWindow;
+        }
+#endif
         
         pFFTsMuxUploader->nNewSegmentInterval = 30;
         
         pFFTsMuxUploader->nFirstTimestamp = -1;
+        pFFTsMuxUploader->nRef = 1;
         
         ret = pthread_mutex_init(&pFFTsMuxUploader->muxUploaderMutex_, NULL);
         if (ret != 0){
@@ -758,9 +1319,31 @@ int LinkNewTsMuxUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAv
         pFFTsMuxUploader->tsMuxUploader_.PushVideo = PushVideo;
         pFFTsMuxUploader->tsMuxUploader_.SetUploaderBufferSize = setUploaderBufferSize;
         pFFTsMuxUploader->tsMuxUploader_.GetUploaderBufferUsedSize = getUploaderBufferUsedSize;
+        pFFTsMuxUploader->tsMuxUploader_.GetUploaderStatInfo = getUploaderStatInfo;
         pFFTsMuxUploader->tsMuxUploader_.SetNewSegmentInterval = setNewSegmentInterval;
+        pFFTsMuxUploader->tsMuxUploader_.PushProgramVideo = PushProgramVideo;
+        pFFTsMuxUploader->tsMuxUploader_.PushProgramAudio = pushProgramAudio;
+        pFFTsMuxUploader->tsMuxUploader_.PushProgramMetadata = PushProgramMetadata;
+        pFFTsMuxUploader->tsMuxUploader_.ReconfigureMedia = ReconfigureMedia;
+        pFFTsMuxUploader->prepareJob.asyncJob.function = prepareStandbyContext;
+        pFFTsMuxUploader->prepareJob.pFFTsMuxUploader = pFFTsMuxUploader;
+        pFFTsMuxUploader->destroyJob.asyncJob.function = destroyTsMuxUploader;
+        pFFTsMuxUploader->destroyJob.pFFTsMuxUploader = pFFTsMuxUploader;
         
-        pFFTsMuxUploader->avArg = *_pAvArg;
+        pFFTsMuxUploader->pPrograms = (ProgramState *)malloc(sizeof(ProgramState) * _nProgramCount);
+        if (pFFTsMuxUploader->pPrograms == NULL) {
+                pthread_mutex_destroy(&pFFTsMuxUploader->muxUploaderMutex_);
+                free(pFFTsMuxUploader);
+                return LINK_NO_MEMORY;
+        }
+        memset(pFFTsMuxUploader->pPrograms, 0, sizeof(ProgramState) * _nProgramCount);
+        int i;
+        for (i = 0; i < _nProgramCount; i++) {
+                pFFTsMuxUploader->pPrograms[i].avArg = _pAvArgs[i];
+                initAdtsHeader(&pFFTsMuxUploader->pPrograms[i]);
+        }
+        pFFTsMuxUploader->nProgramCount = _nProgramCount;
+        LinkAddUploaderStream();
         
         *_pTsMuxUploader = (LinkTsMuxUploader *)pFFTsMuxUploader;
         
@@ -773,27 +1356,61 @@ int LinkTsMuxUploaderStart(LinkTsMuxUploader *_pTsMuxUploader)
         
         assert(pFFTsMuxUploader->pTsMuxCtx == NULL);
         
-        int nBufsize = getBufferSize(pFFTsMuxUploader);
-        int ret = newTsMuxContext(&pFFTsMuxUploader->pTsMuxCtx, &pFFTsMuxUploader->avArg, &pFFTsMuxUploader->uploadArg, nBufsize);
-        if (ret != 0) {
-                free(pFFTsMuxUploader);
-                return ret;
+        applyReconfigure(pFFTsMuxUploader);
+        
+        FFTsMuxContext *pStandbyCtx = pFFTsMuxUploader->pStandbyCtx;
+        pFFTsMuxUploader->pStandbyCtx = NULL;
+        if (pStandbyCtx && pStandbyCtx->nGeneration != pFFTsMuxUploader->nConfigGeneration) {
+                recycleTsMuxContext(pStandbyCtx);
+                pStandbyCtx = NULL;
+        }
+        int i;
+        int ret = 0;
+        if (pStandbyCtx) {
+                pFFTsMuxUploader->pTsMuxCtx = pStandbyCtx;
+        } else {
+                //第一个分片，或者备用的还没建好/已经过期，只能在这里建
+                LinkMediaArg avArgs[LINK_TS_MAX_PROGRAMS];
+                for (i = 0; i < pFFTsMuxUploader->nProgramCount; i++) {
+                        avArgs[i] = pFFTsMuxUploader->pPrograms[i].avArg;
+                }
+                //每个节目都往同一个队列里写
+                int nBufsize = getBufferSize(pFFTsMuxUploader) * pFFTsMuxUploader->nProgramCount;
+                ret = newTsMuxContext(&pFFTsMuxUploader->pTsMuxCtx, avArgs, pFFTsMuxUploader->nProgramCount,
+                                      pFFTsMuxUploader->nWithMetadata, pFFTsMuxUploader->nInterleaveWindow, pFFTsMuxUploader->nPmtVersion,
+                                      &pFFTsMuxUploader->uploadArg, nBufsize);
+                if (ret != 0) {
+                        requestStandby(pFFTsMuxUploader);
+                        return ret;
+                }
+                holdTsMuxUploader(pFFTsMuxUploader, pFFTsMuxUploader->pTsMuxCtx);
+                pFFTsMuxUploader->pTsMuxCtx->nGeneration = pFFTsMuxUploader->nConfigGeneration;
+                pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->UploadStart(pFFTsMuxUploader->pTsMuxCtx->pTsUploader_);
         }
         
-        pFFTsMuxUploader->pTsMuxCtx->pTsUploader_->UploadStart(pFFTsMuxUploader->pTsMuxCtx->pTsUploader_);
+        for (i = 0; i < pFFTsMuxUploader->nProgramCount; i++) {
+                pFFTsMuxUploader->pPrograms[i].nPrevAudioTimestamp = 0;
+                pFFTsMuxUploader->pPrograms[i].nPrevVideoTimestamp = 0;
+                pFFTsMuxUploader->pPrograms[i].nIsParamSetWrited = 0;
+        }
+        
+        requestStandby(pFFTsMuxUploader);
         return LINK_SUCCESS;
 }
 
 void LinkDestroyTsMuxUploader(LinkTsMuxUploader **_pTsMuxUploader)
 {
         FFTsMuxUploader *pFFTsMuxUploader = (FFTsMuxUploader *)(*_pTsMuxUploader);
+        LinkRemoveUploaderStream();
         
         pthread_mutex_lock(&pFFTsMuxUploader->muxUploaderMutex_);
-        if (pFFTsMuxUploader->pTsMuxCtx) {
-                pFFTsMuxUploader->pTsMuxCtx->pTsMuxUploader = (LinkTsMuxUploader*)pFFTsMuxUploader;
-        }
+        pFFTsMuxUploader->nQuit = 1;
         pushRecycle(pFFTsMuxUploader);
         pthread_mutex_unlock(&pFFTsMuxUploader->muxUploaderMutex_);
+        //备用上下文和还没执行的准备任务都在destroyTsMuxUploader里处理
+        if (LinkPushFunction(&pFFTsMuxUploader->destroyJob) < 0) {
+                destroyTsMuxUploader(&pFFTsMuxUploader->destroyJob);
+        }
         *_pTsMuxUploader = NULL;
         return;
 }
@@ -18,10 +18,17 @@ typedef struct _LinkTsMuxUploader{
         int (*SetToken)(LinkTsMuxUploader*, char *, int);
         void (*SetUploaderBufferSize)(LinkTsMuxUploader*, int);
         int (*GetUploaderBufferUsedSize)(LinkTsMuxUploader*);
+        int (*GetUploaderStatInfo)(LinkTsMuxUploader*, LinkUploaderStatInfo *);
         void (*SetNewSegmentInterval)(LinkTsMuxUploader*, int);
+        //多节目时往第nProgram个节目写，第0个节目和PushVideo/PushAudio一样
+        int(*PushProgramVideo)(LinkTsMuxUploader *pTsMuxUploader, int nProgram, char * pData, int nDataLen, int64_t nTimestamp, int nIsKeyFrame);
+        int(*PushProgramAudio)(LinkTsMuxUploader *pTsMuxUploader, int nProgram, char * pData, int nDataLen, int64_t nTimestamp);
+        int(*PushProgramMetadata)(LinkTsMuxUploader *pTsMuxUploader, int nProgram, char * pData, int nDataLen, int64_t nTimestamp);
+        int (*ReconfigureMedia)(LinkTsMuxUploader *pTsMuxUploader, int nProgram, LinkMediaArg *pAvArg);
 }LinkTsMuxUploader;
 
 int LinkNewTsMuxUploader(LinkTsMuxUploader **pTsMuxUploader, LinkMediaArg *pAvArg, LinkUserUploadArg *pUserUploadArg);
+int LinkNewTsMuxUploaderWithPrograms(LinkTsMuxUploader **pTsMuxUploader, LinkMediaArg *pAvArgs, int nProgramCount, LinkUserUploadArg *pUserUploadArg);
 int LinkTsMuxUploaderStart(LinkTsMuxUploader *pTsMuxUploader);
 void LinkDestroyTsMuxUploader(LinkTsMuxUploader **pTsMuxUploader);
 #endif
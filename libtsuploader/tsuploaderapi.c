@@ -3,8 +3,11 @@
 #include <assert.h>
 #include "log.h"
 #include <pthread.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #include "servertime.h"
+#include "arenapool.h"
+#include "spscqueue.h"
 #ifndef USE_OWN_TSMUX
 #include <libavformat/avformat.h>
 #endif
@@ -41,6 +44,12 @@ int LinkInitUploader()
                 LinkLogError("StartMgr fail");
                 return ret;
         }
+        ret = LinkStartUploaderPool();
+        if (ret != 0) {
+                LinkLogError("StartUploaderPool fail:%d", ret);
+                LinkStopMgr();
+                return ret;
+        }
         nProcStatus = 1;
         LinkLogDebug("main thread id:%ld", (long)pthread_self());
         
@@ -48,17 +57,18 @@ int LinkInitUploader()
 
 }
 
-int LinkCreateAndStartAVUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAvArg, LinkUserUploadArg *_pUserUploadArg)
+int LinkCreateAndStartMultiProgramAVUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAvArgs, int _nProgramCount,
+                                             LinkUserUploadArg *_pUserUploadArg)
 {
         if (_pUserUploadArg->pToken_ == NULL || _pUserUploadArg->nTokenLen_ == 0 ||
             _pUserUploadArg->pDeviceId_ == NULL || _pUserUploadArg->nDeviceIdLen_ == 0 ||
-            _pTsMuxUploader == NULL || _pAvArg == NULL || _pUserUploadArg == NULL) {
+            _pTsMuxUploader == NULL || _pAvArgs == NULL || _pUserUploadArg == NULL) {
                 LinkLogError("token or deviceid or argument is null");
                 return LINK_ARG_ERROR;
         }
 
         LinkTsMuxUploader *pTsMuxUploader;
-        int ret = LinkNewTsMuxUploader(&pTsMuxUploader, _pAvArg, _pUserUploadArg);
+        int ret = LinkNewTsMuxUploaderWithPrograms(&pTsMuxUploader, _pAvArgs, _nProgramCount, _pUserUploadArg);
         if (ret != 0) {
                 LinkLogError("NewTsMuxUploader fail");
                 return ret;
@@ -81,6 +91,11 @@ int LinkCreateAndStartAVUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaA
         return LINK_SUCCESS;
 }
 
+int LinkCreateAndStartAVUploader(LinkTsMuxUploader **_pTsMuxUploader, LinkMediaArg *_pAvArg, LinkUserUploadArg *_pUserUploadArg)
+{
+        return LinkCreateAndStartMultiProgramAVUploader(_pTsMuxUploader, _pAvArg, 1, _pUserUploadArg);
+}
+
 int LinkPushVideo(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp, int _nIsKeyFrame, int _nIsSegStart)
 {
         if (_pTsMuxUploader == NULL || _pData == NULL || _nDataLen == 0) {
@@ -101,6 +116,54 @@ int LinkPushAudio(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataL
         return ret;
 }
 
+int LinkPushProgramVideo(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp, int _nIsKeyFrame)
+{
+        if (_pTsMuxUploader == NULL || _pData == NULL || _nDataLen == 0) {
+                return LINK_ARG_ERROR;
+        }
+        int ret = 0;
+        ret = _pTsMuxUploader->PushProgramVideo(_pTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp, _nIsKeyFrame);
+        return ret;
+}
+
+int LinkPushProgramAudio(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp)
+{
+        if (_pTsMuxUploader == NULL || _pData == NULL || _nDataLen == 0) {
+                return LINK_ARG_ERROR;
+        }
+        int ret = 0;
+        ret = _pTsMuxUploader->PushProgramAudio(_pTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp);
+        return ret;
+}
+
+int LinkPushProgramMetadata(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, char * _pData, int _nDataLen, int64_t _nTimestamp)
+{
+        if (_pTsMuxUploader == NULL || _pData == NULL || _nDataLen == 0) {
+                return LINK_ARG_ERROR;
+        }
+        int ret = 0;
+        ret = _pTsMuxUploader->PushProgramMetadata(_pTsMuxUploader, _nProgram, _pData, _nDataLen, _nTimestamp);
+        return ret;
+}
+
+int LinkPushMetadata(LinkTsMuxUploader *_pTsMuxUploader, char * _pData, int _nDataLen, int64_t _nTimestamp)
+{
+        return LinkPushProgramMetadata(_pTsMuxUploader, 0, _pData, _nDataLen, _nTimestamp);
+}
+
+int LinkReconfigureProgramMedia(LinkTsMuxUploader *_pTsMuxUploader, int _nProgram, LinkMediaArg *_pAvArg)
+{
+        if (_pTsMuxUploader == NULL || _pAvArg == NULL) {
+                return LINK_ARG_ERROR;
+        }
+        return _pTsMuxUploader->ReconfigureMedia(_pTsMuxUploader, _nProgram, _pAvArg);
+}
+
+int LinkReconfigureMedia(LinkTsMuxUploader *_pTsMuxUploader, LinkMediaArg *_pAvArg)
+{
+        return LinkReconfigureProgramMedia(_pTsMuxUploader, 0, _pAvArg);
+}
+
 int LinkUpdateToken(LinkTsMuxUploader *_pTsMuxUploader, char * _pToken, int _nTokenLen)
 {
         if (_pTsMuxUploader == NULL || _pToken == NULL || _nTokenLen == 0) {
@@ -123,6 +186,15 @@ int LinkGetUploadBufferUsedSize(LinkTsMuxUploader *_pTsMuxUploader)
         return _pTsMuxUploader->GetUploaderBufferUsedSize(_pTsMuxUploader);
 }
 
+int LinkGetUploadStatInfo(LinkTsMuxUploader *_pTsMuxUploader, LinkUploaderStatInfo *_pStatInfo)
+{
+        if (_pTsMuxUploader == NULL || _pStatInfo == NULL) {
+                LinkLogError("wrong arg.%p %p", _pTsMuxUploader, _pStatInfo);
+                return LINK_ARG_ERROR;
+        }
+        return _pTsMuxUploader->GetUploaderStatInfo(_pTsMuxUploader, _pStatInfo);
+}
+
 void LinkSetNewSegmentInterval(LinkTsMuxUploader *_pTsMuxUploader, int _nIntervalSecond)
 {
         if (_pTsMuxUploader == NULL || _nIntervalSecond < 0) {
@@ -150,12 +222,43 @@ void LinkUninitUploader()
         if (nProcStatus != 1)
                 return;
         nProcStatus = 2;
+        //上传线程结束时会把分片的销毁任务交给资源管理线程，所以先停上传线程
+        LinkStopUploaderPool();
         LinkStopMgr();
+        LinkCleanArenaPool();
+        LinkCleanSpillPool();
         Qiniu_Global_Cleanup();
         
         return;
 }
 
+void LinkSetUploadBufferPoolLimit(int _nMaxCount)
+{
+        if (_nMaxCount < 0) {
+                LinkLogError("wrong arg.%d", _nMaxCount);
+                return;
+        }
+        LinkSetArenaPoolLimit(_nMaxCount);
+}
+
+int LinkSetUploadSpillDir(const char *_pDir, int _nMaxSize)
+{
+        if (_pDir != NULL && (_nMaxSize < 0 || access(_pDir, W_OK) != 0)) {
+                LinkLogError("wrong arg or dir not writable.%s %d", _pDir, _nMaxSize);
+                return LINK_ARG_ERROR;
+        }
+        return LinkSetUploaderSpill(_pDir, _nMaxSize);
+}
+
+int LinkSetUploadWorkerPool(int _nWorkerCount, int _nPendingCount, int _nStackSize, LinkUploadBusyPolicy _busyPolicy)
+{
+        int ret = LinkSetUploaderPool(_nWorkerCount, _nPendingCount, _nStackSize, _busyPolicy);
+        if (ret != 0) {
+                LinkLogError("wrong arg or already started.%d %d %d %d", _nWorkerCount, _nPendingCount, _nStackSize, _busyPolicy);
+        }
+        return ret;
+}
+
 //---------test
 static char gAk[65] = {0};
 static char gSk[65] = {0};
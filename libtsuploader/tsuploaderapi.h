@@ -8,14 +8,41 @@
 int LinkInitUploader();
 
 int LinkCreateAndStartAVUploader(OUT LinkTsMuxUploader **pTsMuxUploader, IN LinkMediaArg *pAvArg, IN LinkUserUploadArg *pUserUploadArg);
+//多路(比如nvr)合成一个多节目ts上传，pAvArgs[i]是第i路的格式，最多16路，只支持ts。第0路的关键帧决定切分片
+int LinkCreateAndStartMultiProgramAVUploader(OUT LinkTsMuxUploader **pTsMuxUploader, IN LinkMediaArg *pAvArgs, IN int nProgramCount,
+                                             IN LinkUserUploadArg *pUserUploadArg);
 int LinkUpdateToken(IN LinkTsMuxUploader *pTsMuxUploader, IN char * pToken, IN int nTokenLen);
 void LinkSetUploadBufferSize(IN LinkTsMuxUploader *pTsMuxUploader, IN int nSize);
 int LinkGetUploadBufferUsedSize(IN LinkTsMuxUploader *pTsMuxUploader);
+//上传队列统计的快照，可以在监控线程里调用，不会阻塞推流
+int LinkGetUploadStatInfo(IN LinkTsMuxUploader *pTsMuxUploader, OUT LinkUploaderStatInfo *pStatInfo);
 void LinkSetNewSegmentInterval(IN LinkTsMuxUploader *pTsMuxUploader, IN int nIntervalSecond);
+//SDK自己分析NAL识别IDR/IRAP，nIsKeyFrame可以传0。每个分片开头的关键帧会补上缓存的sps/pps(vps)
 int LinkPushVideo(IN LinkTsMuxUploader *pTsMuxUploader, IN char * pData, IN int nDataLen, IN int64_t nTimestamp, IN int nIsKeyFrame, IN int nIsSegStart);
 int LinkPushAudio(IN LinkTsMuxUploader *pTsMuxUploader, IN char * pData, IN int nDataLen, IN int64_t nTimestamp);
+//nProgram为0时和LinkPushVideo/LinkPushAudio一样
+int LinkPushProgramVideo(IN LinkTsMuxUploader *pTsMuxUploader, IN int nProgram, IN char * pData, IN int nDataLen, IN int64_t nTimestamp, IN int nIsKeyFrame);
+int LinkPushProgramAudio(IN LinkTsMuxUploader *pTsMuxUploader, IN int nProgram, IN char * pData, IN int nDataLen, IN int64_t nTimestamp);
+//移动侦测/ai事件等，LinkUserUploadArg.nWithMetadata打开时可用。不是id3 tag的数据包成id3 PRIV帧，
+//随分片一起上传，不用每个事件单独发http请求。nTimestamp和音视频同一个时钟，最多16KB
+int LinkPushMetadata(IN LinkTsMuxUploader *pTsMuxUploader, IN char * pData, IN int nDataLen, IN int64_t nTimestamp);
+int LinkPushProgramMetadata(IN LinkTsMuxUploader *pTsMuxUploader, IN int nProgram, IN char * pData, IN int nDataLen, IN int64_t nTimestamp);
+//改分辨率、编码格式(h264/h265)或者音频格式时不用销毁重建。之后push的就是新格式，从下一个关键帧开始新的分片，
+//pmt的version加1。关键帧之前的新格式视频帧(音频格式变了的话还有音频帧)会丢掉
+int LinkReconfigureMedia(IN LinkTsMuxUploader *pTsMuxUploader, IN LinkMediaArg *pAvArg);
+int LinkReconfigureProgramMedia(IN LinkTsMuxUploader *pTsMuxUploader, IN int nProgram, IN LinkMediaArg *pAvArg);
 void LinkDestroyAVUploader(IN OUT LinkTsMuxUploader **pTsMuxUploader);
 void LinkUninitUploader();
+//所有上传实例最多同时占用多少块上传buffer(每个分片一块，上传完归还复用)，0表示不限制
+void LinkSetUploadBufferPoolLimit(IN int nMaxCount);
+//上传buffer满了(网络慢)时把数据暂存到pDir(SD卡或者tmpfs)下，每个分片最多nMaxSize字节，不丢数据。pDir为NULL关闭。
+//暂存文件在分片之间复用，不是每个分片都新建
+int LinkSetUploadSpillDir(IN const char *pDir, IN int nMaxSize);
+//常驻上传线程池，LinkInitUploader之前调用。至少nWorkerCount个线程(默认2)。busyPolicy默认LINK_UPLOAD_BUSY_WAIT，
+//线程数是流数加1，最多8个(nWorkerCount更大时以它为准)，都在忙时最多排队nPendingCount个分片(默认4)。
+//LINK_UPLOAD_BUSY_DROP线程数固定，都在忙时直接丢。LINK_UPLOAD_BUSY_SPAWN每个上传实例一个线程，不限制。
+//线程在创建流或实例时加，不在push的线程里；多出来的线程空闲30秒退出。nStackSize是线程栈大小(默认512K)，0用系统默认
+int LinkSetUploadWorkerPool(IN int nWorkerCount, IN int nPendingCount, IN int nStackSize, IN LinkUploadBusyPolicy busyPolicy);
 
 
 #endif
@@ -1,12 +1,16 @@
 #include <qiniu/io.h>
 #include <qiniu/rs.h>
 #include "uploader.h"
+#include "resource.h"
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <errno.h>
 #include "servertime.h"
+#include "spscqueue.h"
+#include "simd.h"
 #include <time.h>
 #include <curl/curl.h>
 #ifdef __ARM
@@ -16,15 +20,68 @@
 size_t getDataCallback(void* buffer, size_t size, size_t n, void* rptr);
 
 #define TS_DIVIDE_LEN 4096
+//上传线程等数据时，攒够这么多再唤醒，不用每个ts包唤醒一次。不够的时候最多等1秒(getNoOverwriteTimeout)
+#define UPLOAD_WAKEUP_THRESHOLD (188 * 32)
 
-enum WaitFirstFlag {
-        WF_INIT,
-        WF_LOCKED,
-        WF_FIRST,
-        WF_QUIT,
+//所有上传队列共用的磁盘spill配置，目录为空表示不用
+static char gSpillDir[256];
+static int gSpillSize;
+
+#define UPLOAD_POOL_WORKERS 2
+#define UPLOAD_POOL_PENDING 4
+#define UPLOAD_POOL_STACK_SIZE (512 * 1024)
+//LINK_UPLOAD_BUSY_WAIT时按流数加线程的上限
+#define UPLOAD_POOL_MAX_WORKERS 8
+//常驻上传线程空闲超过这么多秒就不再用旧连接，服务端可能已经关了。流式上传的数据没法重发，不能靠curl重连。
+//超过目标数的线程空闲这么久就退出
+#define UPLOAD_KEEPALIVE_IDLE 30
+//磁盘上还有数据时，完全没有进度这么多秒才断开上传
+#define UPLOAD_SPILL_STALL_TIMEOUT 60
+
+enum UploadTaskState {
+        TASK_NONE,
+        TASK_PENDING,
+        TASK_RUNNING,
+        TASK_DONE,
+};
+
+typedef struct _KodoUploader KodoUploader;
+
+//常驻的上传线程。分片有了第一个数据才交给线程，线程上传完一个分片再取下一个
+typedef struct _UploadPool {
+        pthread_mutex_t mutex;
+        pthread_cond_t taskCond; //有新分片或者要退出，启动时改成单调时钟
+        pthread_cond_t doneCond; //有分片上传结束
+        pthread_cond_t exitCond; //有线程退出
+        KodoUploader *pPendingHead; //排队的分片，用KodoUploader的pNextPending_串起来
+        KodoUploader *pPendingTail;
+        int nPendingLen;
+        int nStartedWorkers; //能取分片的线程数
+        int nLiveWorkers; //还没结束的线程数，线程是detach的，停止时等它变成0
+        int nBusy;
+        int nQuit;
+        int nIsStarted;
+        int nUploaders; //还没销毁的上传实例数(包括备用的)，LINK_UPLOAD_BUSY_SPAWN时线程数不少于它
+        int nStreams; //还没销毁的流(LinkTsMuxUploader)数，LINK_UPLOAD_BUSY_WAIT时按它加线程
+        
+        int nWorkerCount;
+        int nPendingCount; //所有线程都忙的时候最多排队的分片数
+        int nStackSize; //0是系统默认
+        LinkUploadBusyPolicy busyPolicy;
+}UploadPool;
+
+static UploadPool gPool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .taskCond = PTHREAD_COND_INITIALIZER,
+        .doneCond = PTHREAD_COND_INITIALIZER,
+        .exitCond = PTHREAD_COND_INITIALIZER,
+        .nWorkerCount = UPLOAD_POOL_WORKERS,
+        .nPendingCount = UPLOAD_POOL_PENDING,
+        .nStackSize = UPLOAD_POOL_STACK_SIZE,
+        .busyPolicy = LINK_UPLOAD_BUSY_WAIT,
 };
 
-typedef struct _KodoUploader{
+struct _KodoUploader{
         LinkTsUploader uploader;
 #ifdef LINK_STREAM_UPLOAD
         LinkCircleQueue * pQueue_;
@@ -33,8 +90,12 @@ typedef struct _KodoUploader{
         int nTsDataCap;
         int nTsDataLen;
 #endif
-        pthread_t workerId_;
-        int isThreadStarted_;
+        int nIsStarted_; //调用过UploadStart
+        int nIsSubmitted_; //已经交给上传线程，只在push的线程里读写
+        int64_t nFirstDataTime_; //第一个数据push进来的时间，分片的key用它。交给线程以后不再改
+        enum UploadTaskState nTaskState_; //gPool.mutex保护
+        KodoUploader *pNextPending_; //gPool.mutex保护
+        LinkAsyncInterface *pRecycle_; //上传结束后要执行的任务，gPool.mutex保护
         
         LinkUploadArg uploadArg;
         
@@ -46,11 +107,17 @@ typedef struct _KodoUploader{
         curl_off_t nLastUlnow;
         int64_t nUlnowRecTime;
         int nLowSpeedCnt;
-        int isTimeoutWithData;
+        int nStallCnt; //ulnow多少秒没有变了
+        
+        int nQueueCap_;
+        int nDropUntilIdr_;
+        int nDroppedFrames_;
+        int64_t nDroppedFrameBytes_;
         
-        pthread_mutex_t waitFirstMutex_;
-        enum WaitFirstFlag nWaitFirstMutexLocked_;
-}KodoUploader;
+        char *pInit_; //fmp4的init segment
+        int nInitLen_;
+        uint32_t nInitCrc_;
+};
 
 static struct timespec tmResolution;
 int timeoutCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
@@ -75,9 +142,23 @@ int timeoutCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_of
         
         int nDiff = (int)((nNow - pUploader->nUlnowRecTime) / 1000000000);
         if (nDiff > 0) {
+                pUploader->nStallCnt = ulnow == pUploader->nLastUlnow ? pUploader->nStallCnt + nDiff : 0;
+                //写过磁盘说明网络比推流慢，这时断开写过磁盘的数据就全丢了。只要还在传就不断开
+                LinkUploaderStatInfo info;
+                pUploader->pQueue_->GetStatInfo(pUploader->pQueue_, &info);
+                if (info.nIsSpilled_) {
+                        if (pUploader->nStallCnt > UPLOAD_SPILL_STALL_TIMEOUT) {
+                                LinkLogError("upload stalled with spilled data:%d %d", pUploader->nStallCnt, info.nSpillLen_);
+                                return -1;
+                        }
+                        pUploader->nLowSpeedCnt = 0;
+                        pUploader->nLastUlnow = ulnow;
+                        pUploader->nUlnowRecTime = nNow;
+                        return 0;
+                }
                 //printf("%d,==========dltotal:%lld dlnow:%lld ultotal:%lld ulnow-reculnow=%lld, now - lastrectime=%lld\n",
                 //       pUploader->nLowSpeedCnt, dltotal, dlnow, ultotal, ulnow - pUploader->nLastUlnow, (nNow - pUploader->nUlnowRecTime)/1000000);
-                if ((ulnow - pUploader->nLastUlnow) / nDiff < 1024) { //} && !pUploader->isTimeoutWithData) {
+                if ((ulnow - pUploader->nLastUlnow) / nDiff < 1024) {
                         pUploader->nLowSpeedCnt += nDiff;
                         if (pUploader->nLowSpeedCnt > 3) {
                                 LinkLogError("accumulate upload timeout:%d %d", pUploader->nLowSpeedCnt, nDiff);
@@ -224,19 +305,36 @@ static int getExpireDays(char * pToken)
         return atoi(days);
 }
 
+//init和分片用一样的key格式，startts就是segment id，这样在segment里排在最前面
+static void uploadInitSegment(KodoUploader *pUploader, Qiniu_Client *pClient, const char *uptoken, int64_t nSegmentId, int nDeleteAfterDays)
+{
+        char key[128] = {0};
+        Qiniu_Io_PutRet putRet;
+        Qiniu_Io_PutExtra putExtra;
+        Qiniu_Zero(putExtra);
+        
+        sprintf(key, "ts/%s/%lld/%lld/%d.mp4", pUploader->uploadArg.pDeviceId_,
+                (long long)(nSegmentId / 1000000), (long long)(nSegmentId / 1000000), nDeleteAfterDays);
+        Qiniu_Error error = Qiniu_Io_PutBuffer(pClient, &putRet, uptoken, key, pUploader->pInit_, pUploader->nInitLen_, &putExtra);
+        //614是文件已经存在，另一个分片的上传线程已经传过了
+        if (error.code != 200 && error.code != 614) {
+                LinkLogError("upload init segment:%s httpcode=%d errmsg=%s", key, error.code, Qiniu_Buffer_CStr(&pClient->b));
+                pUploader->uploadArg.InitSegmentClaim(pUploader->uploadArg.pUploadArgKeeper_, nSegmentId, 0);
+                return;
+        }
+        LinkLogDebug("upload init segment size:%d key:%s success", pUploader->nInitLen_, key);
+}
+
 #ifdef MULTI_SEG_TEST
 static int newSegCount = 0;
 #endif
-static void * streamUpload(void *_pOpaque)
+//pClient由调用的线程持有，连续的分片复用同一个curl handle，连接和tls session不用每次重建
+static void streamUpload(KodoUploader * pUploader, Qiniu_Client *pClient)
 {
-        KodoUploader * pUploader = (KodoUploader *)_pOpaque;
-        
         char *uptoken = NULL;
-        Qiniu_Client client;
         int canFreeToken = 0;
         
         uptoken = pUploader->uploadArg.pToken_;
-        Qiniu_Client_InitNoAuth(&client, 1024);
         
         Qiniu_Io_PutRet putRet;
         Qiniu_Io_PutExtra putExtra;
@@ -285,16 +383,8 @@ static void * streamUpload(void *_pOpaque)
         
         char key[128] = {0};
         
-        // wait for first packet
-        if (pUploader->nWaitFirstMutexLocked_ == WF_LOCKED) {
-                pthread_mutex_lock(&pUploader->waitFirstMutex_);
-                pthread_mutex_unlock(&pUploader->waitFirstMutex_);
-        }
-        if (pUploader->nWaitFirstMutexLocked_ != WF_FIRST) {
-                goto END;
-        }
-        
-        int64_t curTime = LinkGetCurrentNanosecond();
+        //线程池忙的时候分片可能排了一会儿队，用第一个数据进来的时间，不用现在的时间
+        int64_t curTime = pUploader->nFirstDataTime_;
         // ts/uid/ua_id/yyyy/mm/dd/hh/mm/ss/mmm/fragment_start_ts/expiry.ts
         
         if (pUploader->uploadArg.nSegmentId_ == 0) {
@@ -307,17 +397,22 @@ static void * streamUpload(void *_pOpaque)
         uint64_t nSegmentId = pUploader->uploadArg.nSegmentId_;
         
         int nDeleteAfterDays_ = getExpireDays(uptoken);
+        if (pUploader->pInit_ && pUploader->uploadArg.InitSegmentClaim &&
+            pUploader->uploadArg.InitSegmentClaim(pUploader->uploadArg.pUploadArgKeeper_, nSegmentId, pUploader->nInitCrc_)) {
+                uploadInitSegment(pUploader, pClient, uptoken, nSegmentId, nDeleteAfterDays_);
+        }
         memset(key, 0, sizeof(key));
         //ts/uaid/startts/fragment_start_ts/expiry.ts
-        sprintf(key, "ts/%s/%lld/%lld/%d.ts", pUploader->uploadArg.pDeviceId_,
-                curTime / 1000000, nSegmentId / 1000000, nDeleteAfterDays_);
+        sprintf(key, "ts/%s/%lld/%lld/%d.%s", pUploader->uploadArg.pDeviceId_,
+                curTime / 1000000, nSegmentId / 1000000, nDeleteAfterDays_,
+                pUploader->uploadArg.nContainerFormat_ == LINK_CONTAINER_FMP4 ? "m4s" : "ts");
         LinkLogDebug("upload start:%s q:%p", key, pUploader->pQueue_);
 #ifdef LINK_STREAM_UPLOAD
-        client.xferinfoData = _pOpaque;
-        client.xferinfoCb = timeoutCallback;
-        Qiniu_Error error = Qiniu_Io_PutStream(&client, &putRet, uptoken, key, pUploader, -1, getDataCallback, &putExtra);
+        pClient->xferinfoData = pUploader;
+        pClient->xferinfoCb = timeoutCallback;
+        Qiniu_Error error = Qiniu_Io_PutStream(pClient, &putRet, uptoken, key, pUploader, -1, getDataCallback, &putExtra);
 #else
-        Qiniu_Error error = Qiniu_Io_PutBuffer(&client, &putRet, uptoken, key, (const char*)pUploader->pTsData,
+        Qiniu_Error error = Qiniu_Io_PutBuffer(pClient, &putRet, uptoken, key, (const char*)pUploader->pTsData,
                                                pUploader->nTsDataLen, &putExtra);
 #endif
         
@@ -327,9 +422,9 @@ static void * streamUpload(void *_pOpaque)
         if (error.code != 200) {
                 pUploader->state = LINK_UPLOAD_FAIL;
                 if (error.code == 401) {
-                        LinkLogError("upload file :%s expsize:%lld httpcode=%d errmsg=%s", key, pUploader->getDataBytes, error.code, Qiniu_Buffer_CStr(&client.b));
+                        LinkLogError("upload file :%s expsize:%lld httpcode=%d errmsg=%s", key, pUploader->getDataBytes, error.code, Qiniu_Buffer_CStr(&pClient->b));
                 } else if (error.code >= 500) {
-                        const char * pFullErrMsg = Qiniu_Buffer_CStr(&client.b);
+                        const char * pFullErrMsg = Qiniu_Buffer_CStr(&pClient->b);
                         char errMsg[256];
                         char *pMsg = getErrorMsg(pFullErrMsg, errMsg, sizeof(errMsg));
                         if (pMsg) {
@@ -346,102 +441,462 @@ static void * streamUpload(void *_pOpaque)
                                 LinkLogError("upload file :%s expsize:%lld errorcode=%d errmsg={\"error\":\"unknown error\"}", key, pUploader->getDataBytes, error.code);
                         }
                 }
-                //debug_log(&client, error);
+                //debug_log(pClient, error);
         } else {
                 pUploader->state = LINK_UPLOAD_OK;
                 LinkLogDebug("upload file size:(exp:%lld real:%lld) key:%s success",
                          pUploader->getDataBytes, pUploader->nLastUlnow, key);
         }
-END:
         if (canFreeToken) {
                 Qiniu_Free(uptoken);
         }
-        Qiniu_Client_Cleanup(&client);
-        
-        return NULL;
 }
 
 #ifdef LINK_STREAM_UPLOAD
 size_t getDataCallback(void* buffer, size_t size, size_t n, void* rptr)
 {
         KodoUploader * pUploader = (KodoUploader *) rptr;
-        int nPopLen = 0;
-        if (pUploader->isTimeoutWithData != 0) {
-                pUploader->isTimeoutWithData++;
-                LinkLogInfo("isTimeoutWithData:%d\n", pUploader->isTimeoutWithData);;
-                return 0;
-        }
-        nPopLen = pUploader->pQueue_->PopWithNoOverwrite(pUploader->pQueue_, buffer, size * n);
-        if (nPopLen < 0) {
-                if (nPopLen == LINK_TIMEOUT) {
+        LinkQueueSpan spans[2];
+        int nLen = pUploader->pQueue_->PeekWithNoOverwrite(pUploader->pQueue_, spans);
+        if (nLen < 0) {
+                if (nLen == LINK_TIMEOUT) {
                         if (pUploader->nLastFrameTimestamp >= 0 &&  pUploader->nFirstFrameTimestamp >= 0) {
                                 return 0;
                         }
-                        LinkLogError("first pop from queue timeout:%d %lld %lld", nPopLen, pUploader->nLastFrameTimestamp, pUploader->nFirstFrameTimestamp);
+                        LinkLogError("first pop from queue timeout:%d %lld %lld", nLen, pUploader->nLastFrameTimestamp, pUploader->nFirstFrameTimestamp);
                 }
                 return CURL_READFUNC_ABORT;
         }
-        if (nPopLen == 0) {
+        if (nLen == 0) {
                 if (LinkIsProcStatusQuit()) {
                         return CURL_READFUNC_ABORT;
                 }
                 return 0;
         }
         
-        int nTmp = 0;
-        char *pBuf = (char *)buffer;
-        while (size * n - nPopLen > 0) {
-                nTmp = pUploader->pQueue_->PopWithNoOverwrite(pUploader->pQueue_, pBuf + nPopLen, size * n - nPopLen);
-                if (nTmp == 0)
-                        break;
-                if (nTmp < 0) {
-                        if (nTmp == LINK_TIMEOUT) {
-                                if (pUploader->nLastFrameTimestamp >= 0 &&  pUploader->nFirstFrameTimestamp >= 0) {
-                                        pUploader->isTimeoutWithData = 1;
-                                        goto RET;
-                                }
-                                LinkLogError("next pop from queue timeout:%d %lld %lld", nTmp, pUploader->nLastFrameTimestamp, pUploader->nFirstFrameTimestamp);
-                        }
-                        return CURL_READFUNC_ABORT;
+        //有多少给curl多少，最多两次拷贝
+        int nBufLen = size * n;
+        int nPopLen = 0;
+        int i = 0;
+        for (i = 0; i < 2 && nPopLen < nBufLen; i++) {
+                int nCopyLen = spans[i].nLen;
+                if (nCopyLen > nBufLen - nPopLen) {
+                        nCopyLen = nBufLen - nPopLen;
+                }
+                if (nCopyLen > 0) {
+                        memcpy((char *)buffer + nPopLen, spans[i].pData, nCopyLen);
+                        nPopLen += nCopyLen;
                 }
-                nPopLen += nTmp;
         }
-        LinkUploaderStatInfo info;
-        pUploader->pQueue_->GetStatInfo(rptr, &info);
-RET:
+        pUploader->pQueue_->Consume(pUploader->pQueue_, nPopLen);
+        
         pUploader->getDataBytes += nPopLen;
         return nPopLen;
 }
 
-static int streamUploadStart(LinkTsUploader * _pUploader)
+static void runRecycle(LinkAsyncInterface *_pAsync)
 {
-        KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
-        int ret = pthread_create(&pKodoUploader->workerId_, NULL, streamUpload, _pUploader);
-        if (ret == 0) {
-                pKodoUploader->isThreadStarted_ = 1;
-                return LINK_SUCCESS;
+        //资源管理线程已经停了就在当前线程执行，上传已经结束，不会等网络
+        if (LinkPushFunction(_pAsync) < 0) {
+                _pAsync->function(_pAsync);
+        }
+}
+
+//之后_pUploader随时可能被销毁，不能再用
+static void finishUpload(KodoUploader * _pUploader)
+{
+        pthread_mutex_lock(&gPool.mutex);
+        _pUploader->nTaskState_ = TASK_DONE;
+        LinkAsyncInterface *pRecycle = _pUploader->pRecycle_;
+        _pUploader->pRecycle_ = NULL;
+        pthread_cond_broadcast(&gPool.doneCond);
+        pthread_mutex_unlock(&gPool.mutex);
+        if (pRecycle) {
+                runRecycle(pRecycle);
+        }
+}
+
+static int64_t getMonotonicSecond()
+{
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return (int64_t)tp.tv_sec;
+}
+
+//在gPool.mutex里调用
+static int getTargetWorkers()
+{
+        int nTarget = gPool.nWorkerCount;
+        if (gPool.busyPolicy == LINK_UPLOAD_BUSY_SPAWN) {
+                if (gPool.nUploaders > nTarget) {
+                        nTarget = gPool.nUploaders;
+                }
+        } else if (gPool.busyPolicy == LINK_UPLOAD_BUSY_WAIT) {
+                //每路流一个，再多一个给切分片时还没传完的上一个分片
+                int nPerStream = gPool.nStreams + 1;
+                if (nPerStream > UPLOAD_POOL_MAX_WORKERS) {
+                        nPerStream = UPLOAD_POOL_MAX_WORKERS;
+                }
+                if (nPerStream > nTarget) {
+                        nTarget = nPerStream;
+                }
+        }
+        return nTarget;
+}
+
+static void * uploadWorker(void *_pOpaque)
+{
+        //每个常驻线程一个client，curl_easy_reset不会断开连接，也会保留dns缓存和tls session
+        Qiniu_Client client;
+        int nIsClientInited = 0;
+        int64_t nLastUploadTime = 0;
+        
+        pthread_mutex_lock(&gPool.mutex);
+        while (1) {
+                struct timespec idleDeadline;
+                LinkGetCondDeadline(&idleDeadline, UPLOAD_KEEPALIVE_IDLE * 1000000LL);
+                int nIsIdleExit = 0;
+                while (!gPool.nQuit && gPool.nPendingLen == 0 && !nIsIdleExit) {
+                        if (gPool.nStartedWorkers <= getTargetWorkers()) {
+                                pthread_cond_wait(&gPool.taskCond, &gPool.mutex);
+                                continue;
+                        }
+                        //流少了或者SPAWN时上传实例少了，多出来的线程空闲一段时间就退出
+                        if (pthread_cond_timedwait(&gPool.taskCond, &gPool.mutex, &idleDeadline) == ETIMEDOUT) {
+                                nIsIdleExit = gPool.nStartedWorkers > getTargetWorkers();
+                        }
+                }
+                //退出前把排队的分片传完，等着它们的UploadStop才能返回
+                if (gPool.nPendingLen == 0) {
+                        gPool.nStartedWorkers--;
+                        break;
+                }
+                KodoUploader *pUploader = gPool.pPendingHead;
+                gPool.pPendingHead = pUploader->pNextPending_;
+                if (gPool.pPendingHead == NULL) {
+                        gPool.pPendingTail = NULL;
+                }
+                pUploader->pNextPending_ = NULL;
+                gPool.nPendingLen--;
+                pUploader->nTaskState_ = TASK_RUNNING;
+                gPool.nBusy++;
+                pthread_mutex_unlock(&gPool.mutex);
+                
+                if (nIsClientInited && getMonotonicSecond() - nLastUploadTime > UPLOAD_KEEPALIVE_IDLE) {
+                        Qiniu_Client_Cleanup(&client);
+                        nIsClientInited = 0;
+                }
+                if (!nIsClientInited) {
+                        Qiniu_Client_InitNoAuth(&client, 1024);
+                        nIsClientInited = 1;
+                }
+                streamUpload(pUploader, &client);
+                nLastUploadTime = getMonotonicSecond();
+                
+                pthread_mutex_lock(&gPool.mutex);
+                gPool.nBusy--;
+                pthread_mutex_unlock(&gPool.mutex);
+                finishUpload(pUploader);
+                pthread_mutex_lock(&gPool.mutex);
+        }
+        pthread_mutex_unlock(&gPool.mutex);
+        if (nIsClientInited) {
+                Qiniu_Client_Cleanup(&client);
+        }
+        
+        pthread_mutex_lock(&gPool.mutex);
+        gPool.nLiveWorkers--;
+        pthread_cond_broadcast(&gPool.exitCond);
+        pthread_mutex_unlock(&gPool.mutex);
+        return NULL;
+}
+
+//在gPool.mutex里调用
+static int addUploadWorker()
+{
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (gPool.nStackSize > 0) {
+                pthread_attr_setstacksize(&attr, gPool.nStackSize);
+        }
+        pthread_t worker;
+        int ret = pthread_create(&worker, &attr, uploadWorker, NULL);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+                LinkLogError("start upload worker fail:%d", ret);
+                return LINK_THREAD_ERROR;
+        }
+        gPool.nStartedWorkers++;
+        gPool.nLiveWorkers++;
+        return LINK_SUCCESS;
+}
+
+//在gPool.mutex里调用。多出来的线程自己空闲退出，这里只加不减
+static void growUploadWorkers()
+{
+        if (gPool.nIsStarted && !gPool.nQuit) {
+                int nTarget = getTargetWorkers();
+                while (gPool.nStartedWorkers < nTarget && addUploadWorker() == LINK_SUCCESS) {
+                }
+        }
+}
+
+//在创建上传实例的线程(资源管理线程，或者第一个分片时的push线程)里加线程，push数据时不会起线程
+static void addUploader()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        gPool.nUploaders++;
+        growUploadWorkers();
+        pthread_mutex_unlock(&gPool.mutex);
+}
+
+//在gPool.mutex里调用。线程多了叫醒空闲的线程，让它们开始计时退出
+static void shrinkUploadWorkers()
+{
+        if (gPool.nStartedWorkers > getTargetWorkers()) {
+                pthread_cond_broadcast(&gPool.taskCond);
+        }
+}
+
+static void removeUploader()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        gPool.nUploaders--;
+        shrinkUploadWorkers();
+        pthread_mutex_unlock(&gPool.mutex);
+}
+
+void LinkAddUploaderStream()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        gPool.nStreams++;
+        growUploadWorkers();
+        pthread_mutex_unlock(&gPool.mutex);
+}
+
+void LinkRemoveUploaderStream()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        gPool.nStreams--;
+        shrinkUploadWorkers();
+        pthread_mutex_unlock(&gPool.mutex);
+}
+
+//分片有了第一个数据时在push的线程里调用
+static void submitUpload(KodoUploader * _pUploader)
+{
+        _pUploader->nIsSubmitted_ = 1;
+        
+        pthread_mutex_lock(&gPool.mutex);
+        _pUploader->nTaskState_ = TASK_PENDING;
+        int nIdle = gPool.nStartedWorkers - gPool.nBusy - gPool.nPendingLen;
+        int nIsRunning = gPool.nIsStarted && !gPool.nQuit;
+        //LINK_UPLOAD_BUSY_SPAWN时线程在创建上传实例时已经加够了，只有起线程失败或者多的线程刚退出才会排队
+        if (nIsRunning && (nIdle > 0 || gPool.busyPolicy == LINK_UPLOAD_BUSY_SPAWN ||
+                           (gPool.busyPolicy == LINK_UPLOAD_BUSY_WAIT && -nIdle < gPool.nPendingCount))) {
+                if (gPool.pPendingTail) {
+                        gPool.pPendingTail->pNextPending_ = _pUploader;
+                } else {
+                        gPool.pPendingHead = _pUploader;
+                }
+                gPool.pPendingTail = _pUploader;
+                gPool.nPendingLen++;
+                pthread_cond_signal(&gPool.taskCond);
+                pthread_mutex_unlock(&gPool.mutex);
+                return;
+        }
+        pthread_mutex_unlock(&gPool.mutex);
+        
+        if (nIsRunning) {
+                LinkLogWarn("all upload workers are busy. drop segment:%p", _pUploader);
         } else {
-                LinkLogError("start upload thread fail:%d", ret);
+                LinkLogError("upload pool not started. drop segment:%p", _pUploader);
+        }
+        //和上传失败一样处理，tsmuxuploader看到失败会马上切新的分片
+        _pUploader->state = LINK_UPLOAD_FAIL;
+        _pUploader->pQueue_->StopPush(_pUploader->pQueue_);
+        finishUpload(_pUploader);
+        return;
+}
+
+static void waitUploadDone(KodoUploader * _pUploader)
+{
+        if (!_pUploader->nIsSubmitted_) {
+                return;
+        }
+        pthread_mutex_lock(&gPool.mutex);
+        while (_pUploader->nTaskState_ != TASK_DONE) {
+                pthread_cond_wait(&gPool.doneCond, &gPool.mutex);
+        }
+        pthread_mutex_unlock(&gPool.mutex);
+        return;
+}
+
+static inline void onUploadData(KodoUploader * _pUploader)
+{
+        if (_pUploader->nFirstDataTime_ == 0) {
+                _pUploader->nFirstDataTime_ = LinkGetCurrentNanosecond();
+        }
+        if (_pUploader->nIsStarted_ && !_pUploader->nIsSubmitted_) {
+                submitUpload(_pUploader);
+        }
+}
+
+int LinkSetUploaderPool(int _nWorkerCount, int _nPendingCount, int _nStackSize, LinkUploadBusyPolicy _busyPolicy)
+{
+        if (_nWorkerCount < 1 || _nPendingCount < 0 || (_nStackSize != 0 && _nStackSize < 64 * 1024) ||
+            _busyPolicy < LINK_UPLOAD_BUSY_WAIT || _busyPolicy > LINK_UPLOAD_BUSY_SPAWN) {
+                return LINK_ARG_ERROR;
+        }
+        pthread_mutex_lock(&gPool.mutex);
+        if (gPool.nIsStarted) {
+                pthread_mutex_unlock(&gPool.mutex);
+                return LINK_Q_WRONGSTATE;
+        }
+        gPool.nWorkerCount = _nWorkerCount;
+        gPool.nPendingCount = _nPendingCount;
+        gPool.nStackSize = _nStackSize;
+        gPool.busyPolicy = _busyPolicy;
+        pthread_mutex_unlock(&gPool.mutex);
+        return LINK_SUCCESS;
+}
+
+int LinkStartUploaderPool()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        if (gPool.nIsStarted) {
+                pthread_mutex_unlock(&gPool.mutex);
+                return LINK_SUCCESS;
+        }
+        gPool.pPendingHead = NULL;
+        gPool.pPendingTail = NULL;
+        gPool.nPendingLen = 0;
+        gPool.nBusy = 0;
+        gPool.nQuit = 0;
+        //还没有线程在等，可以重建
+        pthread_cond_destroy(&gPool.taskCond);
+        if (LinkInitMonotonicCond(&gPool.taskCond) != 0) {
+                pthread_mutex_unlock(&gPool.mutex);
+                return LINK_COND_ERROR;
+        }
+        gPool.nIsStarted = 1;
+        growUploadWorkers();
+        if (gPool.nStartedWorkers == 0) {
+                gPool.nIsStarted = 0;
+                pthread_mutex_unlock(&gPool.mutex);
                 return LINK_THREAD_ERROR;
         }
+        pthread_mutex_unlock(&gPool.mutex);
+        return LINK_SUCCESS;
+}
+
+void LinkStopUploaderPool()
+{
+        pthread_mutex_lock(&gPool.mutex);
+        if (!gPool.nIsStarted) {
+                pthread_mutex_unlock(&gPool.mutex);
+                return;
+        }
+        gPool.nQuit = 1;
+        pthread_cond_broadcast(&gPool.taskCond);
+        while (gPool.nLiveWorkers > 0) {
+                pthread_cond_wait(&gPool.exitCond, &gPool.mutex);
+        }
+        gPool.nIsStarted = 0;
+        gPool.nQuit = 0;
+        pthread_mutex_unlock(&gPool.mutex);
+        return;
+}
+
+static int streamUploadStart(LinkTsUploader * _pUploader)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
+        pKodoUploader->nIsStarted_ = 1;
+        LinkUploaderStatInfo info;
+        pKodoUploader->pQueue_->GetStatInfo(pKodoUploader->pQueue_, &info);
+        if (info.nPushDataBytes_ > 0) {
+                onUploadData(pKodoUploader);
+        }
+        return LINK_SUCCESS;
 }
 
 static void streamUploadStop(LinkTsUploader * _pUploader)
 {
         KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
-        if(pKodoUploader->nWaitFirstMutexLocked_ == WF_LOCKED) {
-                pKodoUploader->nWaitFirstMutexLocked_ = WF_QUIT;
-                pthread_mutex_unlock(&pKodoUploader->waitFirstMutex_);
+        
+        pKodoUploader->pQueue_->StopPush(pKodoUploader->pQueue_);
+        waitUploadDone(pKodoUploader);
+        return;
+}
+
+static void streamRecycleWhenDone(LinkTsUploader * _pUploader, LinkAsyncInterface *_pAsync)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
+        
+        if (pKodoUploader->nIsSubmitted_) {
+                pthread_mutex_lock(&gPool.mutex);
+                if (pKodoUploader->nTaskState_ != TASK_DONE) {
+                        pKodoUploader->pRecycle_ = _pAsync;
+                        pthread_mutex_unlock(&gPool.mutex);
+                        return;
+                }
+                pthread_mutex_unlock(&gPool.mutex);
+        }
+        runRecycle(_pAsync);
+        return;
+}
+
+static int dropFrame(KodoUploader * pKodoUploader, LinkFrameType frameType, int nTsSize)
+{
+        if (pKodoUploader->nDroppedFrames_ == 0) {
+                LinkLogWarn("upload queue is almost full, start drop frame:%d %d", frameType, nTsSize);
         }
-        pthread_mutex_lock(&pKodoUploader->waitFirstMutex_);
-        pKodoUploader->nWaitFirstMutexLocked_ = WF_QUIT;
-        pthread_mutex_unlock(&pKodoUploader->waitFirstMutex_);
+        pKodoUploader->nDroppedFrames_++;
+        pKodoUploader->nDroppedFrameBytes_ += nTsSize;
+        return 0;
+}
+
+static int streamAdmitFrame(LinkTsUploader * _pUploader, LinkFrameType frameType, int nTsSize)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
         
-        if (pKodoUploader->isThreadStarted_) {
-                pKodoUploader->pQueue_->StopPush(pKodoUploader->pQueue_);
-                pthread_join(pKodoUploader->workerId_, NULL);
-                pKodoUploader->isThreadStarted_ = 0;
+        int nRemain = pKodoUploader->pQueue_->GetFreeSize(pKodoUploader->pQueue_) - nTsSize;
+        if (frameType == LINK_FRAME_VIDEO_IDR) {
+                if (nRemain < 0) {
+                        pKodoUploader->nDropUntilIdr_ = 1;
+                        return dropFrame(pKodoUploader, frameType, nTsSize);
+                }
+                pKodoUploader->nDropUntilIdr_ = 0;
+                return 1;
+        }
+        if (frameType != LINK_FRAME_AUDIO && pKodoUploader->nDropUntilIdr_) {
+                return dropFrame(pKodoUploader, frameType, nTsSize);
+        }
+        
+        //剩下不到1/4先丢非参考帧，不到1/8再丢音频，给参考帧留空间
+        if (frameType == LINK_FRAME_VIDEO_NONREF && nRemain < pKodoUploader->nQueueCap_ / 4) {
+                return dropFrame(pKodoUploader, frameType, nTsSize);
+        }
+        if (frameType == LINK_FRAME_AUDIO && nRemain < pKodoUploader->nQueueCap_ / 8) {
+                return dropFrame(pKodoUploader, frameType, nTsSize);
         }
+        if (nRemain < 0) {
+                //参考帧丢了后面的帧都解不了，一直丢到下一个IDR
+                if (frameType == LINK_FRAME_VIDEO_REF) {
+                        pKodoUploader->nDropUntilIdr_ = 1;
+                }
+                return dropFrame(pKodoUploader, frameType, nTsSize);
+        }
+        return 1;
+}
+
+static void streamEndSegment(LinkTsUploader * _pUploader)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)_pUploader;
+        
+        //队列变成只读，消费者读完剩下的数据后pop返回0，curl就结束了
+        pKodoUploader->pQueue_->StopPush(pKodoUploader->pQueue_);
         return;
 }
 
@@ -450,13 +905,56 @@ static int streamPushData(LinkTsUploader *pTsUploader, char * pData, int nDataLe
         KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
         
         int ret = pKodoUploader->pQueue_->Push(pKodoUploader->pQueue_, (char *)pData, nDataLen);
-        if (pKodoUploader->nWaitFirstMutexLocked_ == WF_LOCKED) {
-                pKodoUploader->nWaitFirstMutexLocked_ = WF_FIRST;
-                pthread_mutex_unlock(&pKodoUploader->waitFirstMutex_);
-        }
+        onUploadData(pKodoUploader);
+        return ret;
+}
+
+static int streamPushVecData(LinkTsUploader *pTsUploader, const struct iovec *pVec, int nVecCount)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
+        
+        int ret = pKodoUploader->pQueue_->PushVec(pKodoUploader->pQueue_, pVec, nVecCount);
+        onUploadData(pKodoUploader);
+        return ret;
+}
+
+static char * streamReserveData(LinkTsUploader *pTsUploader, int nDataLen)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
+        
+        return pKodoUploader->pQueue_->Reserve(pKodoUploader->pQueue_, nDataLen);
+}
+
+static int streamCommitData(LinkTsUploader *pTsUploader, int nDataLen)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
+        
+        int ret = pKodoUploader->pQueue_->Commit(pKodoUploader->pQueue_, nDataLen);
+        onUploadData(pKodoUploader);
         return ret;
 }
 
+static int streamSetInitSegment(LinkTsUploader *pTsUploader, const char *pData, int nDataLen)
+{
+        KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
+        
+        char *pInit = (char *)malloc(nDataLen);
+        if (pInit == NULL) {
+                return LINK_NO_MEMORY;
+        }
+        memcpy(pInit, pData, nDataLen);
+        if (pKodoUploader->pInit_) {
+                free(pKodoUploader->pInit_);
+        }
+        pKodoUploader->pInit_ = pInit;
+        pKodoUploader->nInitLen_ = nDataLen;
+        pKodoUploader->nInitCrc_ = LinkSimdCrc32(0, pData, nDataLen);
+        if (pKodoUploader->nInitCrc_ == 0) {
+                pKodoUploader->nInitCrc_ = 1; //0表示取消
+        }
+        return LINK_SUCCESS;
+}
+
 #else
 
 static int memUploadStart(TsUploader * _pUploader)
@@ -497,9 +995,10 @@ static void getStatInfo(LinkTsUploader *pTsUploader, LinkUploaderStatInfo *_pSta
         KodoUploader * pKodoUploader = (KodoUploader *)pTsUploader;
 #ifdef LINK_STREAM_UPLOAD
         pKodoUploader->pQueue_->GetStatInfo(pKodoUploader->pQueue_, _pStatInfo);
+        _pStatInfo->nDropped += pKodoUploader->nDroppedFrameBytes_;
 #else
-        _pStatInfo->nLen_ = 0;
-        _pStatInfo->nPopDataBytes_ = pKodoUploader->nTsDataLen;
+        memset(_pStatInfo, 0, sizeof(LinkUploaderStatInfo));
+        _pStatInfo->nPushDataBytes_ = pKodoUploader->nTsDataLen;
         _pStatInfo->nPopDataBytes_ = pKodoUploader->nTsDataLen;
 #endif
         return;
@@ -531,19 +1030,19 @@ int LinkNewUploader(LinkTsUploader ** _pUploader, LinkUploadArg *_pArg, enum Cir
         
         memset(pKodoUploader, 0, sizeof(KodoUploader));
         
-        int ret = pthread_mutex_init(&pKodoUploader->waitFirstMutex_, NULL);
-        if (ret != 0){
-                free(pKodoUploader);
-                return LINK_MUTEX_ERROR;
-        }
-        pthread_mutex_lock(&pKodoUploader->waitFirstMutex_);
-        pKodoUploader->nWaitFirstMutexLocked_ = WF_LOCKED;
+        int ret = 0;
 #ifdef LINK_STREAM_UPLOAD
-        ret = LinkNewCircleQueue(&pKodoUploader->pQueue_, 0, _policy, _nMaxItemLen, _nInitItemCount);
+        if (gSpillDir[0] != 0 && gSpillSize > 0) {
+                ret = LinkNewSpillQueue(&pKodoUploader->pQueue_, 0, _policy, _nMaxItemLen, _nInitItemCount, gSpillDir, gSpillSize);
+        } else {
+                ret = LinkNewCircleQueue(&pKodoUploader->pQueue_, 0, _policy, _nMaxItemLen, _nInitItemCount, TSQ_BYTE_STREAM);
+        }
         if (ret != 0) {
                 free(pKodoUploader);
                 return ret;
         }
+        pKodoUploader->nQueueCap_ = _nMaxItemLen * _nInitItemCount;
+        pKodoUploader->pQueue_->SetWakeupThreshold(pKodoUploader->pQueue_, UPLOAD_WAKEUP_THRESHOLD);
 #else
         pKodoUploader->nTsDataCap = 1024 * 1024;
 #endif
@@ -554,6 +1053,14 @@ int LinkNewUploader(LinkTsUploader ** _pUploader, LinkUploadArg *_pArg, enum Cir
         pKodoUploader->uploader.UploadStart = streamUploadStart;
         pKodoUploader->uploader.UploadStop = streamUploadStop;
         pKodoUploader->uploader.Push = streamPushData;
+        pKodoUploader->uploader.PushVec = streamPushVecData;
+        pKodoUploader->uploader.Reserve = streamReserveData;
+        pKodoUploader->uploader.Commit = streamCommitData;
+        pKodoUploader->uploader.EndSegment = streamEndSegment;
+        pKodoUploader->uploader.AdmitFrame = streamAdmitFrame;
+        pKodoUploader->uploader.SetInitSegment = streamSetInitSegment;
+        pKodoUploader->uploader.RecycleWhenDone = streamRecycleWhenDone;
+        addUploader();
 #else
         pKodoUploader->uploader.UploadStart = memUploadStart;
         pKodoUploader->uploader.UploadStop = memUploadStop;
@@ -568,16 +1075,36 @@ int LinkNewUploader(LinkTsUploader ** _pUploader, LinkUploadArg *_pArg, enum Cir
         return LINK_SUCCESS;
 }
 
+int LinkSetUploaderSpill(const char *_pDir, int _nSize)
+{
+        if (_pDir == NULL || _nSize <= 0) {
+                gSpillDir[0] = 0;
+                gSpillSize = 0;
+                LinkCleanSpillPool();
+                return LINK_SUCCESS;
+        }
+        int nLen = strlen(_pDir);
+        if (nLen >= sizeof(gSpillDir)) {
+                return LINK_ARG_TOO_LONG;
+        }
+        memcpy(gSpillDir, _pDir, nLen + 1);
+        gSpillSize = _nSize;
+        //缓存的文件可能在旧目录下
+        LinkCleanSpillPool();
+        return LINK_SUCCESS;
+}
+
 void LinkDestroyUploader(LinkTsUploader ** _pUploader)
 {
         KodoUploader * pKodoUploader = (KodoUploader *)(*_pUploader);
         
-        pthread_mutex_destroy(&pKodoUploader->waitFirstMutex_);
 #ifdef LINK_STREAM_UPLOAD
-        if (pKodoUploader->isThreadStarted_) {
-                pthread_join(pKodoUploader->workerId_, NULL);
-        }
+        waitUploadDone(pKodoUploader);
+        removeUploader();
         LinkDestroyQueue(&pKodoUploader->pQueue_);
+        if (pKodoUploader->pInit_) {
+                free(pKodoUploader->pInit_);
+        }
 #else
         free(pKodoUploader->pTsData);
 #endif
@@ -7,6 +7,8 @@
 #include "base.h"
 
 typedef void (*LinkUploadArgUpadater)(void *pOpaque, void* pUploadArg, int64_t nNow);
+//fmp4的init segment每个segment只传一次。返回1表示还没有传过，由调用者上传；上传失败时nInitCrc传0取消
+typedef int (*LinkInitSegmentClaimer)(void *pOpaque, int64_t nSegmentId, uint32_t nInitCrc);
 
 typedef struct _UploadArg {
         char    *pToken_;
@@ -16,9 +18,20 @@ typedef struct _UploadArg {
         int64_t nSegmentId_;
         int64_t nLastUploadTsTime_;
         LinkUploadArgUpadater UploadArgUpadate;
+        LinkContainerFormat nContainerFormat_; //决定分片的扩展名
+        LinkInitSegmentClaimer InitSegmentClaim;
 }LinkUploadArg;
 
+//队列快满的时候按这个顺序丢整帧：非参考帧，音频，参考帧(丢了要一直丢到下一个IDR)
+typedef enum {
+        LINK_FRAME_AUDIO,
+        LINK_FRAME_VIDEO_IDR,
+        LINK_FRAME_VIDEO_REF,
+        LINK_FRAME_VIDEO_NONREF,
+} LinkFrameType;
+
 typedef struct _LinkTsUploader LinkTsUploader;
+struct _LinkAsyncInterface;
 typedef int (*StreamUploadStart)(LinkTsUploader* pUploader);
 typedef void (*StreamUploadStop)(LinkTsUploader*);
 
@@ -27,12 +40,37 @@ typedef struct _LinkTsUploader{
         StreamUploadStop UploadStop;
         LinkUploadState (*GetUploaderState)(LinkTsUploader *pTsUploader);
         int(*Push)(LinkTsUploader *pTsUploader, char * pData, int nDataLen);
+        //几段数据直接拷到队列里，可以为NULL
+        int(*PushVec)(LinkTsUploader *pTsUploader, const struct iovec *pVec, int nVecCount);
+        //直接写队列内存，Reserve返回NULL时用Push
+        char *(*Reserve)(LinkTsUploader *pTsUploader, int nDataLen);
+        int(*Commit)(LinkTsUploader *pTsUploader, int nDataLen);
+        //分片的数据已经全部push，剩下的数据发完马上结束上传，不用等pop超时
+        void (*EndSegment)(LinkTsUploader *pTsUploader);
+        //每帧mux之前调用，nTsSize是估计的ts长度。返回0表示这一帧整个丢掉
+        int (*AdmitFrame)(LinkTsUploader *pTsUploader, LinkFrameType frameType, int nTsSize);
         void (*GetStatInfo)(LinkTsUploader *pTsUploader, LinkUploaderStatInfo *pStatInfo);
         void (*RecordTimestamp)(LinkTsUploader *pTsUploader, int64_t nTimestamp);
+        //fmp4的init segment，拷贝一份，上传分片之前先传它。要在第一次Push之前调用，可以为NULL
+        int (*SetInitSegment)(LinkTsUploader *pTsUploader, const char *pData, int nDataLen);
+        //EndSegment以后在push的线程里调用，不等上传。上传结束后把pAsync交给资源管理线程(交不过去就直接执行)，
+        //这时UploadStop不会再等网络
+        void (*RecycleWhenDone)(LinkTsUploader *pTsUploader, struct _LinkAsyncInterface *pAsync);
 }LinkTsUploader;
 
 
 int LinkNewUploader(LinkTsUploader ** _pUploader, LinkUploadArg *pArg, enum CircleQueuePolicy _policy, int _nMaxItemLen, int _nInitItemCount);
 void LinkDestroyUploader(LinkTsUploader ** _pUploader);
+//之后创建的上传队列内存满了写到pDir下的文件，每个队列最多nSize字节，文件在分片之间复用。pDir为NULL不写磁盘。
+//写过磁盘的分片上传再慢也不断开，完全不动60秒才断开
+int LinkSetUploaderSpill(const char *pDir, int nSize);
+//上传线程池，要在LinkStartUploaderPool之前设置。没有启动时分片直接算上传失败
+int LinkSetUploaderPool(int nWorkerCount, int nPendingCount, int nStackSize, LinkUploadBusyPolicy busyPolicy);
+int LinkStartUploaderPool();
+//每个LinkTsMuxUploader创建/销毁时调用一次，LINK_UPLOAD_BUSY_WAIT按流数定线程数
+void LinkAddUploaderStream();
+void LinkRemoveUploaderStream();
+//排队的分片传完才返回
+void LinkStopUploaderPool();
 
 #endif